@@ -0,0 +1,244 @@
+/*
+* PackageLicenseDeclared: Apache-2.0
+* Copyright (c) 2017 ARM Limited
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*     http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+
+/**
+ * Micro benchmarks for the kernels on the fragmentation path (fota-replay -B)
+ */
+
+#include "benchmarks.h"
+#include "FragmentationXor.h"
+#include "FragmentationParityRows.h"
+#include "AT45BlockDevice.h"
+#include "PageCacheBlockDevice.h"
+#include "PipelinedAT45BlockDevice.h"
+#include "BlockDeviceStreamReader.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+#include <vector>
+
+typedef void (*xor_kernel_t)(uint8_t*, const uint8_t*, size_t);
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * Time per row combine, when recovered rows are built from many fragments (like the decoder does)
+ */
+static double bench_xor(xor_kernel_t kernel, size_t frag_size, const std::vector<uint8_t>& rows, size_t nb_rows) {
+    const size_t nb_dst = 16;
+    std::vector<uint8_t> dst(nb_dst * frag_size, 0);
+    const size_t iterations = 200;
+
+    uint64_t start = now_ns();
+    for (size_t it = 0; it < iterations; it++) {
+        for (size_t row = 0; row < nb_rows; row++) {
+            // +1 so the source rows are not aligned, fragments in a received frame are not either
+            kernel(&dst[(row % nb_dst) * frag_size], &rows[row * frag_size + 1], frag_size);
+        }
+    }
+    uint64_t elapsed = now_ns() - start;
+
+    // keep the result alive
+    volatile uint8_t sink = dst[frag_size / 2];
+    (void)sink;
+
+    return (double)elapsed / (iterations * nb_rows);
+}
+
+static void bench_xor_kernels(FILE* report) {
+    static const size_t frag_sizes[] = { 16, 51, 115, 204, 242 };
+    const size_t nb_rows = 512;
+
+    fprintf(report, "xor kernels (ns per row combine, selected kernel: %s)\n", FRAG_XOR_KERNEL_NAME);
+    fprintf(report, "  FragSize      bytes      words");
+#if defined(__SSE2__)
+    fprintf(report, "       sse2");
+#endif
+#if defined(__AVX2__)
+    fprintf(report, "       avx2");
+#endif
+    fprintf(report, "    speedup\n");
+
+    for (size_t ix = 0; ix < sizeof(frag_sizes) / sizeof(frag_sizes[0]); ix++) {
+        size_t frag_size = frag_sizes[ix];
+
+        std::vector<uint8_t> rows(nb_rows * frag_size + 1);
+        for (size_t b = 0; b < rows.size(); b++) {
+            rows[b] = rand() & 0xff;
+        }
+
+        double bytes = bench_xor(frag_xor_bytes, frag_size, rows, nb_rows);
+        double selected = bench_xor(FRAG_XOR_KERNEL, frag_size, rows, nb_rows);
+
+        fprintf(report, "  %8u %10.1f %10.1f", (unsigned)frag_size, bytes, bench_xor(frag_xor_words, frag_size, rows, nb_rows));
+#if defined(__SSE2__)
+        fprintf(report, " %10.1f", bench_xor(frag_xor_sse2, frag_size, rows, nb_rows));
+#endif
+#if defined(__AVX2__)
+        fprintf(report, " %10.1f", bench_xor(frag_xor_avx2, frag_size, rows, nb_rows));
+#endif
+        fprintf(report, " %9.1fx\n", bytes / selected);
+    }
+}
+
+/**
+ * Cost of the parity rows that RadioEvent::CountRecoverableFragments needs for a FRAG_STATUS_REQ,
+ * generating every row vs. looking them up in FragmentationParityRows after the first request
+ */
+static void bench_parity_rows(FILE* report) {
+    static const uint16_t nb_frags[] = { 100, 500, 1000, 2000, 4000 };
+    const uint16_t nb_rows = MBED_CONF_APP_FRAG_PARITY_ROW_CACHE;
+    const size_t iterations = 100;
+
+    fprintf(report, "parity rows (ns per row, %u redundancy frames)\n", nb_rows);
+    fprintf(report, "    NbFrag   generate     cached    speedup\n");
+
+    for (size_t ix = 0; ix < sizeof(nb_frags) / sizeof(nb_frags[0]); ix++) {
+        uint16_t nb_frag = nb_frags[ix];
+        std::vector<uint8_t> row(FragmentationParityRows::get_row_size(nb_frag));
+        volatile uint8_t sink = 0;
+
+        uint64_t start = now_ns();
+        for (size_t it = 0; it < iterations; it++) {
+            for (uint16_t n = 1; n <= nb_rows; n++) {
+                FragmentationParityRows::generate(n, nb_frag, &row[0]);
+                sink ^= row[0];
+            }
+        }
+        double generate = (double)(now_ns() - start) / (iterations * nb_rows);
+
+        FragmentationParityRows rows(nb_frag, nb_rows);
+        rows.initialize();
+        for (uint16_t n = 1; n <= nb_rows; n++) {
+            rows.get(n);
+        }
+
+        start = now_ns();
+        for (size_t it = 0; it < iterations; it++) {
+            for (uint16_t n = 1; n <= nb_rows; n++) {
+                sink ^= rows.get(n)[0];
+            }
+        }
+        double cached = (double)(now_ns() - start) / (iterations * nb_rows);
+
+        fprintf(report, "  %8u %10.1f %10.1f %9.1fx\n", nb_frag, generate, cached, generate / cached);
+    }
+}
+
+/**
+ * Device time of the AT45 timing model since start, in microseconds
+ */
+static double flash_ms_since(uint64_t start_us) {
+    AT45Stats_t* stats = AT45BlockDevice::stats();
+    return (stats->spi_us + stats->busy_us - start_us) / 1000.0;
+}
+
+static uint64_t flash_us() {
+    return AT45BlockDevice::stats()->spi_us + AT45BlockDevice::stats()->busy_us;
+}
+
+/**
+ * Program an image fragment by fragment, like the Rx path does, with the time it takes to receive the next
+ * downlink in between (a 51 byte downlink at SF7 takes about 100 ms)
+ *
+ * @returns Device ms the caller waited for the flash
+ */
+static double store_fragments(BlockDevice* bd, const std::vector<uint8_t>& image, size_t frag_size) {
+    const uint32_t frame_interval_us = 50000;
+
+    uint64_t start = flash_us();
+    for (size_t offset = 0; offset < image.size(); offset += frag_size) {
+        size_t length = image.size() - offset < frag_size ? image.size() - offset : frag_size;
+        bd->program(&image[offset], offset, length);
+        mbed_virtual_time_us() += frame_interval_us;
+    }
+    bd->sync();
+    return flash_ms_since(start);
+}
+
+/**
+ * What the flash costs on the device (AT45 timing model, not the host): storing the fragments of a
+ * session directly and through the page cache (through the driver, and pipelined through the two SRAM
+ * buffers of the chip with PipelinedAT45BlockDevice), and reading the session back for the hashes
+ */
+static void bench_flash(FILE* report) {
+    static const uint8_t frag_sizes[] = { 51, 204, 132 };
+    const size_t image_size = 64 * 1024;
+
+    bool timing_was_enabled = AT45BlockDevice::is_timing_enabled();
+    AT45BlockDevice::set_timing(AT45BlockDevice::get_default_timing());
+
+    AT45BlockDevice at45;
+    at45.init();
+    bd_size_t page_size = at45.get_read_size();
+
+    fprintf(report, "flash, %u KiB session (device ms waiting for the flash, AT45 timing model with %u byte pages)\n",
+        (unsigned)(image_size / 1024), (unsigned)page_size);
+    fprintf(report, "  FragSize     direct page cache  pipelined  read back      erase\n");
+
+    std::vector<uint8_t> image(image_size);
+    for (size_t b = 0; b < image.size(); b++) {
+        image[b] = rand() & 0xff;
+    }
+
+    for (size_t ix = 0; ix < sizeof(frag_sizes) / sizeof(frag_sizes[0]); ix++) {
+        size_t frag_size = frag_sizes[ix];
+
+        double direct = store_fragments(&at45, image, frag_size);
+
+        PageCacheBlockDevice cache(&at45);
+        cache.init();
+        double cached = store_fragments(&cache, image, frag_size);
+
+        PipelinedAT45BlockDevice pipelined_at45(&at45, true);
+        pipelined_at45.init();
+        PageCacheBlockDevice pipelined_cache(&pipelined_at45);
+        pipelined_cache.init();
+        double pipelined = store_fragments(&pipelined_cache, image, frag_size);
+
+        BlockDeviceStreamReader reader(&at45, 0, image_size);
+        reader.initialize();
+        uint64_t start = flash_us();
+        const uint8_t* chunk;
+        while (reader.next(&chunk) > 0) {
+        }
+        double read_back = flash_ms_since(start);
+
+        start = flash_us();
+        at45.erase(0, (image_size + page_size - 1) / page_size * page_size);
+        double erase = flash_ms_since(start);
+
+        fprintf(report, "  %8u %10.1f %10.1f %10.1f %10.1f %10.1f\n", (unsigned)frag_size, direct, cached, pipelined, read_back, erase);
+    }
+
+    if (!timing_was_enabled) {
+        AT45BlockDevice::set_timing(NULL);
+    }
+}
+
+void run_benchmarks(FILE* report) {
+    srand(1);
+
+    bench_xor_kernels(report);
+    bench_parity_rows(report);
+    bench_flash(report);
+}
@@ -0,0 +1,29 @@
+/*
+* PackageLicenseDeclared: Apache-2.0
+* Copyright (c) 2017 ARM Limited
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*     http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+
+#ifndef __BENCHMARKS_H__
+#define __BENCHMARKS_H__
+
+#include <stdio.h>
+
+/**
+ * Run the micro benchmarks of the fragmentation kernels and of the flash (AT45 timing model), and write the results to report
+ */
+void run_benchmarks(FILE* report);
+
+#endif
@@ -0,0 +1,152 @@
+/*
+* PackageLicenseDeclared: Apache-2.0
+* Copyright (c) 2017 ARM Limited
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*     http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+/**
+ * malloc wrappers that feed mbed_stats_heap_get() on the host.
+ *
+ * The replay harness calls heap_stats_arm() just before it hands the first MAC command to
+ * RadioEvent, so allocations made by the C library and the harness itself are not counted.
+ * When a heap budget is set, allocations that would go over it fail, like they would on the xDot.
+ */
+
+#include <malloc.h>
+#include <string.h>
+#include "mbed_stats.h"
+#include "heap_stats.h"
+
+extern "C" {
+    void* __libc_malloc(size_t size);
+    void  __libc_free(void* ptr);
+}
+
+static mbed_stats_heap_t heap_stats;
+static size_t heap_budget = 0;
+static bool armed = false;
+
+// every block carries a header; blocks allocated while armed are tagged so that freeing
+// something allocated before arming does not corrupt the counters
+static const uint32_t TRACKED_MAGIC = 0x48454150;
+
+typedef struct {
+    size_t size;
+    uint32_t magic;
+    uint32_t padding;
+} block_header_t;
+
+static void* track(void* raw, size_t size) {
+    if (raw == NULL) {
+        heap_stats.alloc_fail_cnt++;
+        return NULL;
+    }
+
+    block_header_t* hdr = (block_header_t*)raw;
+    hdr->size = size;
+    hdr->magic = armed ? TRACKED_MAGIC : 0;
+
+    if (armed) {
+        heap_stats.current_size += size;
+        heap_stats.total_size += size;
+        heap_stats.alloc_cnt++;
+        if (heap_stats.current_size > heap_stats.max_size) {
+            heap_stats.max_size = heap_stats.current_size;
+        }
+    }
+
+    return hdr + 1;
+}
+
+static bool over_budget(size_t size) {
+    return armed && heap_budget != 0 && heap_stats.current_size + size > heap_budget;
+}
+
+static void untrack(block_header_t* hdr) {
+    if (hdr->magic == TRACKED_MAGIC) {
+        heap_stats.current_size -= hdr->size;
+        heap_stats.alloc_cnt--;
+        hdr->magic = 0;
+    }
+}
+
+extern "C" void* malloc(size_t size) {
+    if (over_budget(size)) {
+        heap_stats.alloc_fail_cnt++;
+        return NULL;
+    }
+    return track(__libc_malloc(size + sizeof(block_header_t)), size);
+}
+
+extern "C" void free(void* ptr) {
+    if (ptr == NULL) return;
+
+    block_header_t* hdr = (block_header_t*)ptr - 1;
+    untrack(hdr);
+    __libc_free(hdr);
+}
+
+extern "C" void* calloc(size_t nmemb, size_t size) {
+    void* ptr = malloc(nmemb * size);
+    if (ptr) {
+        memset(ptr, 0, nmemb * size);
+    }
+    return ptr;
+}
+
+extern "C" void* realloc(void* ptr, size_t size) {
+    if (ptr == NULL) return malloc(size);
+
+    block_header_t* old_hdr = (block_header_t*)ptr - 1;
+    void* new_ptr = malloc(size);
+    if (new_ptr == NULL) return NULL;
+
+    memcpy(new_ptr, ptr, old_hdr->size < size ? old_hdr->size : size);
+    free(ptr);
+    return new_ptr;
+}
+
+// the header keeps malloc's 16 byte alignment, which is all the code under test asks for
+extern "C" int posix_memalign(void** memptr, size_t alignment, size_t size) {
+    *memptr = malloc(size);
+    return *memptr ? 0 : 12 /* ENOMEM */;
+}
+
+extern "C" void* aligned_alloc(size_t alignment, size_t size) {
+    return malloc(size);
+}
+
+extern "C" void* memalign(size_t alignment, size_t size) {
+    return malloc(size);
+}
+
+extern "C" size_t malloc_usable_size(void* ptr) {
+    return ptr ? ((block_header_t*)ptr - 1)->size : 0;
+}
+
+void mbed_stats_heap_get(mbed_stats_heap_t *stats) {
+    memcpy(stats, &heap_stats, sizeof(mbed_stats_heap_t));
+}
+
+void heap_stats_arm(size_t budget) {
+    memset(&heap_stats, 0, sizeof(heap_stats));
+    heap_budget = budget;
+    // without a budget, report a heap that is large enough for anything
+    heap_stats.reserved_size = budget ? budget : 0x7fffffff;
+    armed = true;
+}
+
+void heap_stats_disarm() {
+    armed = false;
+}
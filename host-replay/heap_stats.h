@@ -0,0 +1,35 @@
+/*
+* PackageLicenseDeclared: Apache-2.0
+* Copyright (c) 2017 ARM Limited
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*     http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#ifndef __HEAP_STATS_H__
+#define __HEAP_STATS_H__
+
+#include <stddef.h>
+
+/**
+ * Start counting allocations from zero
+ *
+ * @param budget Size of the emulated heap in bytes, allocations beyond it fail. 0 means unlimited.
+ */
+void heap_stats_arm(size_t budget);
+
+/**
+ * Stop counting allocations
+ */
+void heap_stats_disarm();
+
+#endif
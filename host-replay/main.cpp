@@ -0,0 +1,950 @@
+/*
+* PackageLicenseDeclared: Apache-2.0
+* Copyright (c) 2017 ARM Limited
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*     http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+/**
+ * Host replay harness for the fragmentation path of RadioEvent.
+ *
+ * Generates (or reads from a file) one or more FRAG_SESSION_SETUP_REQs followed by a stream of
+ * DATA_FRAGMENT messages (interleaved when there are multiple sessions), drops frames according to a loss pattern, and feeds the rest to
+ * RadioEvent::MacEvent exactly like the LoRaMAC would. Afterwards it reports per-frame processing
+ * time, heap usage and flash operations, and verifies the reconstructed image.
+ */
+
+#include "mbed.h"
+#include "RadioEvent.h"
+#include "heap_stats.h"
+#include "benchmarks.h"
+#include "FragmentationXor.h"
+#include "FragmentationParityRows.h"
+#include <ctype.h>
+#include <getopt.h>
+#include <algorithm>
+
+typedef struct {
+    uint8_t port;
+    std::vector<uint8_t> data;
+} ReplayFrame_t;
+
+typedef struct {
+    uint16_t nb_frag;
+    uint8_t frag_size;
+    uint8_t padding;
+    uint16_t redundancy;
+    uint8_t sessions;           // number of concurrent sessions, session 0 is the firmware
+    float loss;                 // probability (0..1) that a frame is lost
+    float burst;                // mean length of a loss burst, 1 means independent losses
+    std::vector<uint16_t> drop; // frame counters that are always dropped
+    uint32_t seed;
+    size_t heap_budget;
+    uint32_t interval_us;       // time between frames, 0 means wait for every frame to be processed
+    uint16_t reset_frame;       // simulate a reset after this frame counter, 0 means no reset
+    bool repair;                // repair incomplete sessions with unicast fragments after the stream
+    bool adopt_geometry;        // use the FragSize the device prefers in FRAG_SESSION_SETUP_ANS
+    uint8_t decoder_mode;       // FRAG_DECODER_* for all sessions
+    const char* replay_file;
+    bool timing;                // model the timing of the AT45
+    bool erase_ahead;           // erase the flash for session 0 after its setup, like during TimeToStart
+    bool delta;                 // send session 0 as a diff against an old firmware in flash
+    bool verbose;
+} ReplayOpts_t;
+
+static RadioEvent* radio_events;
+
+// set from the Rx worker thread when the application sends DATA_BLOCK_AUTH_REQ
+static volatile bool session_complete = false;
+static volatile uint8_t sessions_complete = 0;     // bit per FragSession index
+static uint8_t sessions_expected = 1;
+static uint64_t auth_req_crc[FRAG_SESSION_MAX];
+static std::vector<uint8_t> status_ans[FRAG_SESSION_MAX];    // last FRAG_STATUS_ANS per session
+static std::vector<uint8_t> telemetry[FRAG_SESSION_MAX];     // FRAG_TELEMETRY per session
+static std::vector<uint8_t> flash_stats[FRAG_SESSION_MAX];   // FLASH_STATS per session
+static std::vector<uint8_t> frag_geometry[FRAG_SESSION_MAX]; // last FRAG_GEOMETRY per session
+static std::vector<uint8_t> ram_blocks[FRAG_SESSION_MAX];    // data blocks passed to the data block callback
+static bool delta_ready = false;                            // the diff was patched when session 0 completed
+static bd_size_t delta_applied = 0;                         // or this many bytes of it
+
+static void send_msg(uint8_t port, std::vector<uint8_t>* data) {
+    if (data->size() == DATA_BLOCK_AUTH_REQ_LENGTH && data->at(0) == DATA_BLOCK_AUTH_REQ) {
+        uint8_t index = data->at(1) & 0x03;
+        memcpy(&auth_req_crc[index], &data->at(2), sizeof(uint64_t));
+        sessions_complete |= 1 << index;
+
+        if (index == 0) {
+            delta_ready = radio_events->GetDeltaPatch()->is_complete();
+            delta_applied = radio_events->GetDeltaPatch()->get_diff_offset();
+        }
+        session_complete = sessions_complete == (1 << sessions_expected) - 1;
+    }
+    if (data->size() >= FRAG_STATUS_ANS_LENGTH && data->at(0) == FRAG_STATUS_ANS) {
+        status_ans[data->at(2) >> 6] = *data;
+    }
+    if (data->size() == FRAG_GEOMETRY_LENGTH && data->at(0) == FRAG_GEOMETRY) {
+        frag_geometry[data->at(1) & 0x03] = *data;
+    }
+    if (data->size() == FRAG_TELEMETRY_HEADER_LENGTH + FRAG_TELEMETRY_SIZE && data->at(0) == FRAG_TELEMETRY) {
+        telemetry[data->at(1) & 0x03] = *data;
+    }
+    if (data->size() == FLASH_STATS_HEADER_LENGTH + INSTRUMENTED_BD_STATS_SIZE && data->at(0) == FLASH_STATS) {
+        flash_stats[data->at(1) & 0x03] = *data;
+    }
+    delete data;
+}
+
+static void class_switch(char cls) {
+}
+
+static void data_block(uint8_t index, const uint8_t* data, size_t size) {
+    ram_blocks[index].assign(data, data + size);
+}
+
+static uint32_t rng_state;
+
+static uint32_t rng_next() {
+    // xorshift32, so the loss pattern for a seed is the same on every machine
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 17;
+    rng_state ^= rng_state << 5;
+    return rng_state;
+}
+
+static float rng_float() {
+    return (rng_next() & 0xffffff) / (float)0x1000000;
+}
+
+// separate from rng_state, so the RSSI and SNR don't change the loss pattern of a seed
+static uint32_t link_state = 1;
+
+static int link_noise(int range) {
+    link_state ^= link_state << 13;
+    link_state ^= link_state >> 17;
+    link_state ^= link_state << 5;
+    return (int)(link_state % (2 * range + 1)) - range;
+}
+
+/**
+ * Reference CRC64 (Jones polynomial, reflected), bit by bit
+ */
+static uint64_t crc64(const std::vector<uint8_t>& data) {
+    uint64_t crc = 0;
+    for (size_t ix = 0; ix < data.size(); ix++) {
+        crc ^= data[ix];
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc & 1) ? (crc >> 1) ^ 0x95AC9329AC4BC9B5ULL : crc >> 1;
+        }
+    }
+    return crc;
+}
+
+/**
+ * Length of an EQL, DEL or BKT in the diff
+ */
+static void put_delta_length(std::vector<uint8_t>& diff, uint32_t length) {
+    if (length <= 252) {
+        diff.push_back(length - 1);
+    }
+    else if (length <= 508) {
+        diff.push_back(252);
+        diff.push_back(length - 253);
+    }
+    else if (length <= 0xffff) {
+        diff.push_back(253);
+        diff.push_back(length >> 8);
+        diff.push_back(length & 0xff);
+    }
+    else {
+        diff.push_back(254);
+        diff.push_back(length >> 24);
+        diff.push_back(length >> 16 & 0xff);
+        diff.push_back(length >> 8 & 0xff);
+        diff.push_back(length & 0xff);
+    }
+}
+
+/**
+ * A MOD or INS with its data. Like jdiff, an ESC in the data that is followed by an opcode, another
+ * ESC or the next operation is written twice.
+ */
+static void put_delta_data(std::vector<uint8_t>& diff, uint8_t op, const std::vector<uint8_t>& data) {
+    diff.push_back(DELTA_PATCH_ESC);
+    diff.push_back(op);
+
+    for (size_t ix = 0; ix < data.size(); ix++) {
+        diff.push_back(data[ix]);
+
+        if (data[ix] == DELTA_PATCH_ESC && (ix + 1 == data.size() || (data[ix + 1] >= DELTA_PATCH_BKT && data[ix + 1] <= DELTA_PATCH_ESC))) {
+            diff.push_back(DELTA_PATCH_ESC);
+        }
+    }
+}
+
+/**
+ * Make a new firmware from an old one with random edits, and the diff between them in the format of
+ * janpatch (JojoDiff): copied, replaced, inserted and deleted runs, and jumps back in the old firmware.
+ * The data contains ESC and opcodes more often than random data, so their escapes are tested.
+ */
+static void generate_delta(size_t size, std::vector<uint8_t>& old_fw, std::vector<uint8_t>& new_fw, std::vector<uint8_t>& diff) {
+    old_fw.resize(size);
+    for (size_t ix = 0; ix < size; ix++) {
+        old_fw[ix] = rng_next() & 0xff;
+    }
+
+    size_t pos = 0;
+    while (new_fw.size() < size) {
+        uint32_t op = rng_next() % 10;
+        size_t remaining = size - pos;
+        // the new firmware is as large as the old one, so it fits the slot it is patched into
+        size_t room = size - new_fw.size();
+        if (remaining > room) remaining = room;
+
+        if (op < 5 && remaining > 0) {
+            // mostly short runs, now and then one that needs a long length
+            uint32_t max_length = rng_next() % 64 == 0 ? 100000 : 256;
+            uint32_t length = 1 + rng_next() % (remaining < max_length ? remaining : max_length);
+            diff.push_back(DELTA_PATCH_ESC);
+            diff.push_back(DELTA_PATCH_EQL);
+            put_delta_length(diff, length);
+            new_fw.insert(new_fw.end(), old_fw.begin() + pos, old_fw.begin() + pos + length);
+            pos += length;
+        }
+        else if (op < 8) {
+            // MOD replaces as many bytes of the old firmware as it has, INS does not use them
+            bool mod = op < 7 && remaining > 0;
+            size_t max_length = mod ? remaining : room;
+            std::vector<uint8_t> data(1 + rng_next() % (max_length < 64 ? max_length : 64));
+            for (size_t ix = 0; ix < data.size(); ix++) {
+                data[ix] = rng_next() % 8 == 0 ? DELTA_PATCH_BKT + rng_next() % 6 : rng_next() & 0xff;
+            }
+            put_delta_data(diff, mod ? DELTA_PATCH_MOD : DELTA_PATCH_INS, data);
+            new_fw.insert(new_fw.end(), data.begin(), data.end());
+            if (mod) pos += data.size();
+        }
+        else if (op < 9 && remaining > 0) {
+            uint32_t length = 1 + rng_next() % (remaining < 256 ? remaining : 256);
+            diff.push_back(DELTA_PATCH_ESC);
+            diff.push_back(DELTA_PATCH_DEL);
+            put_delta_length(diff, length);
+            pos += length;
+        }
+        else if (pos > 0) {
+            uint32_t length = 1 + rng_next() % (pos < 1024 ? pos : 1024);
+            diff.push_back(DELTA_PATCH_ESC);
+            diff.push_back(DELTA_PATCH_BKT);
+            put_delta_length(diff, length);
+            pos -= length;
+        }
+    }
+}
+
+/**
+ * Make session 0 a firmware diff: put an old firmware where the bootloader keeps a copy of the
+ * running one, and replace the image with an update package (a header that says it is a diff, and
+ * the diff). The session is sized to the package.
+ */
+static void make_delta_package(ReplayOpts_t& opts, std::vector<uint8_t>& image, std::vector<uint8_t>& new_fw) {
+    std::vector<uint8_t> old_fw;
+    std::vector<uint8_t> diff;
+
+    AT45BlockDevice at45;
+    at45.init();
+    size_t size = image.size();
+    size_t slot_size = (size_t)(FOTA_DIFF_TARGET_PAGE - FOTA_DIFF_OLD_FW_PAGE) * at45.get_read_size();
+    generate_delta(size < slot_size ? size : slot_size, old_fw, new_fw, diff);
+    at45.program(&old_fw[0], (bd_addr_t)FOTA_DIFF_OLD_FW_PAGE * at45.get_read_size(), old_fw.size());
+
+    UpdateSignature_t header;
+    memset(&header, 0, sizeof(header));
+    uint8_t* diff_info = (uint8_t*)&header.diff_info;
+    diff_info[0] = 1;
+    diff_info[1] = old_fw.size() >> 16 & 0xff;
+    diff_info[2] = old_fw.size() >> 8 & 0xff;
+    diff_info[3] = old_fw.size() & 0xff;
+
+    image.assign((uint8_t*)&header, (uint8_t*)&header + sizeof(header));
+    image.insert(image.end(), diff.begin(), diff.end());
+
+    opts.nb_frag = (image.size() + opts.frag_size - 1) / opts.frag_size;
+    opts.padding = opts.nb_frag * opts.frag_size - image.size();
+}
+
+/**
+ * Wait until the diff in session 0 is patched, which continues between frames (and after the
+ * session completed) when fragments were lost
+ */
+static bool wait_delta_patch() {
+    const DeltaPatchStream* patch = radio_events->GetDeltaPatch();
+    for (uint32_t waited = 0; waited < 60000 && !patch->is_complete() && patch->get_error() == BD_ERROR_OK; waited++) {
+        usleep(1000);
+    }
+
+    // after the last step the worker puts the flash back in deep power-down
+    for (uint32_t waited = 0; waited < 100 && MBED_CONF_APP_FLASH_POWER_DOWN && !radio_events->IsFlashPoweredDown(); waited++) {
+        usleep(1000);
+    }
+    return patch->is_complete();
+}
+
+static void push_frame(std::vector<ReplayFrame_t>& frames, uint8_t port, const std::vector<uint8_t>& data) {
+    ReplayFrame_t f;
+    f.port = port;
+    f.data = data;
+    frames.push_back(f);
+}
+
+static std::vector<uint8_t> setup_request(const ReplayOpts_t& opts, uint8_t index) {
+    std::vector<uint8_t> setup;
+    setup.push_back(FRAG_SESSION_SETUP_REQ);
+    setup.push_back(index << 4);                    // FragSession
+    setup.push_back(opts.nb_frag & 0xff);
+    setup.push_back(opts.nb_frag >> 8 & 0xff);
+    setup.push_back(opts.frag_size);
+    setup.push_back(0x00);                          // Encoding
+    setup.push_back(opts.padding);
+    return setup;
+}
+
+static void generate_stream(const ReplayOpts_t& opts, const std::vector<std::vector<uint8_t> >& images, std::vector<ReplayFrame_t>& frames) {
+    for (uint8_t index = 0; index < opts.sessions; index++) {
+        push_frame(frames, 201, setup_request(opts, index));
+    }
+
+    std::vector<std::vector<uint8_t> > padded(images);
+    for (uint8_t index = 0; index < opts.sessions; index++) {
+        padded[index].resize(opts.nb_frag * opts.frag_size, 0);
+    }
+
+    // the sessions have the same shape, so the parity row of a frame counter is generated once for all of them
+    std::vector<uint8_t> row(FragmentationParityRows::get_row_size(opts.nb_frag));
+
+    for (uint32_t ix = 0; ix < (uint32_t)(opts.nb_frag + opts.redundancy) * opts.sessions; ix++) {
+        uint16_t fc = ix / opts.sessions + 1;
+        uint8_t index = ix % opts.sessions;
+        uint16_t index_and_n = (index << 14) | fc;
+
+        std::vector<uint8_t> frame;
+        frame.push_back(DATA_FRAGMENT);
+        frame.push_back(index_and_n & 0xff);
+        frame.push_back(index_and_n >> 8 & 0xff);
+
+        if (fc <= opts.nb_frag) {
+            frame.insert(frame.end(), padded[index].begin() + (fc - 1) * opts.frag_size, padded[index].begin() + fc * opts.frag_size);
+        }
+        else {
+            if (index == 0) {
+                FragmentationParityRows::generate(fc - opts.nb_frag, opts.nb_frag, &row[0]);
+            }
+
+            std::vector<uint8_t> parity(opts.frag_size, 0);
+            for (uint16_t frag = 1; frag <= opts.nb_frag; frag++) {
+                if (!FragmentationParityRows::get_bit(&row[0], frag)) continue;
+                frag_xor(&parity[0], &padded[index][(frag - 1) * opts.frag_size], opts.frag_size);
+            }
+            frame.insert(frame.end(), parity.begin(), parity.end());
+        }
+
+        push_frame(frames, 201, frame);
+    }
+}
+
+/**
+ * Reads a recorded stream, one message per line as hex (e.g. copied from the 'Rx data' log),
+ * optionally prefixed with the port ("200: 02 00 ..."). Lines starting with # are ignored.
+ */
+static bool load_stream(const char* path, std::vector<ReplayFrame_t>& frames) {
+    FILE* f = fopen(path, "r");
+    if (!f) {
+        fprintf(stderr, "Could not open %s\n", path);
+        return false;
+    }
+
+    char line[1024];
+    while (fgets(line, sizeof(line), f)) {
+        if (line[0] == '#') continue;
+
+        char* p = line;
+        uint8_t port = 201;
+        char* colon = strchr(line, ':');
+        if (colon) {
+            port = (uint8_t)strtoul(line, NULL, 10);
+            p = colon + 1;
+        }
+
+        std::vector<uint8_t> data;
+        while (*p) {
+            while (*p == ' ' || *p == '\t') p++;
+            if (!isxdigit((unsigned char)p[0]) || !isxdigit((unsigned char)p[1])) break;
+
+            char byte[3] = { p[0], p[1], 0 };
+            data.push_back((uint8_t)strtoul(byte, NULL, 16));
+            p += 2;
+        }
+
+        if (data.size() > 0) {
+            push_frame(frames, port, data);
+        }
+    }
+
+    fclose(f);
+    return true;
+}
+
+static bool is_dropped(const ReplayOpts_t& opts, const ReplayFrame_t& frame, bool* in_burst) {
+    if (frame.port != 201 || frame.data[0] != DATA_FRAGMENT) return false;
+
+    uint16_t fc = ((frame.data[2] << 8) + frame.data[1]) & 0x3fff;
+    if (std::find(opts.drop.begin(), opts.drop.end(), fc) != opts.drop.end()) return true;
+
+    if (opts.loss <= 0.0f) return false;
+
+    // Gilbert model, mean burst length opts.burst and overall loss rate opts.loss
+    float p_leave_burst = 1.0f / opts.burst;
+    float p_enter_burst = opts.loss * p_leave_burst / (1.0f - opts.loss);
+
+    if (*in_burst) {
+        *in_burst = rng_float() >= p_leave_burst;
+    }
+    else {
+        *in_burst = rng_float() < p_enter_burst;
+    }
+    return *in_burst;
+}
+
+/**
+ * Deliver a downlink to the application, like the LoRaMAC does
+ */
+static void mac_event(uint8_t port, std::vector<uint8_t>& data) {
+    LoRaMacEventFlags flags;
+    flags.Value = 0;
+    flags.Bits.Rx = 1;
+    flags.Bits.RxData = 1;
+
+    LoRaMacEventInfo info;
+    memset(&info, 0, sizeof(info));
+    info.Status = LORAMAC_EVENT_INFO_STATUS_OK;
+    info.RxPort = port;
+    info.RxBuffer = &data[0];
+    info.RxBufferSize = data.size();
+    info.RxRssi = -100 + link_noise(12);
+    info.RxSnr = -2 + link_noise(8);
+
+    radio_events->MacEvent(&flags, &info);
+}
+
+/**
+ * After the multicast window: ask every incomplete session for its missing fragments with FRAG_STATUS_REQ,
+ * and send those as unicast downlinks, until all sessions are complete or nothing is missing anymore
+ */
+static void repair_sessions(const ReplayOpts_t& opts, const std::vector<std::vector<uint8_t> >& images,
+                            uint32_t* status_requests, uint32_t* repair_fragments) {
+    radio_events->switchedToClassA();
+
+    for (int round = 0; round < 50 && !session_complete; round++) {
+        bool progress = false;
+
+        for (uint8_t index = 0; index < opts.sessions; index++) {
+            if (sessions_complete & (1 << index)) continue;
+
+            std::vector<uint8_t> req;
+            req.push_back(FRAG_STATUS_REQ);
+            req.push_back((index << 1) | FRAG_STATUS_REQ_ALL_PARTICIPANTS);
+
+            status_ans[index].clear();
+            mac_event(201, req);
+            radio_events->WaitForRxIdle(60000);
+            (*status_requests)++;
+
+            const std::vector<uint8_t>& ans = status_ans[index];
+            for (size_t ix = FRAG_STATUS_ANS_LENGTH; ix + 3 <= ans.size(); ix += 3) {
+                uint16_t start = ans[ix] + ((ans[ix + 1] & 0x3f) << 8);
+                uint16_t length = ans[ix + 2] + 1;
+
+                for (uint16_t fc = start; fc < start + length && !(sessions_complete & (1 << index)); fc++) {
+                    std::vector<uint8_t> frame;
+                    uint16_t index_and_n = (index << 14) | fc;
+                    frame.push_back(DATA_FRAGMENT);
+                    frame.push_back(index_and_n & 0xff);
+                    frame.push_back(index_and_n >> 8 & 0xff);
+
+                    for (uint8_t b = 0; b < opts.frag_size; b++) {
+                        size_t offset = (fc - 1) * opts.frag_size + b;
+                        frame.push_back(offset < images[index].size() ? images[index][offset] : 0);
+                    }
+
+                    mac_event(201, frame);
+                    radio_events->WaitForRxIdle(60000);
+                    (*repair_fragments)++;
+                    progress = true;
+                }
+            }
+        }
+
+        if (!progress) break;
+    }
+}
+
+static uint64_t now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000 + mbed_virtual_time_us();
+}
+
+/**
+ * Erase the flash for the firmware session after it was set up, and wait until that is done. On the
+ * device this happens between MC_CLASSC_SESSION_REQ and the switch to Class C.
+ */
+static void run_erase_ahead(FILE* report) {
+    radio_events->WaitForRxIdle(60000);
+
+    uint64_t start = now_us();
+    if (!radio_events->StartEraseAhead()) {
+        fprintf(report, "erase ahead not started\n");
+        return;
+    }
+
+    const FlashEraseAhead* erase_ahead = radio_events->GetEraseAhead();
+    while (erase_ahead->is_running()) {
+        usleep(100);
+    }
+
+    fprintf(report, "erase ahead %lu bytes %s in %llu us\n", (unsigned long)erase_ahead->get_erased(),
+        erase_ahead->is_ready() ? "ready" : "FAILED", (unsigned long long)(now_us() - start));
+}
+
+static void print_latency(FILE* report, const char* name, const std::vector<uint64_t>& latencies) {
+    if (latencies.size() == 0) return;
+
+    std::vector<uint64_t> sorted(latencies);
+    std::sort(sorted.begin(), sorted.end());
+    uint64_t sum = 0;
+    for (size_t ix = 0; ix < sorted.size(); ix++) sum += sorted[ix];
+
+    fprintf(report, "%s min %llu us, avg %llu us, p50 %llu us, p99 %llu us, max %llu us\n",
+        name,
+        (unsigned long long)sorted[0],
+        (unsigned long long)(sum / sorted.size()),
+        (unsigned long long)sorted[sorted.size() / 2],
+        (unsigned long long)sorted[(sorted.size() * 99) / 100],
+        (unsigned long long)sorted[sorted.size() - 1]);
+}
+
+static void parse_drop_list(const char* arg, std::vector<uint16_t>& drop) {
+    // comma separated list of frame counters and ranges, e.g. 3,7,12-20
+    const char* p = arg;
+    while (*p) {
+        char* end;
+        unsigned long from = strtoul(p, &end, 10);
+        if (end == p) break;
+
+        unsigned long to = from;
+        if (*end == '-') {
+            to = strtoul(end + 1, &end, 10);
+        }
+        for (unsigned long fc = from; fc <= to; fc++) {
+            drop.push_back((uint16_t)fc);
+        }
+        p = (*end == ',') ? end + 1 : end;
+    }
+}
+
+/**
+ * Start the application like main() in the firmware does, after a boot or a reset
+ */
+static RadioEvent* create_radio_events(const ReplayOpts_t& opts) {
+    RadioEvent* events = new RadioEvent(&send_msg, &class_switch);
+    events->SetDataBlockCallback(&data_block);
+    for (uint8_t index = 0; index < FRAG_SESSION_MAX; index++) {
+        events->SetFragDecoderMode(index, opts.decoder_mode);
+    }
+    events->ResumeFragSessions();
+    return events;
+}
+
+/**
+ * Set up session 0 and delete it again, like a network server that learns the geometry its devices
+ * prefer from FRAG_GEOMETRY, and fragment the images with the preferred FragSize
+ */
+static void adopt_geometry(ReplayOpts_t& opts, size_t image_size, FILE* report) {
+    radio_events = create_radio_events(opts);
+
+    std::vector<uint8_t> setup = setup_request(opts, 0);
+    mac_event(201, setup);
+    radio_events->WaitForRxIdle(60000);
+
+    std::vector<uint8_t> del;
+    del.push_back(FRAG_SESSION_DELETE_REQ);
+    del.push_back(0);
+    mac_event(201, del);
+    radio_events->WaitForRxIdle(60000);
+
+    // only sent when the FragSize does not tile the pages
+    const std::vector<uint8_t>& msg = frag_geometry[0];
+    if (msg.empty()) {
+        fprintf(report, "geometry    FragSize %u tiles the pages\n", opts.frag_size);
+        return;
+    }
+
+    uint8_t frag_size = msg[2];
+    uint16_t page_size = msg[3] | (msg[4] << 8);
+    uint16_t nb_frag = (image_size + frag_size - 1) / frag_size;
+
+    fprintf(report, "geometry    FragSize %u -> %u (%u byte pages), NbFrag %u -> %u\n",
+        opts.frag_size, frag_size, page_size, opts.nb_frag, nb_frag);
+
+    opts.frag_size = frag_size;
+    opts.nb_frag = nb_frag;
+    opts.padding = nb_frag * frag_size - image_size;
+}
+
+static void usage(const char* name) {
+    fprintf(stderr,
+        "Usage: %s [options]\n"
+        "  -n NBFRAG      number of uncoded fragments (default 200)\n"
+        "  -s FRAGSIZE    fragment size in bytes (default 204)\n"
+        "  -p PADDING     padding bytes in the last fragment (default 0)\n"
+        "  -r REDUNDANCY  number of redundancy frames sent (default 40)\n"
+        "  -c SESSIONS    number of concurrent sessions of the same shape, session 0 is the firmware (default 1)\n"
+        "  -l LOSS        frame loss rate in percent (default 0)\n"
+        "  -b BURST       mean loss burst length in frames (default 1)\n"
+        "  -d LIST        always drop these frame counters, e.g. 3,7,12-20\n"
+        "  -S SEED        seed for image content and loss pattern (default 1)\n"
+        "  -H BYTES       emulated heap size, allocations beyond it fail (default unlimited)\n"
+        "  -i US          time between frames in microseconds, instead of waiting for each frame to be processed\n"
+        "  -R FRAME       simulate a reset after this frame counter, and resume from the checkpoints\n"
+        "  -u             repair incomplete sessions with FRAG_STATUS_REQ and unicast fragments after the stream\n"
+        "  -F             decode all sessions in flash (FragmentationFlashDecoder), regardless of the heap\n"
+        "  -g             set up a session first, and send the image with the FragSize the device prefers\n"
+        "  -T             model the timing of the AT45, latencies include the time the device waits for flash\n"
+        "  -e             erase the flash for the firmware session after its setup, like while waiting for Class C\n"
+        "  -D             send the firmware as a diff against an old firmware in flash, and check the patched firmware\n"
+        "  -P PAGESIZE    AT45 page size, 528 or 512 (binary page mode) (default 528)\n"
+        "  -A FILE        keep the flash contents in this file, so they survive the run\n"
+        "  -B             run the micro benchmarks of the fragmentation kernels and the flash instead of a session\n"
+        "  -f FILE        replay a recorded stream instead of generating one\n"
+        "  -v             show the application output\n",
+        name);
+}
+
+int main(int argc, char** argv) {
+    ReplayOpts_t opts;
+    opts.nb_frag = 200;
+    opts.frag_size = 204;
+    opts.padding = 0;
+    opts.redundancy = 40;
+    opts.sessions = 1;
+    opts.loss = 0.0f;
+    opts.burst = 1.0f;
+    opts.seed = 1;
+    opts.heap_budget = 0;
+    opts.interval_us = 0;
+    opts.reset_frame = 0;
+    opts.repair = false;
+    opts.adopt_geometry = false;
+    opts.decoder_mode = FRAG_DECODER_AUTO;
+    opts.replay_file = NULL;
+    opts.timing = false;
+    opts.erase_ahead = false;
+    opts.delta = false;
+    opts.verbose = false;
+
+    int c;
+    while ((c = getopt(argc, argv, "n:s:p:r:c:l:b:d:S:H:i:R:uFgeDTP:A:Bf:vh")) != -1) {
+        switch (c) {
+            case 'n': opts.nb_frag = atoi(optarg); break;
+            case 's': opts.frag_size = atoi(optarg); break;
+            case 'p': opts.padding = atoi(optarg); break;
+            case 'r': opts.redundancy = atoi(optarg); break;
+            case 'c': opts.sessions = atoi(optarg); break;
+            case 'l': opts.loss = atof(optarg) / 100.0f; break;
+            case 'b': opts.burst = atof(optarg); break;
+            case 'd': parse_drop_list(optarg, opts.drop); break;
+            case 'S': opts.seed = strtoul(optarg, NULL, 10); break;
+            case 'H': opts.heap_budget = strtoul(optarg, NULL, 10); break;
+            case 'i': opts.interval_us = strtoul(optarg, NULL, 10); break;
+            case 'R': opts.reset_frame = atoi(optarg); break;
+            case 'u': opts.repair = true; break;
+            case 'F': opts.decoder_mode = FRAG_DECODER_FLASH; break;
+            case 'g': opts.adopt_geometry = true; break;
+            case 'e': opts.erase_ahead = true; break;
+            case 'D': opts.delta = true; break;
+            case 'T': opts.timing = true; break;
+            case 'P':
+                if (atoi(optarg) != AT45_PAGE_SIZE && atoi(optarg) != AT45_BINARY_PAGE_SIZE) {
+                    usage(argv[0]);
+                    return 1;
+                }
+                AT45BlockDevice::set_page_size(atoi(optarg));
+                break;
+            case 'A': AT45BlockDevice::set_backing_file(optarg); break;
+            case 'B': run_benchmarks(stdout); return 0;
+            case 'f': opts.replay_file = optarg; break;
+            case 'v': opts.verbose = true; break;
+            default: usage(argv[0]); return 1;
+        }
+    }
+
+    if (opts.nb_frag == 0 || opts.frag_size == 0 || opts.frag_size > 252 || opts.burst < 1.0f || opts.loss >= 1.0f ||
+            opts.sessions < 1 || opts.sessions > FRAG_SESSION_MAX) {
+        fprintf(stderr, "Invalid options\n");
+        usage(argv[0]);
+        return 1;
+    }
+
+    rng_state = opts.seed ? opts.seed : 1;
+
+    FILE* report = fdopen(dup(STDOUT_FILENO), "w");
+    if (!opts.verbose) {
+        freopen("/dev/null", "w", stdout);
+    }
+
+    std::vector<std::vector<uint8_t> > images(opts.sessions);
+    std::vector<uint8_t> new_fw;
+    std::vector<ReplayFrame_t> frames;
+
+    if (opts.replay_file) {
+        if (!load_stream(opts.replay_file, frames)) return 1;
+    }
+    else {
+        for (uint8_t index = 0; index < opts.sessions; index++) {
+            images[index].resize(opts.nb_frag * opts.frag_size - opts.padding);
+            for (size_t ix = 0; ix < images[index].size(); ix++) {
+                images[index][ix] = rng_next() & 0xff;
+            }
+        }
+        if (opts.delta) {
+            // the package sets the number of fragments of every session
+            make_delta_package(opts, images[0], new_fw);
+            for (uint8_t index = 1; index < opts.sessions; index++) {
+                size_t size = images[index].size();
+                images[index].resize(images[0].size());
+                for (size_t ix = size; ix < images[index].size(); ix++) {
+                    images[index][ix] = rng_next() & 0xff;
+                }
+            }
+        }
+        if (opts.adopt_geometry) {
+            adopt_geometry(opts, images[0].size(), report);
+        }
+        generate_stream(opts, images, frames);
+        sessions_expected = opts.sessions;
+    }
+
+    // time spent in the MAC callback, and time until the frame was fully processed
+    std::vector<uint64_t> callback_latencies;
+    std::vector<uint64_t> process_latencies;
+    callback_latencies.reserve(frames.size());
+    process_latencies.reserve(frames.size());
+    uint64_t completion_latency = 0;
+    int completion_frame = -1;
+    size_t dropped = 0;
+    bool in_burst = false;
+
+    if (opts.timing) {
+        AT45BlockDevice::set_timing(AT45BlockDevice::get_default_timing());
+    }
+    // only the erase ahead gains from a driver that programs erased pages without erasing them again
+    AT45BlockDevice::set_erased_page_program(opts.erase_ahead);
+    AT45BlockDevice::reset_stats();
+    heap_stats_arm(opts.heap_budget);
+
+    radio_events = create_radio_events(opts);
+
+    for (size_t ix = 0; ix < frames.size() && !session_complete; ix++) {
+        ReplayFrame_t& frame = frames[ix];
+
+        if (is_dropped(opts, frame, &in_burst)) {
+            dropped++;
+            continue;
+        }
+
+        bool is_fragment = frame.port == 201 && frame.data[0] == DATA_FRAGMENT;
+        uint16_t fc = is_fragment ? ((frame.data[2] << 8) + frame.data[1]) & 0x3fff : 0;
+
+        uint64_t start = now_us();
+        mac_event(frame.port, frame.data);
+        uint64_t callback_elapsed = now_us() - start;
+
+        if (is_fragment) {
+            callback_latencies.push_back(callback_elapsed);
+        }
+
+        if (opts.erase_ahead && frame.port == 201 && frame.data[0] == FRAG_SESSION_SETUP_REQ && ((frame.data[1] >> 4) & 0x03) == 0) {
+            run_erase_ahead(report);
+        }
+
+        if (opts.interval_us) {
+            usleep(opts.interval_us);
+            continue;
+        }
+
+        radio_events->WaitForRxIdle(60000);
+        uint64_t elapsed = now_us() - start;
+
+        if (opts.reset_frame && fc == opts.reset_frame && !session_complete) {
+            // like a brownout: nothing is cleaned up, and the page cache and parity frames in RAM are lost.
+            // The old instance stays allocated, so its memory still counts in the heap statistics.
+            fprintf(report, "reset       after frame %d\n", fc);
+            opts.reset_frame = 0;
+
+            radio_events = create_radio_events(opts);
+            continue;
+        }
+
+        if (session_complete) {
+            completion_latency = elapsed;
+            completion_frame = frame.data.size() > 2 ? ((frame.data[2] << 8) + frame.data[1]) & 0x3fff : -1;
+        }
+        else if (is_fragment) {
+            process_latencies.push_back(elapsed);
+        }
+    }
+
+    radio_events->WaitForRxIdle(60000);
+
+    uint32_t status_requests = 0;
+    uint32_t repair_fragments = 0;
+    if (opts.repair && !session_complete && !opts.replay_file) {
+        repair_sessions(opts, images, &status_requests, &repair_fragments);
+    }
+
+    if (session_complete && completion_frame < 0) {
+        completion_frame = 0;
+    }
+
+    bool patched = session_complete && !new_fw.empty() && wait_delta_patch();
+
+    mbed_stats_heap_t heap;
+    mbed_stats_heap_get(&heap);
+    heap_stats_disarm();
+
+    AT45Stats_t* flash = AT45BlockDevice::stats();
+
+    fprintf(report, "frames      %u total, %u dropped\n", (unsigned)frames.size(), (unsigned)dropped);
+
+    print_latency(report, "callback   ", callback_latencies);
+    print_latency(report, "processing ", process_latencies);
+
+    const RxFrameQueueStats_t* rx_stats = radio_events->GetRxQueueStats();
+    fprintf(report, "rx queue    %u queued, %u dropped, %u under backpressure, peak depth %u, worker max %u us, worker total %llu us\n",
+        rx_stats->queued, rx_stats->dropped, rx_stats->backpressure, rx_stats->peak_depth,
+        rx_stats->process_us_max, (unsigned long long)rx_stats->process_us_total);
+
+    if (opts.repair) {
+        fprintf(report, "repair      %u status requests, %u unicast fragments\n", status_requests, repair_fragments);
+    }
+
+    if (completion_frame >= 0) {
+        if (completion_latency) {
+            fprintf(report, "completion  at frame %d, %llu us (includes digest catch-up)\n", completion_frame, (unsigned long long)completion_latency);
+        }
+        else {
+            fprintf(report, "completion  reached\n");
+        }
+    }
+    else {
+        fprintf(report, "completion  not reached\n");
+    }
+
+    fprintf(report, "heap        peak %lu bytes, current %lu bytes, %lu failed allocations\n",
+        heap.max_size, heap.current_size, heap.alloc_fail_cnt);
+    fprintf(report, "flash       %u reads (%llu bytes), %u programs (%llu bytes, %u pages, %u partial), %u erases (%llu bytes)\n",
+        flash->reads, (unsigned long long)flash->read_bytes,
+        flash->programs, (unsigned long long)flash->program_bytes, flash->page_programs, flash->partial_page_programs,
+        flash->erases, (unsigned long long)flash->erase_bytes);
+    if (opts.timing) {
+        fprintf(report, "flash time  %llu ms (%llu ms SPI, %llu ms busy, %u status polls, %u erased pages programmed, %u overlapped programs)\n",
+            (unsigned long long)(flash->spi_us + flash->busy_us) / 1000, (unsigned long long)flash->spi_us / 1000,
+            (unsigned long long)flash->busy_us / 1000, flash->status_polls, flash->erased_page_programs,
+            flash->overlapped_programs);
+    }
+    if (flash->busy_accesses) {
+        fprintf(report, "flash busy  %u accesses while the chip was busy\n", flash->busy_accesses);
+    }
+
+    const PowerDownStats_t* power = radio_events->GetFlashPowerStats();
+    fprintf(report, "flash power %u power-downs, %u wake-ups (max %u us, total %llu us), %u accesses in deep power-down, %s at the end\n",
+        power->power_downs, power->wakes, power->wake_us_max, (unsigned long long)power->wake_us_total,
+        flash->powered_down_accesses, radio_events->IsFlashPoweredDown() ? "down" : "up");
+
+    // the chip ignores commands in deep power-down or while it programs, on the device these would have gone missing
+    int ret = completion_frame >= 0 && flash->powered_down_accesses == 0 && flash->busy_accesses == 0 ? 0 : 1;
+
+    for (uint8_t index = 0; completion_frame >= 0 && !opts.replay_file && index < opts.sessions; index++) {
+        const std::vector<uint8_t>& image = images[index];
+        std::vector<uint8_t> stored(image.size());
+        AT45BlockDevice at45;
+        at45.init();
+        at45.read(&stored[0], radio_events->GetFragSessionAddress(index), stored.size());
+
+        // small data blocks are only delivered in RAM
+        bool in_ram = !ram_blocks[index].empty();
+        if (in_ram) {
+            stored = ram_blocks[index];
+        }
+
+        bool match = stored == image;
+        fprintf(report, "image %d     %s%s\n", index, match ? "OK" : "MISMATCH", in_ram ? " (RAM)" : "");
+        if (!match) ret = 1;
+
+        bool crc_match = auth_req_crc[index] == crc64(image);
+        fprintf(report, "crc64 %d     %016llx %s\n", index, (unsigned long long)auth_req_crc[index], crc_match ? "OK" : "MISMATCH");
+        if (!crc_match) ret = 1;
+
+        const std::vector<uint8_t>& t = telemetry[index];
+        if (!t.empty()) {
+            const uint8_t* p = &t[FRAG_TELEMETRY_HEADER_LENGTH];
+            fprintf(report, "telemetry %d %u frames, %u lost in %u bursts, rssi -%u..-%u dBm, snr %d..%d dB\n", index,
+                p[0] | (p[1] << 8), p[2] | (p[3] << 8), p[4] | (p[5] << 8), p[6], p[7], (int8_t)p[8], (int8_t)p[9]);
+        }
+
+        const std::vector<uint8_t>& f = flash_stats[index];
+        if (!f.empty()) {
+            static const char* names[INSTRUMENTED_BD_OPS] = { "reads", "programs", "erases" };
+            fprintf(report, "flash %d    ", index);
+            for (size_t op = 0; op < INSTRUMENTED_BD_OPS; op++) {
+                const uint8_t* p = &f[FLASH_STATS_HEADER_LENGTH + op * (INSTRUMENTED_BD_STATS_SIZE / INSTRUMENTED_BD_OPS)];
+                fprintf(report, " %u %s (%u KiB, %u ms)", p[0] | (p[1] << 8), names[op], p[2] | (p[3] << 8), p[4] | (p[5] << 8));
+            }
+            fprintf(report, "\n");
+        }
+    }
+
+    if (completion_frame >= 0 && !new_fw.empty()) {
+        const DeltaPatchStream* patch = radio_events->GetDeltaPatch();
+        std::vector<uint8_t> target(patch->get_target_size());
+        AT45BlockDevice at45;
+        at45.init();
+        if (!target.empty()) {
+            at45.read(&target[0], patch->get_target_address(), target.size());
+        }
+
+        bool match = patched && target == new_fw;
+        size_t diff_size = images[0].size() - FOTA_SIGNATURE_LENGTH;
+        if (delta_ready) {
+            fprintf(report, "delta       %u byte diff, patched when the session completed, ", (unsigned)diff_size);
+        }
+        else {
+            fprintf(report, "delta       %u byte diff, %u bytes patched when the session completed, ", (unsigned)diff_size, (unsigned)delta_applied);
+        }
+        fprintf(report, "firmware %u bytes %s\n", (unsigned)target.size(), match ? "OK" : patched ? "MISMATCH" : "FAILED");
+        if (!match) ret = 1;
+    }
+
+    fclose(report);
+    fflush(stdout);
+
+    // the Rx worker thread is still waiting for frames, skip the static destructors
+    _exit(ret);
+}
@@ -0,0 +1,601 @@
+/*
+* PackageLicenseDeclared: Apache-2.0
+* Copyright (c) 2017 ARM Limited
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*     http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+/**
+ * RAM-backed stand-in for the AT45 driver, used by the host replay harness.
+ * It has the same geometry as the AT45 on the xDot (528 byte pages, or 512 in binary page mode), accepts
+ * unaligned reads and programs like the real driver does, and counts every operation.
+ *
+ * With set_timing() it also models how long the chip takes: every SPI transfer, the internal page
+ * transfers, programs and erases, and the status register polls of the driver while the chip is busy.
+ * The time is virtual, it is added to the clock of Timer (see mbed_virtual_time_us) and to the
+ * counters, so a run gives the same device-equivalent numbers on every machine.
+ *
+ * deinit() puts the chip in deep power-down and init() wakes it up, like the driver does. The chip
+ * ignores everything else in deep power-down, so the stub fails those operations and counts them.
+ *
+ * The at45 driver on the device always programs with the built-in erase of the chip. The stub can
+ * model a driver that knows which pages were erased and not programmed since, and programs those
+ * without the built-in erase, which is several times faster (set_erased_page_program()). That is off
+ * by default, so the timing stays what the device does.
+ *
+ * Besides the driver API, the stub answers the commands that PipelinedAT45BlockDevice sends over SPI
+ * (see at45_spi_transfer): status read, buffer write, buffer to main memory page program and main
+ * memory page to buffer transfer. A page program started that way runs in the background, on the
+ * virtual clock: the chip is busy until it is done, and can meanwhile only read its status and write
+ * the other buffer. Everything else it gets while busy is ignored and counted as a busy access.
+ *
+ * There is only one flash chip on the board, so storage, configuration and counters are shared
+ * between all instances. Configure the geometry and the backing file before the first use.
+ */
+
+#ifndef __AT45_BLOCK_DEVICE_H__
+#define __AT45_BLOCK_DEVICE_H__
+
+#include <string.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "mbed.h"
+#include "BlockDevice.h"
+
+#define AT45_PAGE_SIZE          528
+#define AT45_BINARY_PAGE_SIZE   512
+#define AT45_PAGE_COUNT         16384
+#define AT45_BLOCK_PAGES        8       // pages in an erase block
+
+typedef struct {
+    uint32_t reads;                     // number of read() calls
+    uint64_t read_bytes;
+    uint32_t programs;                  // number of program() calls, and page programs sent over SPI
+    uint64_t program_bytes;
+    uint32_t page_programs;             // number of physical pages programmed
+    uint32_t erased_page_programs;      // pages that were erased before, and programmed without erasing
+    uint32_t partial_page_programs;     // pages that needed a read-modify-write cycle
+    uint32_t erases;                    // number of erase() calls
+    uint64_t erase_bytes;
+    uint64_t spi_us;                    // timing model: time on the SPI bus, including status polls
+    uint64_t busy_us;                   // timing model: time waiting for the chip to become ready
+    uint32_t status_polls;              // timing model: status register reads while waiting
+    uint32_t power_downs;               // deinit() calls that put the chip in deep power-down
+    uint32_t powered_down_accesses;     // operations that failed because the chip was in deep power-down
+    uint32_t overlapped_programs;       // pages written into a buffer over SPI while the other one was programmed
+    uint32_t busy_accesses;             // operations and SPI commands that the chip ignored because it was busy
+} AT45Stats_t;
+
+/**
+ * Timing of the chip and the driver, in microseconds. The defaults are in the range of the typical
+ * values of the AT45DB datasheets, with an 8 MHz SPI clock.
+ */
+typedef struct {
+    uint32_t spi_byte_ns;               // time to clock one byte over SPI
+    uint32_t page_to_buffer_us;         // main memory page to buffer transfer (tXFR)
+    uint32_t page_program_us;           // buffer to main memory page program with built-in erase (tEP)
+    uint32_t erased_page_program_us;    // buffer to main memory page program without built-in erase (tP)
+    uint32_t page_erase_us;             // tPE
+    uint32_t block_erase_us;            // tBE, AT45_BLOCK_PAGES pages
+    uint32_t poll_interval_us;          // time between two status register reads of the driver
+    uint32_t resume_us;                 // resume from deep power-down (tRDPD)
+} AT45Timing_t;
+
+class AT45BlockDevice : public BlockDevice
+{
+public:
+    AT45BlockDevice() {}
+
+    virtual int init() {
+        if (*powered_down()) {
+            *powered_down() = false;
+
+            // resume from deep power-down command, then wait until the chip accepts commands again
+            spi(1);
+            if (is_timing_enabled()) {
+                stats()->busy_us += timing()->resume_us;
+                mbed_virtual_time_us() += timing()->resume_us;
+            }
+        }
+        return storage() != NULL ? BD_ERROR_OK : BD_ERROR_DEVICE_ERROR;
+    }
+
+    virtual int deinit() {
+        if (*powered_down()) return BD_ERROR_OK;
+        if (reject_busy()) return BD_ERROR_DEVICE_ERROR;
+
+        spi(1);
+        *powered_down() = true;
+        stats()->power_downs++;
+        return BD_ERROR_OK;
+    }
+
+    virtual int sync() {
+        if (reject_powered_down() || reject_busy()) return BD_ERROR_DEVICE_ERROR;
+
+        return BD_ERROR_OK;
+    }
+
+    virtual int read(void *buffer, bd_addr_t addr, bd_size_t size) {
+        if (addr + size > this->size() || reject_powered_down() || reject_busy()) return BD_ERROR_DEVICE_ERROR;
+
+        memcpy(buffer, storage() + addr, size);
+
+        stats()->reads++;
+        stats()->read_bytes += size;
+
+        // continuous array read: opcode, address and dummy bytes, then the data, across pages
+        spi(8 + size);
+        return BD_ERROR_OK;
+    }
+
+    virtual int program(const void *buffer, bd_addr_t addr, bd_size_t size) {
+        if (addr + size > this->size() || reject_powered_down() || reject_busy()) return BD_ERROR_DEVICE_ERROR;
+
+        memcpy(storage() + addr, buffer, size);
+
+        stats()->programs++;
+        stats()->program_bytes += size;
+
+        // the chip programs through its SRAM buffer one page at a time,
+        // anything that does not cover a full page is read back first
+        bd_size_t page_size = get_page_size();
+        bd_addr_t end = addr + size;
+        while (addr < end) {
+            bd_addr_t page_end = (addr / page_size + 1) * page_size;
+            bd_addr_t chunk_end = page_end < end ? page_end : end;
+
+            stats()->page_programs++;
+            if (chunk_end - addr != page_size) {
+                stats()->partial_page_programs++;
+
+                spi(4);
+                busy(timing()->page_to_buffer_us);
+            }
+
+            bd_size_t page = addr / page_size;
+            bool erased = is_erased(page) && *erased_page_program();
+            set_erased(page, false);
+            if (erased) {
+                stats()->erased_page_programs++;
+            }
+
+            // buffer write, then buffer to main memory page program
+            spi(4 + (chunk_end - addr));
+            spi(4);
+            busy(erased ? timing()->erased_page_program_us : timing()->page_program_us);
+
+            addr = chunk_end;
+        }
+        return BD_ERROR_OK;
+    }
+
+    virtual int erase(bd_addr_t addr, bd_size_t size) {
+        if (addr + size > this->size() || reject_powered_down() || reject_busy()) return BD_ERROR_DEVICE_ERROR;
+
+        memset(storage() + addr, 0xff, size);
+
+        stats()->erases++;
+        stats()->erase_bytes += size;
+
+        // whole blocks where possible, pages for the rest
+        bd_size_t page_size = get_page_size();
+        bd_size_t block_size = page_size * AT45_BLOCK_PAGES;
+        bd_addr_t end = addr + size;
+        addr = addr / page_size * page_size;
+        for (bd_addr_t page_addr = addr; page_addr < end; page_addr += page_size) {
+            set_erased(page_addr / page_size, true);
+        }
+        while (addr < end) {
+            spi(4);
+            if (addr % block_size == 0 && addr + block_size <= end) {
+                busy(timing()->block_erase_us);
+                addr += block_size;
+            }
+            else {
+                busy(timing()->page_erase_us);
+                addr += page_size;
+            }
+        }
+        return BD_ERROR_OK;
+    }
+
+    virtual bd_size_t get_read_size() const {
+        return get_page_size();
+    }
+
+    virtual bd_size_t get_program_size() const {
+        return get_page_size();
+    }
+
+    virtual bd_size_t size() const {
+        return get_page_size() * AT45_PAGE_COUNT;
+    }
+
+    static AT45Stats_t* stats() {
+        static AT45Stats_t s;
+        return &s;
+    }
+
+    static void reset_stats() {
+        memset(stats(), 0, sizeof(AT45Stats_t));
+    }
+
+    /**
+     * Use 512 byte pages (binary page mode) instead of 528
+     */
+    static void set_page_size(bd_size_t size) {
+        *page_size_setting() = size;
+    }
+
+    static bd_size_t get_page_size() {
+        return *page_size_setting();
+    }
+
+    /**
+     * Keep the contents of the flash in a file, so they survive the process. Parts of the file that
+     * did not exist yet are erased.
+     */
+    static void set_backing_file(const char* path) {
+        *backing_file_setting() = path;
+    }
+
+    /**
+     * Model the timing of the chip. NULL turns the model off, flash then runs at RAM speed.
+     */
+    static void set_timing(const AT45Timing_t* t) {
+        *timing_enabled() = t != NULL;
+        if (t) *timing() = *t;
+    }
+
+    static bool is_timing_enabled() {
+        return *timing_enabled();
+    }
+
+    /**
+     * Program pages that were erased and not programmed since without the built-in erase. The at45
+     * driver does not do this, so it is off by default.
+     */
+    static void set_erased_page_program(bool enabled) {
+        *erased_page_program() = enabled;
+    }
+
+    static const AT45Timing_t* get_default_timing() {
+        static const AT45Timing_t t = { 125, 200, 15000, 3000, 12000, 30000, 50, 35 };
+        return &t;
+    }
+
+    /**
+     * Chip select of the SPI bus: a command starts when the chip is selected, and a page program or
+     * transfer starts when it is deselected
+     */
+    static void spi_select(bool selected) {
+        SpiCommand_t* c = spi_command();
+
+        if (selected) {
+            c->length = 0;
+            c->ignored = *powered_down();
+            if (c->ignored) stats()->powered_down_accesses++;
+            return;
+        }
+
+        if (c->ignored || c->length < 4) return;
+
+        uint8_t opcode = c->bytes[0];
+        if (opcode != 0x83 && opcode != 0x86 && opcode != 0x53 && opcode != 0x55) return;
+
+        bd_size_t page_size = get_page_size();
+        uint32_t address = (c->bytes[1] << 16) | (c->bytes[2] << 8) | c->bytes[3];
+        uint32_t page = address >> get_page_shift();
+        if (page >= AT45_PAGE_COUNT) return;
+
+        uint8_t* buffer = spi_buffer(opcode == 0x86 || opcode == 0x55 ? 1 : 0);
+        uint8_t* main = storage() + (bd_addr_t)page * page_size;
+
+        // a page that is only partly programmed is read into the buffer first
+        if (opcode == 0x53 || opcode == 0x55) {
+            stats()->partial_page_programs++;
+            memcpy(buffer, main, page_size);
+            start_busy(timing()->page_to_buffer_us, -1);
+            return;
+        }
+
+        // with built-in erase, the whole page is replaced by the buffer
+        memcpy(main, buffer, page_size);
+        set_erased(page, false);
+        stats()->programs++;
+        stats()->page_programs++;
+        start_busy(timing()->page_program_us, opcode == 0x86 ? 1 : 0);
+    }
+
+    /**
+     * One byte on the SPI bus while the chip is selected
+     *
+     * @returns The byte the chip sends back
+     */
+    static uint8_t spi_transfer(uint8_t value) {
+        SpiCommand_t* c = spi_command();
+        spi(1);
+
+        if (c->ignored) return 0xff;
+
+        if (c->length < 4) {
+            c->bytes[c->length] = value;
+        }
+        c->length++;
+
+        uint8_t opcode = c->bytes[0];
+
+        // status register: bit 7 is ready, the chip sends it as long as it is selected
+        if (opcode == 0xD7) {
+            if (c->length == 1) return 0xff;
+            return read_status();
+        }
+
+        // status reads and writes into the buffer that is not being programmed are all the chip takes while busy
+        bool write_buffer = opcode == 0x84 || opcode == 0x87;
+        uint8_t index = opcode == 0x87 ? 1 : 0;
+        if (is_busy() && !(write_buffer && *programming_buffer() >= 0 && *programming_buffer() != index)) {
+            if (c->length == 1) stats()->busy_accesses++;
+            c->ignored = true;
+            return 0xff;
+        }
+
+        if (!write_buffer || c->length <= 4) return 0xff;
+
+        // buffer write: the address is the byte in the buffer, it wraps around at the end of the buffer
+        uint32_t offset = ((c->bytes[2] << 8) | c->bytes[3]) & ((1 << get_page_shift()) - 1);
+        uint32_t byte = (offset + c->length - 5) % get_page_size();
+        spi_buffer(index)[byte] = value;
+
+        if (c->length == 5 && is_busy()) {
+            stats()->overlapped_programs++;
+        }
+        stats()->program_bytes++;
+        return 0xff;
+    }
+
+    /**
+     * Backing store, mmap'ed so it does not show up in the heap statistics
+     */
+    static uint8_t* storage() {
+        static uint8_t* mem = NULL;
+        if (mem == NULL) {
+            size_t len = (size_t)get_page_size() * AT45_PAGE_COUNT;
+            const char* path = *backing_file_setting();
+            if (path) {
+                mem = map_file(path, len);
+            }
+            else {
+                mem = (uint8_t*)mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+                if (mem == MAP_FAILED) mem = NULL;
+                if (mem) memset(mem, 0xff, len);
+            }
+        }
+        return mem;
+    }
+
+private:
+    /**
+     * Whether the chip is in deep power-down, where it ignores the operation. Counts it.
+     */
+    static bool reject_powered_down() {
+        if (!*powered_down()) return false;
+
+        stats()->powered_down_accesses++;
+        return true;
+    }
+
+    static uint8_t* map_file(const char* path, size_t len) {
+        int fd = open(path, O_RDWR | O_CREAT, 0644);
+        if (fd < 0) return NULL;
+
+        struct stat st;
+        size_t existing = fstat(fd, &st) == 0 ? (size_t)st.st_size : 0;
+        if (existing < len && ftruncate(fd, len) != 0) {
+            close(fd);
+            return NULL;
+        }
+
+        uint8_t* mem = (uint8_t*)mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (mem == MAP_FAILED) return NULL;
+
+        if (existing < len) {
+            memset(mem + existing, 0xff, len - existing);
+        }
+        return mem;
+    }
+
+    /**
+     * SPI transfer of this many bytes
+     */
+    static void spi(bd_size_t bytes) {
+        if (!is_timing_enabled()) return;
+
+        // in ns, the bytes of a command over SPI come one at a time
+        static uint64_t ns = 0;
+        ns += bytes * timing()->spi_byte_ns;
+        uint64_t us = ns / 1000;
+        ns -= us * 1000;
+
+        stats()->spi_us += us;
+        mbed_virtual_time_us() += us;
+    }
+
+    /**
+     * Wait until an internal operation of us microseconds finished, like the driver does: read the
+     * status register, and if the chip is still busy, try again poll_interval_us later
+     */
+    static void busy(uint32_t us) {
+        if (!is_timing_enabled()) return;
+
+        uint32_t interval = timing()->poll_interval_us > 0 ? timing()->poll_interval_us : 1;
+        uint32_t waits = (us + interval - 1) / interval;
+        uint64_t waited = (uint64_t)waits * interval;
+
+        stats()->busy_us += waited;
+        stats()->status_polls += waits + 1;
+        mbed_virtual_time_us() += waited;
+        spi(2 * (waits + 1));
+    }
+
+    typedef struct {
+        uint8_t bytes[4];                   // opcode and address
+        size_t length;                      // bytes since the chip was selected
+        bool ignored;                       // in deep power-down, or busy
+    } SpiCommand_t;
+
+    static SpiCommand_t* spi_command() {
+        static SpiCommand_t c;
+        return &c;
+    }
+
+    /**
+     * SRAM buffer 1 (index 0) or 2 (index 1) of the chip
+     */
+    static uint8_t* spi_buffer(uint8_t index) {
+        static uint8_t buffers[2][AT45_PAGE_SIZE];
+        return buffers[index];
+    }
+
+    /**
+     * Bits of the byte address in a page in the address of a command: 10 for 528 byte pages, 9 for 512
+     */
+    static uint8_t get_page_shift() {
+        return get_page_size() > 512 ? 10 : 9;
+    }
+
+    /**
+     * Start an operation that the chip runs in the background, on the virtual clock
+     *
+     * @param buffer Buffer that is programmed, -1 if none
+     */
+    static void start_busy(uint32_t us, int buffer) {
+        if (!is_timing_enabled()) return;
+
+        *busy_until() = mbed_virtual_time_us() + us;
+        *programming_buffer() = buffer;
+    }
+
+    static bool is_busy() {
+        return mbed_virtual_time_us() < *busy_until();
+    }
+
+    /**
+     * Status register read. The time from the first read that found the chip busy until it is ready is
+     * what the caller waited for it.
+     */
+    static uint8_t read_status() {
+        static uint64_t waiting_since = 0;
+        static bool waiting = false;
+
+        stats()->status_polls++;
+
+        if (is_busy()) {
+            if (!waiting) {
+                waiting = true;
+                waiting_since = mbed_virtual_time_us();
+            }
+            return 0x00;
+        }
+
+        if (waiting) {
+            stats()->busy_us += mbed_virtual_time_us() - waiting_since;
+            waiting = false;
+        }
+        return 0x80;
+    }
+
+    /**
+     * An operation of the driver API while a page program over SPI is still running, which the chip ignores
+     */
+    static bool reject_busy() {
+        if (!is_busy()) return false;
+
+        stats()->busy_accesses++;
+        return true;
+    }
+
+    static uint64_t* busy_until() {
+        static uint64_t t = 0;
+        return &t;
+    }
+
+    static int* programming_buffer() {
+        static int b = -1;
+        return &b;
+    }
+
+    /**
+     * Pages that were erased, and not programmed since
+     */
+    static uint8_t* erased_pages() {
+        static uint8_t bits[AT45_PAGE_COUNT / 8];
+        return bits;
+    }
+
+    static bool is_erased(bd_size_t page) {
+        return erased_pages()[page / 8] & (1 << (page % 8));
+    }
+
+    static void set_erased(bd_size_t page, bool erased) {
+        if (erased) {
+            erased_pages()[page / 8] |= 1 << (page % 8);
+        }
+        else {
+            erased_pages()[page / 8] &= ~(1 << (page % 8));
+        }
+    }
+
+    static bd_size_t* page_size_setting() {
+        static bd_size_t s = AT45_PAGE_SIZE;
+        return &s;
+    }
+
+    static const char** backing_file_setting() {
+        static const char* s = NULL;
+        return &s;
+    }
+
+    static bool* powered_down() {
+        static bool s = false;
+        return &s;
+    }
+
+    static bool* erased_page_program() {
+        static bool s = false;
+        return &s;
+    }
+
+    static bool* timing_enabled() {
+        static bool s = false;
+        return &s;
+    }
+
+    static AT45Timing_t* timing() {
+        static AT45Timing_t s = *get_default_timing();
+        return &s;
+    }
+};
+
+inline void at45_spi_select(bool selected) {
+    AT45BlockDevice::spi_select(selected);
+}
+
+inline uint8_t at45_spi_transfer(uint8_t value) {
+    return AT45BlockDevice::spi_transfer(value);
+}
+
+#endif
@@ -0,0 +1,79 @@
+/*
+* PackageLicenseDeclared: Apache-2.0
+* Copyright (c) 2017 ARM Limited
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*     http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+/**
+ * Host copy of the mbed OS BlockDevice interface (features/filesystem/bd/BlockDevice.h)
+ */
+
+#ifndef __BLOCK_DEVICE_H__
+#define __BLOCK_DEVICE_H__
+
+#include <stdint.h>
+
+typedef uint64_t bd_addr_t;
+typedef uint64_t bd_size_t;
+
+enum bd_error {
+    BD_ERROR_OK                 = 0,     // no error
+    BD_ERROR_DEVICE_ERROR       = -4001, // device specific error
+};
+
+class BlockDevice
+{
+public:
+    virtual ~BlockDevice() {}
+
+    virtual int init() = 0;
+
+    virtual int deinit() = 0;
+
+    virtual int sync() {
+        return 0;
+    }
+
+    virtual int read(void *buffer, bd_addr_t addr, bd_size_t size) = 0;
+
+    virtual int program(const void *buffer, bd_addr_t addr, bd_size_t size) = 0;
+
+    virtual int erase(bd_addr_t addr, bd_size_t size) {
+        return 0;
+    }
+
+    virtual bd_size_t get_read_size() const = 0;
+
+    virtual bd_size_t get_program_size() const = 0;
+
+    virtual bd_size_t get_erase_size() const {
+        return get_program_size();
+    }
+
+    virtual bd_size_t size() const = 0;
+
+    bool is_valid_read(bd_addr_t addr, bd_size_t size) const {
+        return (addr % get_read_size() == 0 && size % get_read_size() == 0 && addr + size <= this->size());
+    }
+
+    bool is_valid_program(bd_addr_t addr, bd_size_t size) const {
+        return (addr % get_program_size() == 0 && size % get_program_size() == 0 && addr + size <= this->size());
+    }
+
+    bool is_valid_erase(bd_addr_t addr, bd_size_t size) const {
+        return (addr % get_erase_size() == 0 && size % get_erase_size() == 0 && addr + size <= this->size());
+    }
+};
+
+#endif
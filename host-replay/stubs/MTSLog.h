@@ -0,0 +1,64 @@
+/*
+* PackageLicenseDeclared: Apache-2.0
+* Copyright (c) 2017 ARM Limited
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*     http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#ifndef __MTS_LOG_H__
+#define __MTS_LOG_H__
+
+#include <stdio.h>
+
+namespace mts {
+
+class MTSLog {
+public:
+    enum Level {
+        NONE_LEVEL = 0,
+        FATAL_LEVEL = 1,
+        ERROR_LEVEL = 2,
+        WARNING_LEVEL = 3,
+        INFO_LEVEL = 4,
+        DEBUG_LEVEL = 5,
+        TRACE_LEVEL = 6
+    };
+
+    static int getLogLevel() {
+        return *level();
+    }
+
+    static void setLogLevel(int l) {
+        *level() = l;
+    }
+
+private:
+    static int* level() {
+        static int l = INFO_LEVEL;
+        return &l;
+    }
+};
+
+}
+
+#define MTS_LOG(lvl, name, format, ...) \
+    do { if (mts::MTSLog::getLogLevel() >= lvl) printf("[" name "] " format "\n", ##__VA_ARGS__); } while (0)
+
+#define logFatal(format, ...)   MTS_LOG(mts::MTSLog::FATAL_LEVEL, "FATAL", format, ##__VA_ARGS__)
+#define logError(format, ...)   MTS_LOG(mts::MTSLog::ERROR_LEVEL, "ERROR", format, ##__VA_ARGS__)
+#define logWarning(format, ...) MTS_LOG(mts::MTSLog::WARNING_LEVEL, "WARNING", format, ##__VA_ARGS__)
+#define logInfo(format, ...)    MTS_LOG(mts::MTSLog::INFO_LEVEL, "INFO", format, ##__VA_ARGS__)
+#define logDebug(format, ...)   MTS_LOG(mts::MTSLog::DEBUG_LEVEL, "DEBUG", format, ##__VA_ARGS__)
+#define logTrace(format, ...)   MTS_LOG(mts::MTSLog::TRACE_LEVEL, "TRACE", format, ##__VA_ARGS__)
+
+#endif
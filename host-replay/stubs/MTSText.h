@@ -0,0 +1,47 @@
+/*
+* PackageLicenseDeclared: Apache-2.0
+* Copyright (c) 2017 ARM Limited
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*     http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#ifndef __MTS_TEXT_H__
+#define __MTS_TEXT_H__
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+namespace mts {
+
+class Text {
+public:
+    static std::string bin2hexString(const uint8_t* data, const uint32_t len) {
+        std::string str;
+        char buf[3];
+        for (uint32_t ix = 0; ix < len; ix++) {
+            snprintf(buf, sizeof(buf), "%02x", data[ix]);
+            str.append(buf);
+        }
+        return str;
+    }
+
+    static std::string bin2hexString(const std::vector<uint8_t>& data) {
+        return bin2hexString(&data[0], data.size());
+    }
+};
+
+}
+
+#endif
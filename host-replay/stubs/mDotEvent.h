@@ -0,0 +1,75 @@
+/*
+* PackageLicenseDeclared: Apache-2.0
+* Copyright (c) 2017 ARM Limited
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*     http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+/**
+ * Host version of the libxDot event types, only the parts that RadioEvent uses.
+ */
+
+#ifndef __MDOT_EVENT_H__
+#define __MDOT_EVENT_H__
+
+#include "mbed.h"
+
+typedef enum {
+    LORAMAC_EVENT_INFO_STATUS_OK = 0,
+    LORAMAC_EVENT_INFO_STATUS_ERROR,
+    LORAMAC_EVENT_INFO_STATUS_TX_TIMEOUT,
+    LORAMAC_EVENT_INFO_STATUS_RX_TIMEOUT,
+    LORAMAC_EVENT_INFO_STATUS_RX_ERROR,
+    LORAMAC_EVENT_INFO_STATUS_JOIN_FAIL,
+    LORAMAC_EVENT_INFO_STATUS_DOWNLINK_FAIL,
+    LORAMAC_EVENT_INFO_STATUS_ADDRESS_FAIL,
+    LORAMAC_EVENT_INFO_STATUS_MIC_FAIL,
+} LoRaMacEventInfoStatus;
+
+typedef union {
+    uint8_t Value;
+    struct {
+        uint8_t Tx :1;
+        uint8_t Rx :1;
+        uint8_t RxData :1;
+        uint8_t Multicast :1;
+        uint8_t RxSlot :2;
+        uint8_t LinkCheck :1;
+        uint8_t JoinAccept :1;
+    } Bits;
+} LoRaMacEventFlags;
+
+typedef struct {
+    LoRaMacEventInfoStatus Status;
+    bool TxAckReceived;
+    uint8_t TxNbRetries;
+    uint8_t TxDatarate;
+    uint8_t RxPort;
+    uint8_t *RxBuffer;
+    uint8_t RxBufferSize;
+    int16_t RxRssi;
+    int8_t RxSnr;
+    uint16_t Energy;
+    uint8_t DemodMargin;
+    uint8_t NbGateways;
+} LoRaMacEventInfo;
+
+class mDotEvent {
+public:
+    mDotEvent() {}
+    virtual ~mDotEvent() {}
+
+    virtual void MacEvent(LoRaMacEventFlags *flags, LoRaMacEventInfo *info) = 0;
+};
+
+#endif
@@ -0,0 +1,306 @@
+/*
+* PackageLicenseDeclared: Apache-2.0
+* Copyright (c) 2017 ARM Limited
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*     http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+/**
+ * Minimal host implementation of the mbed OS APIs that the application headers use.
+ * Timers never fire; the replay harness drives RadioEvent directly.
+ */
+
+#ifndef __MBED_H__
+#define __MBED_H__
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <atomic>
+
+#include "mbed_config.h"
+#include "BlockDevice.h"
+#include "platform/mbed_critical.h"
+
+template <typename F>
+class Callback;
+
+template <typename R, typename... Args>
+class Callback<R(Args...)> {
+public:
+    Callback() {}
+
+    Callback(R (*func)(Args...)) : _func(func) {}
+
+    template <typename T, typename U>
+    Callback(U *obj, R (T::*method)(Args...)) : _func([obj, method](Args... args) { return (obj->*method)(args...); }) {}
+
+    R call(Args... args) const {
+        return _func(args...);
+    }
+
+    R operator()(Args... args) const {
+        return _func(args...);
+    }
+
+    operator bool() const {
+        return (bool)_func;
+    }
+
+private:
+    std::function<R(Args...)> _func;
+};
+
+template <typename R, typename... Args>
+Callback<R(Args...)> callback(R (*func)(Args...)) {
+    return Callback<R(Args...)>(func);
+}
+
+template <typename T, typename U, typename R, typename... Args>
+Callback<R(Args...)> callback(U *obj, R (T::*method)(Args...)) {
+    return Callback<R(Args...)>(obj, method);
+}
+
+class Timeout {
+public:
+    void attach(Callback<void()> func, float t) {
+        _func = func;
+    }
+
+    void detach() {
+        _func = Callback<void()>();
+    }
+
+private:
+    Callback<void()> _func;
+};
+
+typedef Timeout Ticker;
+
+/**
+ * Time spent waiting for simulated peripherals (the AT45 timing model), in microseconds. It is added to
+ * the clock of Timer, so code that measures itself sees the time the device would spend on them.
+ */
+inline std::atomic<uint64_t>& mbed_virtual_time_us() {
+    static std::atomic<uint64_t> t(0);
+    return t;
+}
+
+class Timer {
+public:
+    Timer() : _running(false), _start(0), _acc(0) {}
+
+    void start() {
+        if (!_running) {
+            _start = now_us();
+            _running = true;
+        }
+    }
+
+    void stop() {
+        if (_running) {
+            _acc += now_us() - _start;
+            _running = false;
+        }
+    }
+
+    void reset() {
+        _acc = 0;
+        _start = now_us();
+    }
+
+    int read_us() {
+        return (int)(_acc + (_running ? now_us() - _start : 0));
+    }
+
+    int read_ms() {
+        return read_us() / 1000;
+    }
+
+    float read() {
+        return read_us() / 1000000.0f;
+    }
+
+private:
+    static uint64_t now_us() {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000 + mbed_virtual_time_us();
+    }
+
+    bool _running;
+    uint64_t _start;
+    uint64_t _acc;
+};
+
+typedef enum {
+    SPI_MOSI,
+    SPI_MISO,
+    SPI_SCK,
+    SPI_NSS,
+    NC = -1,
+} PinName;
+
+// the AT45 is the only device on the SPI bus, its commands are emulated by the AT45BlockDevice stub
+void at45_spi_select(bool selected);
+uint8_t at45_spi_transfer(uint8_t value);
+
+class SPI {
+public:
+    SPI(PinName mosi, PinName miso, PinName sclk) {}
+
+    void format(int bits, int mode = 0) {}
+
+    void frequency(int hz) {}
+
+    int write(int value) {
+        return at45_spi_transfer((uint8_t)value);
+    }
+};
+
+class DigitalOut {
+public:
+    DigitalOut(PinName apin, int avalue = 0) : pin(apin), value(avalue) {}
+
+    void write(int avalue) {
+        value = avalue;
+        if (pin == SPI_NSS) at45_spi_select(value == 0);
+    }
+
+    int read() {
+        return value;
+    }
+
+    DigitalOut& operator=(int avalue) {
+        write(avalue);
+        return *this;
+    }
+
+private:
+    PinName pin;
+    int value;
+};
+
+typedef enum {
+    osPriorityLow = 8,
+    osPriorityBelowNormal = 16,
+    osPriorityNormal = 24,
+    osPriorityAboveNormal = 32,
+    osPriorityHigh = 40,
+    osPriorityRealtime = 48,
+} osPriority;
+
+typedef enum {
+    osOK = 0,
+    osErrorResource = -3,
+} osStatus;
+
+class Semaphore {
+public:
+    Semaphore(int32_t count = 0) : _count(count) {}
+
+    int32_t wait(uint32_t millisec = 0xFFFFFFFF) {
+        std::unique_lock<std::mutex> lock(_mutex);
+        if (millisec == 0xFFFFFFFF) {
+            _cv.wait(lock, [this] { return _count > 0; });
+        }
+        else if (!_cv.wait_for(lock, std::chrono::milliseconds(millisec), [this] { return _count > 0; })) {
+            return 0;
+        }
+        return _count--;
+    }
+
+    int release() {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _count++;
+        _cv.notify_one();
+        return 0;
+    }
+
+private:
+    std::mutex _mutex;
+    std::condition_variable _cv;
+    int32_t _count;
+};
+
+class Thread {
+public:
+    Thread(osPriority priority = osPriorityNormal, uint32_t stack_size = 4096) {}
+
+    ~Thread() {
+        if (_thread.joinable()) {
+            _thread.detach();
+        }
+    }
+
+    osStatus start(Callback<void()> task) {
+        _thread = std::thread([task] { task(); });
+        return osOK;
+    }
+
+    osStatus join() {
+        if (_thread.joinable()) {
+            _thread.join();
+        }
+        return osOK;
+    }
+
+    // the stack of a std::thread is not painted, so its use is unknown
+    uint32_t max_stack() {
+        return 0;
+    }
+
+private:
+    std::thread _thread;
+};
+
+static inline void debug(const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    vfprintf(stdout, format, args);
+    va_end(args);
+}
+
+static inline void wait(float s) {
+    usleep((useconds_t)(s * 1000000.0f));
+}
+
+static inline void wait_ms(int ms) {
+    usleep(ms * 1000);
+}
+
+/**
+ * Drivers busy wait for peripherals with this, so it only advances the virtual clock (see mbed_virtual_time_us)
+ */
+static inline void wait_us(int us) {
+    mbed_virtual_time_us() += us;
+}
+
+static inline void NVIC_SystemReset() {
+    printf("NVIC_SystemReset\n");
+    exit(0);
+}
+
+#endif
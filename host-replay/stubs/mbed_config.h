@@ -0,0 +1,55 @@
+/*
+* PackageLicenseDeclared: Apache-2.0
+* Copyright (c) 2017 ARM Limited
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*     http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+/**
+ * Host replacement for the mbed_config.h that mbed CLI generates from mbed_app.json.
+ * Keep these values in sync with the "config" section of mbed_app.json.
+ */
+
+#ifndef __MBED_CONFIG_H__
+#define __MBED_CONFIG_H__
+
+#define MBED_CONF_APP_FRAG_SESSIONS                 2
+#define MBED_CONF_APP_FRAG_CHECKPOINT_INTERVAL      16
+#define MBED_CONF_APP_FRAG_STATUS_MAX_SIZE          51
+#define MBED_CONF_APP_FRAG_FAST_PATH                1
+#define MBED_CONF_APP_FRAG_FLASH_DECODER_LOSS       10
+#define MBED_CONF_APP_FRAG_FLASH_DECODER_CACHE_ROWS 4
+#define MBED_CONF_APP_FRAG_PARITY_ROW_CACHE         16
+#define MBED_CONF_APP_FRAG_TELEMETRY                1
+#define MBED_CONF_APP_FRAG_FLASH_STATS              1
+#define MBED_CONF_APP_FRAG_GEOMETRY                 1
+#define MBED_CONF_APP_FRAG_ERASE_AHEAD              0
+#define MBED_CONF_APP_FRAG_DELTA_STREAM             1
+// off like on the device, build with CXXFLAGS="-O2 -g -DMBED_CONF_APP_FLASH_PIPELINED_PROGRAM=1" to replay with it
+#ifndef MBED_CONF_APP_FLASH_PIPELINED_PROGRAM
+#define MBED_CONF_APP_FLASH_PIPELINED_PROGRAM       0
+#endif
+// off like on the device, build with CXXFLAGS="-O2 -g -DMBED_CONF_APP_FLASH_POWER_DOWN=1" to replay with it
+#ifndef MBED_CONF_APP_FLASH_POWER_DOWN
+#define MBED_CONF_APP_FLASH_POWER_DOWN              0
+#endif
+#define MBED_CONF_APP_FRAG_RAM_SINK_MAX_SIZE        1024
+#define MBED_CONF_APP_MAX_REDUNDANCY_PACKETS        80
+#define MBED_CONF_APP_MIN_REDUNDANCY_PACKETS        4
+#define MBED_CONF_APP_FRAG_HEAP_RESERVE             2048
+#define MBED_CONF_APP_ACK_MAC_COMMANDS              0
+#define MBED_CONF_APP_DIGEST_CATCHUP_BYTES          512
+#define MBED_CONF_APP_RX_QUEUE_DEPTH                4
+#define MBED_CONF_APP_RX_WORKER_STACK_SIZE          6144
+
+#endif
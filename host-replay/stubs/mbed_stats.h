@@ -0,0 +1,40 @@
+/*
+* PackageLicenseDeclared: Apache-2.0
+* Copyright (c) 2017 ARM Limited
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*     http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+/**
+ * Host version of mbed_stats.h. The numbers are collected by the malloc wrappers in
+ * heap_stats.cpp, so they mean the same as on the device (bytes handed out by malloc).
+ */
+
+#ifndef __MBED_STATS_H__
+#define __MBED_STATS_H__
+
+#include <stdint.h>
+
+// unsigned long rather than uint32_t, so the "%lu" format strings used on the device also work on the host
+typedef struct {
+    unsigned long current_size;     // bytes allocated currently
+    unsigned long max_size;         // max bytes allocated at a given time
+    unsigned long total_size;       // cumulative sum of bytes ever allocated
+    unsigned long reserved_size;    // current number of bytes allocated for the heap
+    unsigned long alloc_cnt;        // current number of allocations
+    unsigned long alloc_fail_cnt;   // number of failed allocations
+} mbed_stats_heap_t;
+
+void mbed_stats_heap_get(mbed_stats_heap_t *stats);
+
+#endif
@@ -0,0 +1,36 @@
+/*
+* PackageLicenseDeclared: Apache-2.0
+* Copyright (c) 2017 ARM Limited
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*     http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#ifndef __MBED_CRITICAL_H__
+#define __MBED_CRITICAL_H__
+
+#include <mutex>
+
+static inline std::recursive_mutex& core_util_critical_section_mutex() {
+    static std::recursive_mutex m;
+    return m;
+}
+
+static inline void core_util_critical_section_enter() {
+    core_util_critical_section_mutex().lock();
+}
+
+static inline void core_util_critical_section_exit() {
+    core_util_critical_section_mutex().unlock();
+}
+
+#endif
@@ -0,0 +1,119 @@
+/*
+* PackageLicenseDeclared: Apache-2.0
+* Copyright (c) 2017 ARM Limited
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*     http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+
+#ifndef __BLOCK_DEVICE_STREAM_READER_H__
+#define __BLOCK_DEVICE_STREAM_READER_H__
+
+#include "mbed.h"
+#include "BlockDevice.h"
+
+#ifndef BLOCK_DEVICE_STREAM_READER_BUFFER_SIZE
+#define BLOCK_DEVICE_STREAM_READER_BUFFER_SIZE      512
+#endif
+
+/**
+ * Reads a range of a block device in chunks, for hashing and verifying data in flash.
+ *
+ * next() reads every chunk on the calling thread. The AT45 driver reads with blocking SPI, so a thread
+ * that reads ahead would barely overlap with the hash computation; the large chunks cut the number of
+ * read commands instead.
+ *
+ * The block device must not be written while the reader is active.
+ */
+class BlockDeviceStreamReader {
+public:
+    /**
+     * @param abd Block device to read
+     * @param aoffset Start of the range
+     * @param asize Size of the range
+     * @param abuffer_size Size of the buffer, i.e. the largest chunk next() returns
+     */
+    BlockDeviceStreamReader(BlockDevice* abd, bd_addr_t aoffset, bd_size_t asize, size_t abuffer_size = BLOCK_DEVICE_STREAM_READER_BUFFER_SIZE)
+        : bd(abd), offset(aoffset), size(asize), buffer_size(abuffer_size), buffer(NULL), position(0), error(BD_ERROR_OK)
+    {
+    }
+
+    ~BlockDeviceStreamReader() {
+        if (buffer) free(buffer);
+    }
+
+    /**
+     * Allocate the buffer (a smaller one if the heap is short)
+     *
+     * @returns false if there was not enough memory
+     */
+    bool initialize() {
+        while (buffer_size >= MIN_BUFFER_SIZE) {
+            buffer = (uint8_t*)malloc(buffer_size);
+            if (buffer) return true;
+
+            buffer_size /= 2;
+        }
+        return false;
+    }
+
+    /**
+     * Next chunk of the range. The data stays valid until the next call.
+     *
+     * @param data Set to the chunk
+     * @returns Size of the chunk, 0 at the end of the range or after a read error
+     */
+    size_t next(const uint8_t** data) {
+        if (position >= size || error != BD_ERROR_OK) return 0;
+
+        size_t length = size - position < buffer_size ? size - position : buffer_size;
+
+        int r = bd->read(buffer, offset + position, length);
+        if (r != BD_ERROR_OK) {
+            error = r;
+            return 0;
+        }
+
+        *data = buffer;
+        position += length;
+        return length;
+    }
+
+    /**
+     * Error of the last failed read, or BD_ERROR_OK
+     */
+    int get_error() const {
+        return error;
+    }
+
+    /**
+     * Size of the buffer, after initialize()
+     */
+    size_t get_buffer_size() const {
+        return buffer_size;
+    }
+
+private:
+    static const size_t MIN_BUFFER_SIZE = 32;
+
+    BlockDevice* bd;
+    bd_addr_t offset;
+    bd_size_t size;
+    size_t buffer_size;
+
+    uint8_t* buffer;
+    bd_size_t position;         // start of the next chunk that next() returns
+    int error;
+};
+
+#endif
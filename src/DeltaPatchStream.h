@@ -0,0 +1,487 @@
+/*
+* PackageLicenseDeclared: Apache-2.0
+* Copyright (c) 2017 ARM Limited
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*     http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+
+#ifndef __DELTA_PATCH_STREAM_H__
+#define __DELTA_PATCH_STREAM_H__
+
+#include "mbed.h"
+#include "BlockDevice.h"
+
+// diff bytes read from flash at a time
+#ifndef DELTA_PATCH_STREAM_BUFFER_SIZE
+#define DELTA_PATCH_STREAM_BUFFER_SIZE      64
+#endif
+
+// diff and source bytes per step when patching between received frames, about a page of the target
+#ifndef DELTA_PATCH_STREAM_STEP_BYTES
+#define DELTA_PATCH_STREAM_STEP_BYTES       512
+#endif
+
+// opcodes of the janpatch (JojoDiff) format, every operation starts with ESC and the opcode
+#define DELTA_PATCH_ESC     0xA7
+#define DELTA_PATCH_MOD     0xA6    // replace source bytes with the data that follows
+#define DELTA_PATCH_INS     0xA5    // insert the data that follows
+#define DELTA_PATCH_DEL     0xA4    // skip source bytes
+#define DELTA_PATCH_EQL     0xA3    // copy source bytes
+#define DELTA_PATCH_BKT     0xA2    // go back in the source
+
+/**
+ * Applies a janpatch diff while it is still being received, so the patched firmware is ready soon
+ * after the last fragment instead of after another pass over the complete diff.
+ *
+ * apply_delta_update pulls the diff through janpatch in one blocking call. This class interprets the
+ * same operations, but is pushed: step() gets the number of diff bytes at the start of the diff that
+ * are in flash (the fragments before the first missing one), consumes operations up to there, and
+ * returns when an operation needs bytes that did not arrive yet. When the gap is filled (through
+ * parity, or a repair) the next steps catch up by reading the bytes that came in meanwhile from flash.
+ * Every step does a bounded amount of work, so it can run between received frames.
+ *
+ * The patched image is programmed a page at a time. The source (the old firmware), the target and the
+ * diff must not overlap.
+ *
+ * Not thread safe: start(), step(), finish() and cancel() are called from the same thread.
+ */
+class DeltaPatchStream {
+public:
+    DeltaPatchStream(BlockDevice* abd)
+        : bd(abd), page_size(0), page(NULL), running(false), complete(false), error(BD_ERROR_OK),
+          diff_addr(0), diff_size(0), source_addr(0), source_size(0), target_addr(0), target_max_size(0)
+    {
+        reset();
+    }
+
+    ~DeltaPatchStream() {
+        if (page) free(page);
+    }
+
+    /**
+     * Start patching. Stops patching the previous diff.
+     *
+     * @param adiff_addr Start of the diff
+     * @param adiff_size Size of the complete diff
+     * @param asource_addr Start of the old firmware
+     * @param asource_size Size of the old firmware
+     * @param atarget_addr Where the patched firmware goes
+     * @param atarget_max_size Size of the flash region at atarget_addr
+     * @returns false if there was not enough memory for the page buffer
+     */
+    bool start(bd_addr_t adiff_addr, bd_size_t adiff_size, bd_addr_t asource_addr, bd_size_t asource_size,
+               bd_addr_t atarget_addr, bd_size_t atarget_max_size)
+    {
+        cancel();
+
+        page_size = bd->get_read_size();
+        page = (uint8_t*)malloc(page_size);
+        if (page == NULL) return false;
+
+        diff_addr = adiff_addr;
+        diff_size = adiff_size;
+        source_addr = asource_addr;
+        source_size = asource_size;
+        target_addr = atarget_addr;
+        target_max_size = atarget_max_size;
+
+        reset();
+        running = true;
+        return true;
+    }
+
+    /**
+     * Stop patching, and release the page buffer. The target is then not complete.
+     */
+    void cancel() {
+        running = false;
+        complete = false;
+
+        if (page) {
+            free(page);
+            page = NULL;
+        }
+    }
+
+    /**
+     * Apply the operations in the part of the diff that is available
+     *
+     * @param diff_bd Block device to read the diff from (e.g. the page cache of the session that receives it)
+     * @param available Number of bytes at the start of the diff that are on diff_bd
+     * @param max_bytes Stop after about this many diff and source bytes
+     * @returns true if there is more to do with the bytes that are available
+     */
+    bool step(BlockDevice* diff_bd, bd_size_t available, size_t max_bytes) {
+        if (!running) return false;
+
+        if (available > diff_size) {
+            available = diff_size;
+        }
+
+        size_t budget = max_bytes;
+        while (running && budget > 0) {
+            size_t used = state == STATE_EQL ? copy_source(budget) : decode(diff_bd, available);
+
+            // waiting for the next fragment, or for the gap to be filled
+            if (used == 0) return false;
+
+            budget -= used < budget ? used : budget;
+        }
+        return running;
+    }
+
+    /**
+     * Apply the rest of the diff, once it is complete
+     *
+     * @returns BD_ERROR_OK if the target is complete
+     */
+    int finish(BlockDevice* diff_bd) {
+        while (step(diff_bd, diff_size, (size_t)-1)) {}
+
+        if (complete) return BD_ERROR_OK;
+        return error != BD_ERROR_OK ? error : BD_ERROR_DEVICE_ERROR;
+    }
+
+    bool is_running() const {
+        return running;
+    }
+
+    /**
+     * Whether the whole diff was applied, and the patched firmware is in flash
+     */
+    bool is_complete() const {
+        return complete;
+    }
+
+    /**
+     * Error that stopped patching: a flash error, or BD_ERROR_DEVICE_ERROR for a diff that janpatch
+     * would not apply either. BD_ERROR_OK if there was none.
+     */
+    int get_error() const {
+        return error;
+    }
+
+    bd_addr_t get_diff_address() const {
+        return diff_addr;
+    }
+
+    bd_addr_t get_target_address() const {
+        return target_addr;
+    }
+
+    /**
+     * Number of diff bytes that were applied
+     */
+    bd_size_t get_diff_offset() const {
+        return diff_pos;
+    }
+
+    /**
+     * Size of the patched firmware so far
+     */
+    bd_size_t get_target_size() const {
+        return target_written + page_fill;
+    }
+
+private:
+    enum {
+        STATE_OP,       // expecting ESC and an opcode
+        STATE_MOD,      // data that replaces source bytes
+        STATE_INS,      // data that is inserted
+        STATE_EQL       // copying source bytes
+    };
+
+    void reset() {
+        complete = false;
+        error = BD_ERROR_OK;
+        state = STATE_OP;
+        diff_pos = 0;
+        source_pos = 0;
+        eql_remaining = 0;
+        target_written = 0;
+        page_fill = 0;
+        window_start = 0;
+        window_length = 0;
+    }
+
+    /**
+     * Consume the next operation, or the next data byte of a MOD or INS
+     *
+     * @returns number of diff bytes consumed, 0 if the diff bytes that are needed are not available
+     *          (or patching stopped)
+     */
+    size_t decode(BlockDevice* diff_bd, bd_size_t available) {
+        uint8_t b[6];
+
+        if (diff_pos >= diff_size) {
+            return finish_target();
+        }
+
+        if (state == STATE_OP) {
+            if (!peek(diff_bd, available, 0, &b[0])) return 0;
+
+            // a lone ESC at the end of the diff is ignored
+            if (b[0] == DELTA_PATCH_ESC && diff_pos + 1 == diff_size) {
+                diff_pos++;
+                return 1;
+            }
+
+            if (!peek(diff_bd, available, 1, &b[1])) return 0;
+
+            if (b[0] != DELTA_PATCH_ESC) {
+                return fail(BD_ERROR_DEVICE_ERROR);
+            }
+
+            switch (b[1]) {
+                case DELTA_PATCH_MOD:
+                    state = STATE_MOD;
+                    diff_pos += 2;
+                    return 2;
+
+                case DELTA_PATCH_INS:
+                    state = STATE_INS;
+                    diff_pos += 2;
+                    return 2;
+
+                case DELTA_PATCH_EQL:
+                case DELTA_PATCH_DEL:
+                case DELTA_PATCH_BKT:
+                    return decode_length_op(diff_bd, available, b[1]);
+
+                default:
+                    return fail(BD_ERROR_DEVICE_ERROR);
+            }
+        }
+
+        // data of a MOD or INS, until the next operation
+        if (!peek(diff_bd, available, 0, &b[0])) return 0;
+
+        if (b[0] != DELTA_PATCH_ESC) {
+            return put_data(b, 1, 1);
+        }
+
+        // a lone ESC at the end of the diff is ignored
+        if (diff_pos + 1 == diff_size) {
+            diff_pos++;
+            return 1;
+        }
+
+        if (!peek(diff_bd, available, 1, &b[1])) return 0;
+
+        if (b[1] == DELTA_PATCH_ESC) {
+            // ESC ESC is a single ESC in the data: jdiff escapes a data ESC that is followed by an
+            // opcode (or ESC) this way, so both bytes are consumed and one ESC is written, like
+            // process_mod in janpatch
+            return put_data(b, 1, 2);
+        }
+        if (b[1] >= DELTA_PATCH_BKT && b[1] <= DELTA_PATCH_MOD) {
+            // the next operation
+            state = STATE_OP;
+            return decode(diff_bd, available);
+        }
+        // an ESC that does not start an operation is data
+        return put_data(b, 2, 2);
+    }
+
+    /**
+     * EQL, DEL and BKT are followed by a length of 1 to 5 bytes: 0..251 is the length minus one,
+     * 252 adds the next byte to 253, 253 is followed by 2 and 254 by 4 bytes big endian
+     */
+    size_t decode_length_op(BlockDevice* diff_bd, bd_size_t available, uint8_t op) {
+        uint8_t b[4];
+        if (!peek(diff_bd, available, 2, &b[0])) return 0;
+
+        size_t extra = b[0] == 252 ? 1 : b[0] == 253 ? 2 : b[0] == 254 ? 4 : 0;
+        if (b[0] == 255) {
+            return fail(BD_ERROR_DEVICE_ERROR);
+        }
+
+        uint32_t length = 0;
+        for (size_t ix = 0; ix < extra; ix++) {
+            if (!peek(diff_bd, available, 3 + ix, &b[ix])) return 0;
+            length = (length << 8) | b[ix];
+        }
+
+        if (extra == 0) {
+            length = (uint32_t)b[0] + 1;
+        }
+        else if (extra == 1) {
+            length += 253;
+        }
+
+        switch (op) {
+            case DELTA_PATCH_EQL:
+                state = STATE_EQL;
+                eql_remaining = length;
+                break;
+
+            case DELTA_PATCH_DEL:
+                source_pos += length;
+                break;
+
+            case DELTA_PATCH_BKT:
+                if (length > source_pos) return fail(BD_ERROR_DEVICE_ERROR);
+                source_pos -= length;
+                break;
+        }
+
+        diff_pos += 3 + extra;
+        return 3 + extra;
+    }
+
+    /**
+     * Write data bytes of a MOD or INS to the target
+     *
+     * @returns consumed, or 0 if patching stopped
+     */
+    size_t put_data(const uint8_t* data, size_t length, size_t consumed) {
+        for (size_t ix = 0; ix < length; ix++) {
+            if (!put_target(data[ix])) return 0;
+        }
+
+        if (state == STATE_MOD) {
+            source_pos += length;
+        }
+
+        diff_pos += consumed;
+        return consumed;
+    }
+
+    /**
+     * Copy source bytes of an EQL to the target, straight into the page buffer
+     *
+     * @returns number of bytes copied, 0 if patching stopped
+     */
+    size_t copy_source(size_t max_bytes) {
+        bd_size_t length = eql_remaining;
+        if (length > page_size - page_fill) length = page_size - page_fill;
+        if (length > max_bytes) length = max_bytes;
+
+        if (source_pos + length > source_size) {
+            return fail(BD_ERROR_DEVICE_ERROR);
+        }
+
+        int r = bd->read(page + page_fill, source_addr + source_pos, length);
+        if (r != BD_ERROR_OK) return fail(r);
+
+        page_fill += length;
+        source_pos += length;
+        eql_remaining -= length;
+        if (eql_remaining == 0) {
+            state = STATE_OP;
+        }
+
+        if (page_fill == page_size && program_page() != BD_ERROR_OK) return 0;
+        return length;
+    }
+
+    bool put_target(uint8_t c) {
+        page[page_fill++] = c;
+        if (page_fill < page_size) return true;
+
+        return program_page() == BD_ERROR_OK;
+    }
+
+    int program_page() {
+        if (target_written + page_fill > target_max_size) {
+            return fail(BD_ERROR_DEVICE_ERROR);
+        }
+
+        int r = bd->program(page, target_addr + target_written, page_fill);
+        if (r != BD_ERROR_OK) {
+            fail(r);
+            return r;
+        }
+
+        target_written += page_fill;
+        page_fill = 0;
+        return BD_ERROR_OK;
+    }
+
+    /**
+     * Program the last, partial, page of the target
+     *
+     * @returns 0, patching stopped
+     */
+    size_t finish_target() {
+        if (page_fill > 0 && program_page() != BD_ERROR_OK) return 0;
+
+        cancel();
+        complete = true;
+        return 0;
+    }
+
+    /**
+     * @returns 0, for the decode functions to return
+     */
+    size_t fail(int aerror) {
+        error = aerror;
+        cancel();
+        return 0;
+    }
+
+    /**
+     * Diff byte at diff_pos + index, through a small window
+     *
+     * @returns false if that byte is not available (yet), or could not be read
+     */
+    bool peek(BlockDevice* diff_bd, bd_size_t available, bd_size_t index, uint8_t* out) {
+        bd_size_t pos = diff_pos + index;
+        if (pos >= available) return false;
+
+        if (pos < window_start || pos >= window_start + window_length) {
+            bd_size_t length = available - diff_pos;
+            if (length > sizeof(window)) length = sizeof(window);
+
+            int r = diff_bd->read(window, diff_addr + diff_pos, length);
+            if (r != BD_ERROR_OK) {
+                fail(r);
+                return false;
+            }
+
+            window_start = diff_pos;
+            window_length = length;
+        }
+
+        *out = window[pos - window_start];
+        return true;
+    }
+
+    BlockDevice* bd;
+    bd_size_t page_size;
+    uint8_t* page;              // target page that is being filled
+    bool running;
+    bool complete;
+    int error;
+
+    bd_addr_t diff_addr;
+    bd_size_t diff_size;
+    bd_addr_t source_addr;
+    bd_size_t source_size;
+    bd_addr_t target_addr;
+    bd_size_t target_max_size;
+
+    uint8_t state;              // STATE_*
+    bd_size_t diff_pos;         // diff bytes consumed
+    bd_size_t source_pos;       // position in the old firmware
+    bd_size_t eql_remaining;    // source bytes left to copy
+    bd_size_t target_written;   // bytes of the target programmed
+    bd_size_t page_fill;        // bytes in the page buffer
+
+    uint8_t window[DELTA_PATCH_STREAM_BUFFER_SIZE];
+    bd_size_t window_start;     // diff offset of window[0]
+    bd_size_t window_length;
+};
+
+#endif
@@ -0,0 +1,130 @@
+/*
+* PackageLicenseDeclared: Apache-2.0
+* Copyright (c) 2017 ARM Limited
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*     http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+
+#ifndef __FLASH_ERASE_AHEAD_H__
+#define __FLASH_ERASE_AHEAD_H__
+
+#include "mbed.h"
+#include "BlockDevice.h"
+
+// erase blocks of this many erase units per step(), so a step never holds up a received frame for long
+#ifndef FLASH_ERASE_AHEAD_CHUNK_PAGES
+#define FLASH_ERASE_AHEAD_CHUNK_PAGES   8
+#endif
+
+/**
+ * Erases a flash region in small steps before data is written to it, so the writes only need to
+ * program. RadioEvent erases the region of the firmware session with it while the device waits for
+ * the Class C session to start, and calls step() on the Rx worker thread whenever no frames are waiting.
+ * This only saves time with a driver that programs erased pages without erasing them again, the at45
+ * driver always erases, so it is off by default (frag-erase-ahead).
+ *
+ * Not thread safe: start(), step() and cancel() are called from the same thread.
+ */
+class FlashEraseAhead {
+public:
+    FlashEraseAhead(BlockDevice* abd)
+        : bd(abd), start_addr(0), end_addr(0), position(0), running(false), error(BD_ERROR_OK)
+    {
+    }
+
+    /**
+     * Start erasing a region, rounded out to whole erase units. Stops erasing the previous region.
+     */
+    void start(bd_addr_t addr, bd_size_t size) {
+        bd_size_t erase_size = bd->get_erase_size();
+
+        start_addr = addr / erase_size * erase_size;
+        end_addr = (addr + size + erase_size - 1) / erase_size * erase_size;
+        position = start_addr;
+        running = end_addr > start_addr;
+        error = BD_ERROR_OK;
+    }
+
+    /**
+     * Stop erasing, e.g. because data is written to the region. The region is then not ready.
+     */
+    void cancel() {
+        running = false;
+    }
+
+    /**
+     * Erase the next chunk, which ends on a multiple of FLASH_ERASE_AHEAD_CHUNK_PAGES erase units so
+     * the driver can erase whole blocks
+     *
+     * @returns true if there is more to erase
+     */
+    bool step() {
+        if (!running) return false;
+
+        bd_size_t chunk = bd->get_erase_size() * FLASH_ERASE_AHEAD_CHUNK_PAGES;
+        bd_addr_t next = (position / chunk + 1) * chunk;
+        if (next > end_addr) next = end_addr;
+
+        int r = bd->erase(position, next - position);
+        if (r != BD_ERROR_OK) {
+            error = r;
+            running = false;
+            return false;
+        }
+
+        position = next;
+        running = position < end_addr;
+        return running;
+    }
+
+    bool is_running() const {
+        return running;
+    }
+
+    /**
+     * Whether the whole region was erased
+     */
+    bool is_ready() const {
+        return !running && error == BD_ERROR_OK && end_addr > start_addr && position >= end_addr;
+    }
+
+    /**
+     * Part of the region that is erased, in percent
+     */
+    uint8_t get_progress() const {
+        if (end_addr <= start_addr) return 0;
+        return (uint8_t)((uint64_t)(position - start_addr) * 100 / (end_addr - start_addr));
+    }
+
+    bd_size_t get_erased() const {
+        return position - start_addr;
+    }
+
+    /**
+     * Error of the last erase, BD_ERROR_OK if there was none
+     */
+    int get_error() const {
+        return error;
+    }
+
+private:
+    BlockDevice* bd;
+    bd_addr_t start_addr;
+    bd_addr_t end_addr;
+    bd_addr_t position;         // everything before this is erased
+    bool running;
+    int error;
+};
+
+#endif
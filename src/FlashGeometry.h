@@ -0,0 +1,83 @@
+/*
+* PackageLicenseDeclared: Apache-2.0
+* Copyright (c) 2017 ARM Limited
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*     http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+
+#ifndef __FLASH_GEOMETRY_H__
+#define __FLASH_GEOMETRY_H__
+
+#include "mbed.h"
+#include "BlockDevice.h"
+
+/**
+ * Page arithmetic of a flash chip. The AT45 comes with 528 byte pages, or 512 byte pages when it is
+ * configured for binary page mode; the driver reports which one it uses at init. With a power of two
+ * page size, the conversions between addresses and pages are shifts and masks instead of divisions.
+ */
+class FlashGeometry {
+public:
+    FlashGeometry(bd_size_t apage_size = 1) {
+        set_page_size(apage_size);
+    }
+
+    void set_page_size(bd_size_t apage_size) {
+        page_size = apage_size > 0 ? apage_size : 1;
+
+        page_shift = 0;
+        while (((bd_size_t)1 << page_shift) < page_size) page_shift++;
+        if (((bd_size_t)1 << page_shift) != page_size) page_shift = NOT_POWER_OF_TWO;
+    }
+
+    bd_size_t get_page_size() const {
+        return page_size;
+    }
+
+    /**
+     * Whether the chip is in binary page mode (or has power of two pages anyway)
+     */
+    bool is_power_of_two() const {
+        return page_shift != NOT_POWER_OF_TWO;
+    }
+
+    /**
+     * Page that holds an address
+     */
+    bd_addr_t get_page(bd_addr_t addr) const {
+        return is_power_of_two() ? addr >> page_shift : addr / page_size;
+    }
+
+    /**
+     * Offset of an address in its page
+     */
+    bd_size_t get_offset(bd_addr_t addr) const {
+        return is_power_of_two() ? addr & (page_size - 1) : addr % page_size;
+    }
+
+    /**
+     * Address of the start of a page
+     */
+    bd_addr_t get_address(bd_addr_t page) const {
+        return is_power_of_two() ? page << page_shift : page * page_size;
+    }
+
+private:
+    static const uint8_t NOT_POWER_OF_TWO = 0xff;
+
+    bd_size_t page_size;
+    uint8_t page_shift;
+};
+
+#endif
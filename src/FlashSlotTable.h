@@ -0,0 +1,257 @@
+/*
+* PackageLicenseDeclared: Apache-2.0
+* Copyright (c) 2017 ARM Limited
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*     http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+
+#ifndef __FLASH_SLOT_TABLE_H__
+#define __FLASH_SLOT_TABLE_H__
+
+#include "mbed.h"
+#include "BlockDevice.h"
+#include "UpdateParameters.h"
+
+#define FLASH_SLOT_TABLE_LEGACY_OFFSET  128     // Offset of the table on the info page, where earlier releases stored it
+#define FLASH_SLOT_TABLE_MAX_SLOTS      16
+
+// Type of a flash slot, the index tells slots of the same type apart
+#define FLASH_SLOT_RECEIVE          1       // firmware packages (FragSession 0), index 0 and 1 are the A and B slot
+#define FLASH_SLOT_OLD_FW           2       // copy of the running firmware for diffs, written by the bootloader
+#define FLASH_SLOT_DATA_BLOCK       3       // data blocks, index is the FragSession (1..3)
+#define FLASH_SLOT_SCRATCH          4       // parity rows of the flash decoder, index is the FragSession
+#define FLASH_SLOT_CHECKPOINT       5       // checkpoints, index is the FragSession
+#define FLASH_SLOT_JOURNAL          6       // journal of the update parameters
+
+typedef struct {
+    uint8_t type;                       // FLASH_SLOT_*
+    uint8_t index;
+    uint16_t first_page;
+    uint16_t page_count;
+} FlashSlot_t;
+
+typedef struct {
+    uint32_t signature;                 // MAGIC when the table is valid
+    uint16_t version;                   // VERSION of the layout of this struct
+    uint16_t count;                     // number of slots in use
+    FlashSlot_t slots[FLASH_SLOT_TABLE_MAX_SLOTS];
+    uint32_t checksum;                  // FNV-1a over everything before it
+} FlashSlotTableData_t;
+
+/**
+ * Table of the regions ("slots") on the AT45, stored on a page of its own (FLASH_SLOT_TABLE_PAGE).
+ *
+ * The bootloader only reads UpdateParams_t on the info page, which holds the address of the update, and
+ * writes the copy of the running firmware to FOTA_DIFF_OLD_FW_PAGE, so everything else can be moved or
+ * resized by saving another table. The bootloader does not read the table. It is not on the info page,
+ * because the application and the bootloader program UpdateParams_t there on every update, which
+ * rewrites the whole page, and a reset during that would take the layout with it.
+ *
+ * Tables stored on the info page by earlier releases are moved to the table page. Devices without a
+ * table (or with an older version) get the default layout, which matches the fixed pages of earlier
+ * releases, with the old diff target region as the second receive slot.
+ */
+class FlashSlotTable {
+public:
+    static const uint32_t MAGIC = 0x1BEAC510;
+    static const uint16_t VERSION = 1;
+
+    /**
+     * @param abd Block device the table and the slots are on
+     * @param atable_page Page the table is stored on
+     * @param ainfo_page Page with UpdateParams_t, which no slot may cover either
+     */
+    FlashSlotTable(BlockDevice* abd, uint32_t atable_page, uint32_t ainfo_page)
+        : bd(abd), table_page(atable_page), info_page(ainfo_page)
+    {
+        memset(&table, 0, sizeof(table));
+    }
+
+    /**
+     * Read the table from flash. A table on the info page (earlier releases) is moved to the table page.
+     * If there is no valid table of this version, store the default layout.
+     */
+    int load() {
+        bool valid;
+        int r = read(get_address(), &valid);
+        if (r != BD_ERROR_OK || valid) return r;
+
+        r = read((bd_addr_t)info_page * bd->get_read_size() + FLASH_SLOT_TABLE_LEGACY_OFFSET, &valid);
+        if (r != BD_ERROR_OK) return r;
+
+        if (valid) {
+            printf("Moving the flash slot table from the info page to page 0x%lx\n", table_page);
+            return save();
+        }
+
+        printf("No valid flash slot table on page 0x%lx, storing the default layout\n", table_page);
+        if (!set_default_layout()) {
+            printf("Flash of %lu bytes does not hold all slots of the default layout\n", (uint32_t)bd->size());
+        }
+        return save();
+    }
+
+    /**
+     * Write the table to flash
+     */
+    int save() {
+        table.signature = MAGIC;
+        table.version = VERSION;
+        table.checksum = checksum(&table);
+
+        return bd->program(&table, get_address(), sizeof(table));
+    }
+
+    /**
+     * Remove all slots (in RAM, until save() is called)
+     */
+    void clear() {
+        memset(&table, 0, sizeof(table));
+    }
+
+    /**
+     * Add a slot (in RAM, until save() is called)
+     *
+     * @returns false if the table is full, the slot already exists, or its pages are outside the block
+     *          device, on the info page or the table page, or overlap another slot
+     */
+    bool add(uint8_t type, uint8_t index, uint16_t first_page, uint16_t page_count) {
+        if (table.count >= FLASH_SLOT_TABLE_MAX_SLOTS || page_count == 0 || find(type, index) != NULL) return false;
+
+        uint32_t end_page = (uint32_t)first_page + page_count;
+        if (end_page > bd->size() / bd->get_read_size()) return false;
+        if (first_page <= info_page && info_page < end_page) return false;
+        if (first_page <= table_page && table_page < end_page) return false;
+
+        for (uint16_t ix = 0; ix < table.count; ix++) {
+            const FlashSlot_t* slot = &table.slots[ix];
+            if (first_page < slot->first_page + slot->page_count && slot->first_page < end_page) return false;
+        }
+
+        FlashSlot_t* slot = &table.slots[table.count++];
+        slot->type = type;
+        slot->index = index;
+        slot->first_page = first_page;
+        slot->page_count = page_count;
+        return true;
+    }
+
+    /**
+     * The layout of earlier releases (see UpdateParameters.h). Slots that don't fit on the block device
+     * (e.g. a smaller chip) are left out, find() returns NULL for them.
+     *
+     * @returns false if a slot was left out
+     */
+    bool set_default_layout() {
+        clear();
+
+        bool complete = add(FLASH_SLOT_JOURNAL, 0, FOTA_JOURNAL_PAGE, FOTA_JOURNAL_PAGES);
+
+        for (uint8_t index = 0; index < 4; index++) {
+            complete &= add(FLASH_SLOT_CHECKPOINT, index, FRAG_CHECKPOINT_PAGE + index * FRAG_CHECKPOINT_PAGES, FRAG_CHECKPOINT_PAGES);
+        }
+
+        complete &= add(FLASH_SLOT_RECEIVE, 0, FOTA_UPDATE_PAGE, FOTA_DIFF_OLD_FW_PAGE - FOTA_UPDATE_PAGE);
+        complete &= add(FLASH_SLOT_OLD_FW, 0, FOTA_DIFF_OLD_FW_PAGE, FOTA_DIFF_TARGET_PAGE - FOTA_DIFF_OLD_FW_PAGE);
+        complete &= add(FLASH_SLOT_RECEIVE, 1, FOTA_DIFF_TARGET_PAGE, FRAG_DATA_BLOCK_PAGE - FOTA_DIFF_TARGET_PAGE);
+
+        for (uint8_t index = 1; index < 4; index++) {
+            complete &= add(FLASH_SLOT_DATA_BLOCK, index, FRAG_DATA_BLOCK_PAGE + (index - 1) * FRAG_DATA_BLOCK_PAGES, FRAG_DATA_BLOCK_PAGES);
+        }
+
+        for (uint8_t index = 0; index < 4; index++) {
+            complete &= add(FLASH_SLOT_SCRATCH, index, FRAG_SCRATCH_PAGE + index * FRAG_SCRATCH_PAGES, FRAG_SCRATCH_PAGES);
+        }
+
+        return complete;
+    }
+
+    /**
+     * @returns the slot, or NULL if the table has no slot of this type and index
+     */
+    const FlashSlot_t* find(uint8_t type, uint8_t index) const {
+        for (uint16_t ix = 0; ix < table.count; ix++) {
+            if (table.slots[ix].type == type && table.slots[ix].index == index) return &table.slots[ix];
+        }
+        return NULL;
+    }
+
+    uint16_t get_count() const {
+        return table.count;
+    }
+
+    const FlashSlot_t* get(uint16_t ix) const {
+        return ix < table.count ? &table.slots[ix] : NULL;
+    }
+
+    /**
+     * Whether an address on the block device is in a slot
+     */
+    bool contains(const FlashSlot_t* slot, bd_addr_t address) const {
+        bd_size_t page_size = bd->get_read_size();
+        return address >= (bd_addr_t)slot->first_page * page_size &&
+            address < (bd_addr_t)(slot->first_page + slot->page_count) * page_size;
+    }
+
+private:
+    bd_addr_t get_address() const {
+        return (bd_addr_t)table_page * bd->get_read_size();
+    }
+
+    /**
+     * Read a table stored at an address, and replace the table in RAM with it if it is valid
+     *
+     * @param valid Set to whether there is a valid table of this version at the address
+     */
+    int read(bd_addr_t address, bool* valid) {
+        *valid = false;
+
+        FlashSlotTableData_t stored;
+        int r = bd->read(&stored, address, sizeof(stored));
+        if (r != BD_ERROR_OK) return r;
+
+        if (stored.signature != MAGIC || stored.version != VERSION || stored.count > FLASH_SLOT_TABLE_MAX_SLOTS ||
+                stored.checksum != checksum(&stored)) {
+            return BD_ERROR_OK;
+        }
+
+        clear();
+
+        // validate the slots like they were added one by one
+        for (uint16_t ix = 0; ix < stored.count; ix++) {
+            const FlashSlot_t* slot = &stored.slots[ix];
+            if (!add(slot->type, slot->index, slot->first_page, slot->page_count)) return BD_ERROR_OK;
+        }
+
+        *valid = true;
+        return BD_ERROR_OK;
+    }
+
+    static uint32_t checksum(const FlashSlotTableData_t* data) {
+        const uint8_t* bytes = (const uint8_t*)data;
+        uint32_t hash = 2166136261UL;
+
+        for (size_t ix = 0; ix < offsetof(FlashSlotTableData_t, checksum); ix++) {
+            hash = (hash ^ bytes[ix]) * 16777619UL;
+        }
+        return hash;
+    }
+
+    BlockDevice* bd;
+    uint32_t table_page;
+    uint32_t info_page;
+    FlashSlotTableData_t table;
+};
+
+#endif
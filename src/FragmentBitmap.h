@@ -0,0 +1,153 @@
+/*
+* PackageLicenseDeclared: Apache-2.0
+* Copyright (c) 2017 ARM Limited
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*     http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#ifndef __FRAGMENT_BITMAP_H__
+#define __FRAGMENT_BITMAP_H__
+
+#include "mbed.h"
+
+/**
+ * One bit per fragment, indexed by the 1-based fragment index used in DATA_FRAGMENT
+ */
+class FragmentBitmap {
+public:
+    FragmentBitmap(uint16_t anb_frag) : nb_frag(anb_frag), bits(NULL), count(0) {}
+
+    ~FragmentBitmap() {
+        if (bits) free(bits);
+    }
+
+    /**
+     * Allocate the bitmap
+     *
+     * @returns false if there was not enough memory
+     */
+    bool initialize() {
+        bits = (uint8_t*)calloc(get_bits_size(), 1);
+        return bits != NULL;
+    }
+
+    /**
+     * Mark a fragment as present
+     *
+     * @returns true if the fragment was not marked before
+     */
+    bool set(uint16_t index) {
+        if (index == 0 || index > nb_frag) return false;
+
+        uint8_t mask = 1 << ((index - 1) & 7);
+        uint8_t* byte = &bits[(index - 1) >> 3];
+        if (*byte & mask) return false;
+
+        *byte |= mask;
+        count++;
+        return true;
+    }
+
+    /**
+     * Mark a fragment as not present
+     *
+     * @returns true if the fragment was marked before
+     */
+    bool clear(uint16_t index) {
+        if (index == 0 || index > nb_frag) return false;
+
+        uint8_t mask = 1 << ((index - 1) & 7);
+        uint8_t* byte = &bits[(index - 1) >> 3];
+        if (!(*byte & mask)) return false;
+
+        *byte &= ~mask;
+        count--;
+        return true;
+    }
+
+    bool get(uint16_t index) const {
+        if (index == 0 || index > nb_frag) return false;
+        return bits[(index - 1) >> 3] & (1 << ((index - 1) & 7));
+    }
+
+    /**
+     * Number of fragments that are marked
+     */
+    uint16_t get_count() const {
+        return count;
+    }
+
+    uint16_t get_size() const {
+        return nb_frag;
+    }
+
+    /**
+     * Encode the fragments that are not marked as runs. Every run is 3 bytes: the first missing
+     * fragment (little endian, 14 bits) and the length of the run minus one.
+     *
+     * @param last Only look at fragments up to and including this index
+     * @param out Buffer for the runs
+     * @param out_size Size of out
+     * @param truncated Set to true if not all runs fit in out
+     * @returns Number of bytes written to out
+     */
+    size_t encode_missing_runs(uint16_t last, uint8_t* out, size_t out_size, bool* truncated) const {
+        size_t length = 0;
+        *truncated = false;
+
+        if (last > nb_frag) last = nb_frag;
+
+        uint16_t index = 1;
+        while (index <= last) {
+            if (get(index)) {
+                index++;
+                continue;
+            }
+
+            uint16_t start = index;
+            while (index <= last && !get(index) && index - start < 256) index++;
+
+            if (length + 3 > out_size) {
+                *truncated = true;
+                break;
+            }
+
+            out[length++] = start & 0xff;
+            out[length++] = (start >> 8) & 0x3f;
+            out[length++] = index - start - 1;
+        }
+
+        return length;
+    }
+
+    /**
+     * Raw bitmap, bit 0 of byte 0 is fragment 1
+     */
+    const uint8_t* get_bits() const {
+        return bits;
+    }
+
+    /**
+     * Size of the raw bitmap in bytes
+     */
+    size_t get_bits_size() const {
+        return (nb_frag + 7) / 8;
+    }
+
+private:
+    uint16_t nb_frag;
+    uint8_t* bits;
+    uint16_t count;
+};
+
+#endif
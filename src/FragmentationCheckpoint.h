@@ -0,0 +1,158 @@
+/*
+* PackageLicenseDeclared: Apache-2.0
+* Copyright (c) 2017 ARM Limited
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*     http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#ifndef __FRAGMENTATION_CHECKPOINT_H__
+#define __FRAGMENTATION_CHECKPOINT_H__
+
+#include "mbed.h"
+#include "BlockDevice.h"
+#include "ProtocolLayer.h"
+#include "FragmentBitmap.h"
+
+typedef struct {
+    uint32_t signature;                 // MAGIC when the checkpoint is valid
+    FTMPackageParams_t params;          // as received in FRAG_SESSION_SETUP_REQ
+} FragCheckpointHeader_t;
+
+/**
+ * Checkpoint of a fragmentation session in flash, so the session can be resumed after a reset.
+ *
+ * The checkpoint holds the session parameters, followed by the bitmap of uncoded fragments that
+ * are in flash. The bitmap is stored inverted (a 0 bit is a fragment that is in flash), because the
+ * AT45 programs a page by erasing it to all ones first: a page that is interrupted after the erase
+ * reads as no fragments (or, for the page with the header, as no checkpoint), and programming only
+ * clears bits of fragments that are in the new bitmap. An interrupted save() loses fragments, but
+ * never marks one that is not in flash. The caller needs to make sure the fragments themselves are
+ * programmed before save() is called.
+ */
+class FragmentationCheckpoint {
+public:
+    static const uint32_t MAGIC = 0x1BEAC0F6;
+
+    /**
+     * @param abd Block device to store the checkpoint on
+     * @param aaddress Address of the checkpoint, it needs get_size(NbFrag) bytes
+     */
+    FragmentationCheckpoint(BlockDevice* abd, bd_addr_t aaddress)
+        : bd(abd), address(aaddress)
+    {
+    }
+
+    /**
+     * Bytes a checkpoint takes in flash: the header, followed by one bit per fragment
+     */
+    static bd_size_t get_size(uint16_t nb_frag) {
+        return sizeof(FragCheckpointHeader_t) + (nb_frag + 7) / 8;
+    }
+
+    /**
+     * Start a new checkpoint for a session, with no fragments received
+     */
+    int start(const FTMPackageParams_t* params) {
+        int r = clear();
+        if (r != BD_ERROR_OK) return r;
+
+        // empty bitmap first, then make it valid
+        uint8_t none[32];
+        memset(none, 0xff, sizeof(none));
+
+        size_t bitmap_size = (params->NbFrag + 7) / 8;
+        for (size_t ix = 0; ix < bitmap_size; ix += sizeof(none)) {
+            size_t length = bitmap_size - ix < sizeof(none) ? bitmap_size - ix : sizeof(none);
+
+            r = bd->program(none, address + sizeof(FragCheckpointHeader_t) + ix, length);
+            if (r != BD_ERROR_OK) return r;
+        }
+
+        FragCheckpointHeader_t header;
+        memset(&header, 0, sizeof(header));
+        header.signature = MAGIC;
+        header.params = *params;
+        return bd->program(&header, address, sizeof(header));
+    }
+
+    /**
+     * Store which fragments are in flash
+     */
+    int save(const FragmentBitmap* received) {
+        size_t bitmap_size = received->get_bits_size();
+
+        // inverted in one buffer, so every page is programmed once
+        uint8_t* bits = (uint8_t*)malloc(bitmap_size);
+        if (bits == NULL) return BD_ERROR_DEVICE_ERROR;
+
+        for (size_t ix = 0; ix < bitmap_size; ix++) {
+            bits[ix] = ~received->get_bits()[ix];
+        }
+
+        int r = bd->program(bits, address + sizeof(FragCheckpointHeader_t), bitmap_size);
+        free(bits);
+        return r;
+    }
+
+    /**
+     * Read the session parameters
+     *
+     * @returns false if there is no valid checkpoint
+     */
+    bool read_params(FTMPackageParams_t* params) {
+        FragCheckpointHeader_t header;
+        if (bd->read(&header, address, sizeof(header)) != BD_ERROR_OK) return false;
+        if (header.signature != MAGIC) return false;
+
+        *params = header.params;
+        return true;
+    }
+
+    /**
+     * Read the fragments that are in flash, and mark them in a bitmap
+     */
+    int load(FragmentBitmap* received) {
+        uint8_t buffer[32];
+
+        size_t bitmap_size = received->get_bits_size();
+        for (size_t ix = 0; ix < bitmap_size; ix += sizeof(buffer)) {
+            size_t length = bitmap_size - ix < sizeof(buffer) ? bitmap_size - ix : sizeof(buffer);
+
+            int r = bd->read(buffer, address + sizeof(FragCheckpointHeader_t) + ix, length);
+            if (r != BD_ERROR_OK) return r;
+
+            for (size_t byte = 0; byte < length; byte++) {
+                for (uint8_t bit = 0; bit < 8; bit++) {
+                    if (!(buffer[byte] & (1 << bit))) {
+                        received->set(((ix + byte) * 8) + bit + 1);
+                    }
+                }
+            }
+        }
+        return BD_ERROR_OK;
+    }
+
+    /**
+     * Invalidate the checkpoint
+     */
+    int clear() {
+        uint32_t signature = 0;
+        return bd->program(&signature, address, sizeof(signature));
+    }
+
+private:
+    BlockDevice* bd;
+    bd_addr_t address;
+};
+
+#endif
@@ -0,0 +1,228 @@
+/*
+* PackageLicenseDeclared: Apache-2.0
+* Copyright (c) 2017 ARM Limited
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*     http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#ifndef __FRAGMENTATION_DIGEST_H__
+#define __FRAGMENTATION_DIGEST_H__
+
+#include "mbed.h"
+#include "BlockDevice.h"
+#include "mbedtls/sha256.h"
+#include "FragmentBitmap.h"
+#include "BlockDeviceStreamReader.h"
+
+#ifndef FRAGMENTATION_DIGEST_BUFFER_SIZE
+#define FRAGMENTATION_DIGEST_BUFFER_SIZE    128
+#endif
+
+/**
+ * Running CRC64 and SHA256 over a data block that arrives in fragments.
+ *
+ * Fragments that arrive in order are hashed straight from the radio buffer, so for a lossless
+ * session both digests are ready when the last fragment lands. At the first missing fragment the
+ * digest stalls; once the gap is filled it catches up by reading the fragments that came in
+ * meanwhile back from flash, at most MBED_CONF_APP_DIGEST_CATCHUP_BYTES per fragment so the Rx path
+ * stays short. Whatever is left (e.g. fragments recovered through parity) is read back in finish().
+ *
+ * The CRC64 is the same Jones CRC64 as FragmentationCrc64 calculates over flash.
+ * The SHA256 skips the first sha_skip bytes (the signature header of an update package).
+ */
+class FragmentationDigest {
+public:
+    /**
+     * @param abd Block device the fragments are stored on
+     * @param aflash_offset Offset of the first fragment on the block device
+     * @param nb_frag Number of fragments
+     * @param afrag_size Size of a fragment
+     * @param asize Size of the data block (NbFrag * FragSize - Padding)
+     * @param asha_skip Number of bytes at the start of the block that are not part of the SHA256 hash
+     */
+    FragmentationDigest(BlockDevice* abd, size_t aflash_offset, uint16_t nb_frag, uint8_t afrag_size, size_t asize, size_t asha_skip)
+        : bd(abd), flash_offset(aflash_offset), frag_size(afrag_size), size(asize), sha_skip(asha_skip),
+          received(nb_frag), next_index(1), offset(0), crc(0), catchup_bytes(0)
+    {
+        mbedtls_sha256_init(&sha);
+    }
+
+    ~FragmentationDigest() {
+        mbedtls_sha256_free(&sha);
+    }
+
+    /**
+     * @returns false if there was not enough memory
+     */
+    bool initialize() {
+        if (!received.initialize()) return false;
+
+        mbedtls_sha256_starts(&sha, 0);
+        return true;
+    }
+
+    /**
+     * Process an uncoded fragment, after it was written to flash
+     *
+     * @param index 1-based fragment index
+     * @param data Fragment data
+     * @param length Length of the fragment
+     */
+    void process_fragment(uint16_t index, const uint8_t* data, size_t length) {
+        if (!received.set(index)) return;
+
+        if (index == next_index) {
+            update(data, length < frag_size ? length : frag_size);
+            next_index++;
+        }
+
+        catch_up(MBED_CONF_APP_DIGEST_CATCHUP_BYTES);
+    }
+
+    /**
+     * Hash the rest of the data block from flash, and return the digests
+     *
+     * @param crc_out CRC64 of the data block
+     * @param sha_out SHA256 hash of the data block, without the first sha_skip bytes
+     */
+    void finish(uint64_t* crc_out, unsigned char sha_out[32]) {
+        if (offset < size) {
+            BlockDeviceStreamReader reader(bd, flash_offset + offset, size - offset);
+            if (reader.initialize()) {
+                const uint8_t* data;
+                size_t length;
+                while ((length = reader.next(&data)) > 0) {
+                    catchup_bytes += length;
+                    update(data, length);
+                }
+            }
+        }
+
+        // without heap for the reader, or after a read error
+        uint8_t buffer[FRAGMENTATION_DIGEST_BUFFER_SIZE];
+        while (offset < size) {
+            size_t length = size - offset;
+            if (length > sizeof(buffer)) length = sizeof(buffer);
+
+            bd->read(buffer, flash_offset + offset, length);
+            catchup_bytes += length;
+            update(buffer, length);
+        }
+
+        *crc_out = crc;
+        mbedtls_sha256_finish(&sha, sha_out);
+    }
+
+    /**
+     * Number of bytes that were read back from flash
+     */
+    size_t get_catchup_bytes() const {
+        return catchup_bytes;
+    }
+
+    /**
+     * Uncoded fragments that were processed
+     */
+    const FragmentBitmap* get_received() const {
+        return &received;
+    }
+
+    /**
+     * Number of bytes that were hashed so far
+     */
+    size_t get_offset() const {
+        return offset;
+    }
+
+private:
+    /**
+     * Hash fragments that are already in flash and directly follow the hashed data
+     */
+    void catch_up(size_t max_bytes) {
+        uint8_t buffer[FRAGMENTATION_DIGEST_BUFFER_SIZE];
+        size_t budget = max_bytes;
+
+        while (received.get(next_index) && offset < size) {
+            size_t fragment_end = (size_t)next_index * frag_size;
+            if (fragment_end > size) fragment_end = size;
+
+            while (offset < fragment_end) {
+                if (budget == 0) return;
+
+                size_t length = fragment_end - offset;
+                if (length > sizeof(buffer)) length = sizeof(buffer);
+                if (length > budget) length = budget;
+
+                bd->read(buffer, flash_offset + offset, length);
+                catchup_bytes += length;
+                budget -= length;
+                update(buffer, length);
+            }
+
+            next_index++;
+        }
+    }
+
+    void update(const uint8_t* data, size_t length) {
+        if (offset + length > size) {
+            length = size - offset;
+        }
+
+        crc = crc64(crc, data, length);
+
+        if (offset + length > sha_skip) {
+            size_t skip = offset < sha_skip ? sha_skip - offset : 0;
+            mbedtls_sha256_update(&sha, data + skip, length - skip);
+        }
+
+        offset += length;
+    }
+
+    static uint64_t crc64(uint64_t c, const uint8_t* data, size_t length) {
+        // nibble table for the reflected Jones polynomial (0x95AC9329AC4BC9B5)
+        static const uint64_t table[16] = {
+            0x0000000000000000ULL, 0x7d08ff3b88be6f81ULL,
+            0xfa11fe77117cdf02ULL, 0x8719014c99c2b083ULL,
+            0xdf7adabd7a6e2d6fULL, 0xa2722586f2d042eeULL,
+            0x256b24ca6b12f26dULL, 0x5863dbf1e3ac9decULL,
+            0x95ac9329ac4bc9b5ULL, 0xe8a46c1224f5a634ULL,
+            0x6fbd6d5ebd3716b7ULL, 0x12b5926535897936ULL,
+            0x4ad64994d625e4daULL, 0x37deb6af5e9b8b5bULL,
+            0xb0c7b7e3c7593bd8ULL, 0xcdcf48d84fe75459ULL
+        };
+
+        for (size_t ix = 0; ix < length; ix++) {
+            c ^= data[ix];
+            c = (c >> 4) ^ table[c & 0xf];
+            c = (c >> 4) ^ table[c & 0xf];
+        }
+        return c;
+    }
+
+    BlockDevice* bd;
+    size_t flash_offset;
+    uint8_t frag_size;
+    size_t size;
+    size_t sha_skip;
+
+    FragmentBitmap received;
+    uint16_t next_index;        // first fragment that was not hashed yet
+    size_t offset;              // number of bytes hashed
+
+    uint64_t crc;
+    mbedtls_sha256_context sha;
+
+    size_t catchup_bytes;
+};
+
+#endif
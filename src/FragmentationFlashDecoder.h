@@ -0,0 +1,432 @@
+/*
+* PackageLicenseDeclared: Apache-2.0
+* Copyright (c) 2017 ARM Limited
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*     http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#ifndef __FRAGMENTATION_FLASH_DECODER_H__
+#define __FRAGMENTATION_FLASH_DECODER_H__
+
+#include "mbed.h"
+#include "mbed_lorawan_frag_lib.h"
+#include "FragmentBitmap.h"
+#include "FragmentationParityRows.h"
+#include "FragmentationXor.h"
+
+/**
+ * Decoder for fragmentation sessions that keeps its parity rows in flash, so the number of redundancy
+ * frames it can use is not limited by the heap. It has the same interface as FragmentationSession.
+ *
+ * Every redundancy frame is reduced (Gaussian elimination over GF(2)) against the fragments that were
+ * received and the rows that are stored already, until its first fragment is one that is missing and not
+ * the pivot of another row. It is then stored in a scratch region as a record: the row (one bit per
+ * fragment) followed by the data. When every fragment is either received or a pivot, the missing
+ * fragments are solved from the last to the first and written to flash.
+ *
+ * Only a few records are cached in RAM, the least recently used one is replaced on a miss.
+ */
+class FragmentationFlashDecoder {
+public:
+    /**
+     * @param aflash Block device with the fragments of the session
+     * @param aopts Session options, RedundancyPackets is the number of rows in the scratch region
+     * @param ascratch Block device with the scratch region
+     * @param ascratch_address Start of the scratch region, RedundancyPackets * get_record_stride() bytes
+     * @param acache_rows Number of records that are cached in RAM
+     */
+    FragmentationFlashDecoder(BlockDevice* aflash, FragmentationSessionOpts_t aopts, BlockDevice* ascratch,
+                              bd_addr_t ascratch_address, uint16_t acache_rows)
+        : flash(aflash), opts(aopts), scratch(ascratch), scratch_address(ascratch_address), cache_rows(acache_rows),
+          received(aopts.NumberOfFragments), pivots(aopts.NumberOfFragments), row_pivot(NULL), work(NULL), fragment(NULL),
+          cache(NULL), cache_row(NULL), cache_used(NULL), cache_clock(0), seen_frag(0), lost(0), dropped(0), hits(0), misses(0)
+    {
+        record_stride = get_record_stride(opts.NumberOfFragments, opts.FragmentSize, scratch->get_read_size());
+    }
+
+    ~FragmentationFlashDecoder() {
+        if (row_pivot) free(row_pivot);
+        if (work) free(work);
+        if (fragment) free(fragment);
+        if (cache) free(cache);
+        if (cache_row) free(cache_row);
+        if (cache_used) free(cache_used);
+    }
+
+    /**
+     * Allocate the bitmaps, buffers and the row cache
+     */
+    FragResult initialize() {
+        row_pivot = (uint16_t*)calloc(opts.RedundancyPackets, sizeof(uint16_t));
+        work = (uint8_t*)malloc(get_record_size());
+        fragment = (uint8_t*)malloc(opts.FragmentSize);
+        cache = (uint8_t*)malloc(cache_rows * get_record_size());
+        cache_row = (uint16_t*)malloc(cache_rows * sizeof(uint16_t));
+        cache_used = (uint32_t*)calloc(cache_rows, sizeof(uint32_t));
+
+        if (!received.initialize() || !pivots.initialize() || !row_pivot || !work || !fragment ||
+                !cache || !cache_row || !cache_used) {
+            return FRAG_NO_MEMORY;
+        }
+
+        for (uint16_t ix = 0; ix < cache_rows; ix++) {
+            cache_row[ix] = NO_ROW;
+        }
+        return FRAG_OK;
+    }
+
+    /**
+     * Process a fragment: uncoded fragments are written to flash, redundancy frames are reduced and stored
+     *
+     * @returns FRAG_COMPLETE when all fragments are in flash
+     */
+    FragResult process_frame(uint16_t frame_counter, uint8_t* buffer, size_t size) {
+        if (size != opts.FragmentSize) return FRAG_SIZE_INCORRECT;
+        if (frame_counter == 0) return FRAG_OK;
+
+        count_lost(frame_counter);
+
+        FragResult result;
+        if (frame_counter <= opts.NumberOfFragments) {
+            if (received.get(frame_counter)) return FRAG_OK;
+
+            if (flash->program(buffer, get_fragment_address(frame_counter), size) != BD_ERROR_OK) {
+                return FRAG_FLASH_WRITE_ERROR;
+            }
+
+            received.set(frame_counter);
+
+            // the row that has this fragment as its pivot is now an equation of the other missing fragments
+            result = FRAG_OK;
+            if (pivots.get(frame_counter)) {
+                uint16_t row = find_row(frame_counter);
+                const uint8_t* record = load_row(row);
+                if (record == NULL) return FRAG_FLASH_WRITE_ERROR;
+
+                memcpy(work, record, get_record_size());
+                remove_row(row);
+                result = reduce();
+            }
+        }
+        else {
+            FragmentationParityRows::generate(frame_counter - opts.NumberOfFragments, opts.NumberOfFragments, work);
+            memcpy(work + get_row_size(), buffer, size);
+            result = reduce();
+        }
+
+        if (result != FRAG_OK) return result;
+
+        if (received.get_count() + pivots.get_count() < opts.NumberOfFragments) return FRAG_OK;
+
+        return solve();
+    }
+
+    /**
+     * Mark an uncoded fragment that is in flash already as received, e.g. when the decoder starts
+     * after the first lost fragment. Call before any redundancy frame is processed.
+     */
+    void mark_received(uint16_t frame_counter) {
+        count_lost(frame_counter);
+        received.set(frame_counter);
+    }
+
+    /**
+     * Number of uncoded fragments that were not received when a later frame arrived
+     */
+    int get_lost_frame_count() const {
+        return lost;
+    }
+
+    /**
+     * Number of missing fragments that the stored rows will recover
+     */
+    uint16_t get_pivot_count() const {
+        return pivots.get_count();
+    }
+
+    /**
+     * Number of reduced rows that were dropped because the scratch region was full. Each of them
+     * would have recovered a missing fragment, which now needs a repair.
+     */
+    uint16_t get_dropped_row_count() const {
+        return dropped;
+    }
+
+    uint32_t get_cache_hits() const {
+        return hits;
+    }
+
+    uint32_t get_cache_misses() const {
+        return misses;
+    }
+
+    size_t get_row_size() const {
+        return (opts.NumberOfFragments + 7) / 8;
+    }
+
+    size_t get_record_size() const {
+        return get_row_size() + opts.FragmentSize;
+    }
+
+    /**
+     * Space a record takes in the scratch region: records start on a page, so storing a row
+     * programs whole pages
+     */
+    static bd_size_t get_record_stride(uint16_t nb_frag, uint8_t frag_size, bd_size_t page_size) {
+        bd_size_t record = ((nb_frag + 7) / 8) + frag_size;
+        return ((record + page_size - 1) / page_size) * page_size;
+    }
+
+private:
+    static const uint16_t NO_ROW = 0xffff;
+
+    /**
+     * Reduce the record in work and store it, if it has a fragment that is not recovered yet
+     */
+    FragResult reduce() {
+        uint8_t* row = work;
+        uint8_t* data = work + get_row_size();
+
+        // take out the fragments we have in one pass, they are half of a fresh parity row
+        const uint8_t* have = received.get_bits();
+        for (size_t byte = 0; byte < get_row_size(); byte++) {
+            uint8_t bits = row[byte] & have[byte];
+            for (uint8_t bit = 0; bits != 0; bit++, bits >>= 1) {
+                if (!(bits & 1)) continue;
+                if (!xor_fragment(data, (byte * 8) + bit + 1)) return FRAG_FLASH_WRITE_ERROR;
+            }
+            row[byte] &= ~have[byte];
+        }
+
+        size_t start = 0;
+        while (true) {
+            uint16_t pivot = first_fragment(row, &start);
+
+            // a combination of what we have already
+            if (pivot == 0) return FRAG_OK;
+
+            // received after a stored row that was combined in
+            if (received.get(pivot)) {
+                if (!xor_fragment(data, pivot)) return FRAG_FLASH_WRITE_ERROR;
+                row[(pivot - 1) >> 3] &= ~(1 << ((pivot - 1) & 7));
+                continue;
+            }
+
+            if (!pivots.get(pivot)) return store_row(pivot);
+
+            // stored rows have no fragments before their pivot, so only XOR from the current byte
+            const uint8_t* record = load_row(find_row(pivot));
+            if (record == NULL) return FRAG_FLASH_WRITE_ERROR;
+
+            frag_xor(work + start, record + start, get_record_size() - start);
+        }
+    }
+
+    /**
+     * Solve the missing fragments from the stored rows, last pivot first: the other fragments in
+     * a row come after its pivot, so they are received or solved already
+     */
+    FragResult solve() {
+        uint8_t* row = work;
+        uint8_t* data = work + get_row_size();
+
+        for (uint16_t pivot = opts.NumberOfFragments; pivot > 0; pivot--) {
+            if (!pivots.get(pivot) || received.get(pivot)) continue;
+
+            const uint8_t* record = load_row(find_row(pivot));
+            if (record == NULL) return FRAG_FLASH_WRITE_ERROR;
+
+            memcpy(work, record, get_record_size());
+            row[(pivot - 1) >> 3] &= ~(1 << ((pivot - 1) & 7));
+
+            size_t start = (pivot - 1) >> 3;
+            uint16_t index;
+            while ((index = first_fragment(row, &start)) != 0) {
+                if (!xor_fragment(data, index)) return FRAG_FLASH_WRITE_ERROR;
+                row[(index - 1) >> 3] &= ~(1 << ((index - 1) & 7));
+            }
+
+            if (flash->program(data, get_fragment_address(pivot), opts.FragmentSize) != BD_ERROR_OK) {
+                return FRAG_FLASH_WRITE_ERROR;
+            }
+            received.set(pivot);
+        }
+
+        return FRAG_COMPLETE;
+    }
+
+    /**
+     * Store the record in work in a free row of the scratch region
+     */
+    FragResult store_row(uint16_t pivot) {
+        uint16_t row = find_row(0);
+
+        // more fragments were lost than the scratch region can recover, drop the row
+        if (row == NO_ROW) {
+            dropped++;
+            return FRAG_OK;
+        }
+
+        if (scratch->program(work, get_row_address(row), get_record_size()) != BD_ERROR_OK) {
+            return FRAG_FLASH_WRITE_ERROR;
+        }
+
+        row_pivot[row] = pivot;
+        pivots.set(pivot);
+
+        // rows are mostly combined in soon after they are stored
+        uint16_t slot = get_cache_victim();
+        memcpy(cache + slot * get_record_size(), work, get_record_size());
+        cache_row[slot] = row;
+        cache_used[slot] = ++cache_clock;
+
+        return FRAG_OK;
+    }
+
+    void remove_row(uint16_t row) {
+        pivots.clear(row_pivot[row]);
+        row_pivot[row] = 0;
+
+        for (uint16_t slot = 0; slot < cache_rows; slot++) {
+            if (cache_row[slot] == row) cache_row[slot] = NO_ROW;
+        }
+    }
+
+    /**
+     * Record of a row in the scratch region, from the cache or read from flash
+     *
+     * @returns NULL if it could not be read
+     */
+    const uint8_t* load_row(uint16_t row) {
+        if (row == NO_ROW) return NULL;
+
+        for (uint16_t slot = 0; slot < cache_rows; slot++) {
+            if (cache_row[slot] != row) continue;
+
+            hits++;
+            cache_used[slot] = ++cache_clock;
+            return cache + slot * get_record_size();
+        }
+
+        misses++;
+
+        uint16_t slot = get_cache_victim();
+        uint8_t* record = cache + slot * get_record_size();
+        if (scratch->read(record, get_row_address(row), get_record_size()) != BD_ERROR_OK) {
+            cache_row[slot] = NO_ROW;
+            return NULL;
+        }
+
+        cache_row[slot] = row;
+        cache_used[slot] = ++cache_clock;
+        return record;
+    }
+
+    /**
+     * Empty or least recently used slot of the row cache
+     */
+    uint16_t get_cache_victim() {
+        uint16_t victim = 0;
+        for (uint16_t slot = 0; slot < cache_rows; slot++) {
+            if (cache_row[slot] == NO_ROW) return slot;
+            if (cache_used[slot] < cache_used[victim]) victim = slot;
+        }
+        return victim;
+    }
+
+    /**
+     * Row in the scratch region with this pivot, or a free row for pivot 0
+     */
+    uint16_t find_row(uint16_t pivot) {
+        for (uint16_t row = 0; row < opts.RedundancyPackets; row++) {
+            if (row_pivot[row] == pivot) return row;
+        }
+        return NO_ROW;
+    }
+
+    /**
+     * First fragment (1-based) in a row, from byte start on, which is moved to the byte it is in
+     *
+     * @returns 0 if the row is empty
+     */
+    uint16_t first_fragment(const uint8_t* row, size_t* start) {
+        for (; *start < get_row_size(); (*start)++) {
+            uint8_t bits = row[*start];
+            if (bits == 0) continue;
+
+            uint8_t bit = 0;
+            while (!(bits & 1)) {
+                bits >>= 1;
+                bit++;
+            }
+            return (*start * 8) + bit + 1;
+        }
+        return 0;
+    }
+
+    /**
+     * data ^= fragment index, read from flash
+     */
+    bool xor_fragment(uint8_t* data, uint16_t index) {
+        if (flash->read(fragment, get_fragment_address(index), opts.FragmentSize) != BD_ERROR_OK) return false;
+
+        frag_xor(data, fragment, opts.FragmentSize);
+        return true;
+    }
+
+    /**
+     * Count the uncoded fragments that were sent before this frame and did not arrive
+     */
+    void count_lost(uint16_t frame_counter) {
+        uint16_t before = frame_counter > opts.NumberOfFragments ? opts.NumberOfFragments : frame_counter - 1;
+
+        for (; seen_frag < before; seen_frag++) {
+            if (!received.get(seen_frag + 1)) lost++;
+        }
+    }
+
+    bd_addr_t get_fragment_address(uint16_t index) const {
+        return opts.FlashOffset + (bd_addr_t)(index - 1) * opts.FragmentSize;
+    }
+
+    bd_addr_t get_row_address(uint16_t row) const {
+        return scratch_address + (bd_addr_t)row * record_stride;
+    }
+
+    BlockDevice* flash;
+    FragmentationSessionOpts_t opts;
+    BlockDevice* scratch;
+    bd_addr_t scratch_address;
+    bd_size_t record_stride;
+    uint16_t cache_rows;
+
+    FragmentBitmap received;        // uncoded fragments that are in flash
+    FragmentBitmap pivots;          // missing fragments that are the pivot of a stored row
+    uint16_t* row_pivot;            // pivot of every row in the scratch region, 0 if the row is free
+    uint8_t* work;                  // record being reduced or solved
+    uint8_t* fragment;              // fragment read from flash
+
+    uint8_t* cache;                 // cache_rows records
+    uint16_t* cache_row;            // row in the scratch region of every cached record, NO_ROW if empty
+    uint32_t* cache_used;           // last use of every cached record
+    uint32_t cache_clock;
+
+    uint16_t seen_frag;             // uncoded fragments that were counted by count_lost
+    int lost;
+    uint16_t dropped;               // rows that did not fit in the scratch region
+
+    uint32_t hits;
+    uint32_t misses;
+};
+
+#endif
@@ -0,0 +1,93 @@
+/*
+* PackageLicenseDeclared: Apache-2.0
+* Copyright (c) 2017 ARM Limited
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*     http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#ifndef __FRAGMENTATION_HEAP_H__
+#define __FRAGMENTATION_HEAP_H__
+
+#include "mbed.h"
+#include "mbed_stats.h"
+
+// allocator overhead and the session object itself
+#define FRAG_SESSION_HEAP_OVERHEAD      256
+
+/**
+ * Bytes of heap that every redundancy packet costs: the parity frame itself, its row in the
+ * bit-packed parity matrix, a few bytes of decoder state, and its entry in the list of received
+ * redundancy frames (see RadioEvent::CountRecoverableFragments)
+ */
+static size_t frag_session_heap_per_redundancy(uint16_t nb_frag, uint8_t frag_size) {
+    return frag_size + ((nb_frag >> 3) + 1) + 3 + sizeof(uint16_t);
+}
+
+/**
+ * Estimate of the heap a FragmentationSession allocates in initialize()
+ *
+ * @param nb_frag Number of uncoded fragments
+ * @param frag_size Size of a fragment
+ * @param redundancy Number of redundancy packets the session can hold
+ */
+static size_t frag_session_heap_size(uint16_t nb_frag, uint8_t frag_size, uint16_t redundancy) {
+    return FRAG_SESSION_HEAP_OVERHEAD +
+        ((nb_frag >> 3) + 1) +                      // extra parity matrix row
+        nb_frag * sizeof(uint16_t) +                // missing frame index
+        nb_frag +                                   // parity matrix row being decoded
+        frag_size * 2 +                             // row buffers
+        (MBED_CONF_APP_FRAG_PARITY_ROW_CACHE + 1) * (((nb_frag + 7) / 8) + sizeof(uint16_t)) +  // FragmentationParityRows
+        redundancy * frag_session_heap_per_redundancy(nb_frag, frag_size);
+}
+
+/**
+ * Estimate of the heap a FragmentationFlashDecoder allocates in initialize()
+ *
+ * @param nb_frag Number of uncoded fragments
+ * @param frag_size Size of a fragment
+ * @param redundancy Number of rows in the scratch region
+ * @param cache_rows Number of rows cached in RAM
+ */
+static size_t frag_flash_decoder_heap_size(uint16_t nb_frag, uint8_t frag_size, uint16_t redundancy, uint16_t cache_rows) {
+    size_t record = ((nb_frag + 7) / 8) + frag_size;
+
+    return FRAG_SESSION_HEAP_OVERHEAD +
+        ((nb_frag + 7) / 8) * 2 +                   // received and pivot bitmaps
+        redundancy * sizeof(uint16_t) +             // pivot of every row in flash
+        record + frag_size +                        // record being reduced, fragment buffer
+        cache_rows * (record + sizeof(uint16_t) + sizeof(uint32_t));
+}
+
+/**
+ * Number of redundancy packets a session can hold in the given amount of heap
+ */
+static uint16_t frag_session_max_redundancy(uint16_t nb_frag, uint8_t frag_size, size_t heap_available) {
+    size_t fixed = frag_session_heap_size(nb_frag, frag_size, 0);
+    if (heap_available <= fixed) return 0;
+
+    size_t redundancy = (heap_available - fixed) / frag_session_heap_per_redundancy(nb_frag, frag_size);
+    return redundancy > 0xffff ? 0xffff : redundancy;
+}
+
+/**
+ * Heap that is free right now, according to mbed_stats_heap_get
+ */
+static size_t heap_free_size() {
+    mbed_stats_heap_t heap_stats;
+    mbed_stats_heap_get(&heap_stats);
+
+    if (heap_stats.reserved_size <= heap_stats.current_size) return 0;
+    return heap_stats.reserved_size - heap_stats.current_size;
+}
+
+#endif
@@ -0,0 +1,157 @@
+/*
+* PackageLicenseDeclared: Apache-2.0
+* Copyright (c) 2017 ARM Limited
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*     http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+
+#ifndef __FRAGMENTATION_PARITY_ROWS_H__
+#define __FRAGMENTATION_PARITY_ROWS_H__
+
+#include "mbed.h"
+
+/**
+ * Bounded cache of the rows of the parity matrix of a session, bit packed (bit 0 of byte 0 is fragment 1).
+ *
+ * Redundancy frame n is the XOR of the uncoded fragments in row n of the matrix. A row is generated
+ * from n with a PRBS23 sequence, which takes NbFrag / 2 coefficients or more. The decoders use the row of
+ * a redundancy frame once when it arrives (FragmentationFlashDecoder calls generate() directly), but
+ * RadioEvent::CountRecoverableFragments needs the rows of all received redundancy frames again on every
+ * FRAG_STATUS_REQ, and looks them up here.
+ *
+ * The first max_rows rows stay cached. Later rows are generated into a spare row on every lookup: they
+ * are looked up in the order of the frames, so replacing cached rows would miss on every lookup.
+ */
+class FragmentationParityRows {
+public:
+    /**
+     * @param anb_frag Number of uncoded fragments (the width of a row)
+     * @param amax_rows Number of rows that are cached
+     */
+    FragmentationParityRows(uint16_t anb_frag, uint16_t amax_rows)
+        : nb_frag(anb_frag), max_rows(amax_rows), rows(NULL), row_index(NULL), hits(0), misses(0)
+    {
+    }
+
+    ~FragmentationParityRows() {
+        if (rows) free(rows);
+        if (row_index) free(row_index);
+    }
+
+    /**
+     * Allocate the cached rows and the spare row
+     *
+     * @returns false if there was not enough memory
+     */
+    bool initialize() {
+        rows = (uint8_t*)malloc((max_rows + 1) * get_row_size(nb_frag));
+        row_index = (uint16_t*)calloc(max_rows, sizeof(uint16_t));
+        return rows != NULL && row_index != NULL;
+    }
+
+    /**
+     * Row n of the parity matrix, generated if it is not cached. The row is valid until the next call.
+     *
+     * @param n 1-based index of the redundancy frame (frame counter - NbFrag)
+     */
+    const uint8_t* get(uint16_t n) {
+        uint16_t slot;
+        for (slot = 0; slot < max_rows && row_index[slot] != 0; slot++) {
+            if (row_index[slot] == n) {
+                hits++;
+                return rows + slot * get_row_size(nb_frag);
+            }
+        }
+
+        misses++;
+
+        // slot is the first free one, or the spare row when the cache is full
+        uint8_t* row = rows + slot * get_row_size(nb_frag);
+        generate(n, nb_frag, row);
+        if (slot < max_rows) {
+            row_index[slot] = n;
+        }
+        return row;
+    }
+
+    uint16_t get_max_rows() const {
+        return max_rows;
+    }
+
+    uint32_t get_hits() const {
+        return hits;
+    }
+
+    uint32_t get_misses() const {
+        return misses;
+    }
+
+    /**
+     * Size of a row for nb_frag fragments
+     */
+    static size_t get_row_size(uint16_t nb_frag) {
+        return (nb_frag + 7) / 8;
+    }
+
+    /**
+     * Whether fragment index (1-based) is part of a row
+     */
+    static bool get_bit(const uint8_t* row, uint16_t index) {
+        return row[(index - 1) >> 3] & (1 << ((index - 1) & 7));
+    }
+
+    /**
+     * Generate row n of the parity matrix for nb_frag fragments, as defined in the
+     * LoRaWAN fragmented data block transport specification
+     *
+     * @param n 1-based index of the redundancy frame
+     * @param nb_frag Number of uncoded fragments
+     * @param row Buffer of get_row_size(nb_frag) bytes
+     */
+    static void generate(uint16_t n, uint16_t nb_frag, uint8_t* row) {
+        int m = nb_frag;
+        int mm = ((m & (m - 1)) == 0) ? 1 : 0;
+        int x = 1 + (1001 * n);
+
+        memset(row, 0, get_row_size(nb_frag));
+
+        int nb_coeff = 0;
+        while (nb_coeff < (m >> 1)) {
+            int r = 1 << 16;
+            while (r >= m) {
+                x = prbs23(x);
+                r = x % (m + mm);
+            }
+            row[r >> 3] |= 1 << (r & 7);
+            nb_coeff++;
+        }
+    }
+
+private:
+    static int prbs23(int x) {
+        int b0 = x & 1;
+        int b1 = (x & 0x20) >> 5;
+        return (x >> 1) + ((b0 ^ b1) << 22);
+    }
+
+    uint16_t nb_frag;
+    uint16_t max_rows;
+    uint8_t* rows;          // max_rows cached rows, followed by the spare row
+    uint16_t* row_index;    // redundancy frame of every cached row, 0 if the slot is free
+
+    uint32_t hits;
+    uint32_t misses;
+};
+
+#endif
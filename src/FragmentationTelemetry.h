@@ -0,0 +1,209 @@
+/*
+* PackageLicenseDeclared: Apache-2.0
+* Copyright (c) 2017 ARM Limited
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*     http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#ifndef __FRAGMENTATION_TELEMETRY_H__
+#define __FRAGMENTATION_TELEMETRY_H__
+
+#include "mbed.h"
+
+#define FRAG_TELEMETRY_BINS         8
+// size of encode(): counters, RSSI / SNR range and the four histograms
+#define FRAG_TELEMETRY_SIZE         (10 + 4 * FRAG_TELEMETRY_BINS)
+
+/**
+ * Reception statistics of a fragmentation session: histograms of the RSSI, SNR, inter-arrival jitter
+ * and loss burst lengths of the fragments, small enough to send in a single uplink (see encode).
+ *
+ * Bins:
+ *   RSSI     8 dB wide, the first one is below -128 dBm and the last one -80 dBm and up
+ *   SNR      4 dB wide, the first one is below -16 dB and the last one 8 dB and up
+ *   jitter   difference between consecutive inter-arrival times (per frame counter), 0-2 ms, 2-4 ms,
+ *            4-8 ms ... 128 ms and up
+ *   bursts   number of consecutive lost fragments: 1, 2, 3, 4, 5-8, 9-16, 17-32, 33 and up
+ */
+class FragmentationTelemetry {
+public:
+    /**
+     * Clear the statistics. All zero bytes is the same state, so it can live in a struct that is cleared with memset.
+     */
+    void reset() {
+        memset(rssi_bins, 0, sizeof(rssi_bins));
+        memset(snr_bins, 0, sizeof(snr_bins));
+        memset(jitter_bins, 0, sizeof(jitter_bins));
+        memset(burst_bins, 0, sizeof(burst_bins));
+
+        frames = 0;
+        lost = 0;
+        bursts = 0;
+        rssi_min = 0;
+        rssi_max = 0;
+        snr_min = 0;
+        snr_max = 0;
+        last_frame_counter = 0;
+        last_rx_us = 0;
+        last_interval_us = 0;
+    }
+
+    /**
+     * Record a received fragment
+     *
+     * @param frame_counter Frame counter of the fragment
+     * @param rssi RSSI in dBm
+     * @param snr SNR in dB
+     * @param rx_us Time the fragment was received in microseconds (may wrap)
+     */
+    void add(uint16_t frame_counter, int16_t rssi, int8_t snr, uint32_t rx_us) {
+        if (frames == 0 || rssi < rssi_min) rssi_min = rssi;
+        if (frames == 0 || rssi > rssi_max) rssi_max = rssi;
+        if (frames == 0 || snr < snr_min) snr_min = snr;
+        if (frames == 0 || snr > snr_max) snr_max = snr;
+
+        frames++;
+        rssi_bins[get_linear_bin(rssi, -128, 8)]++;
+        snr_bins[get_linear_bin(snr, -16, 4)]++;
+
+        // unicast repair fragments come out of order, only the multicast stream tells something about timing and loss
+        if (last_frame_counter != 0 && frame_counter <= last_frame_counter) return;
+
+        if (last_frame_counter != 0) {
+            uint16_t gap = frame_counter - last_frame_counter - 1;
+            if (gap > 0) {
+                burst_bins[get_burst_bin(gap)]++;
+                bursts++;
+                lost += gap;
+            }
+
+            // the lost fragments were sent as well, so spread the time over them
+            uint32_t interval_us = (rx_us - last_rx_us) / (frame_counter - last_frame_counter);
+            if (last_interval_us != 0) {
+                uint32_t jitter_us = interval_us > last_interval_us ? interval_us - last_interval_us : last_interval_us - interval_us;
+                jitter_bins[get_log2_bin(jitter_us / 1000)]++;
+            }
+            last_interval_us = interval_us > 0 ? interval_us : 1;
+        }
+
+        last_frame_counter = frame_counter;
+        last_rx_us = rx_us;
+    }
+
+    /**
+     * Encode the statistics, FRAG_TELEMETRY_SIZE bytes:
+     *
+     *   frames received (2 bytes), fragments lost in bursts (2), bursts (2), all little endian
+     *   lowest and highest RSSI (1 byte each, -dBm), lowest and highest SNR (1 byte each, signed dB)
+     *   RSSI, SNR, jitter and burst histograms (8 bytes each), every bin is the share of the
+     *   samples of its histogram in 1/255, rounded up so a bin with samples is never 0
+     *
+     * @returns Number of bytes written, 0 if out is too small
+     */
+    size_t encode(uint8_t* out, size_t size) const {
+        if (size < FRAG_TELEMETRY_SIZE) return 0;
+
+        size_t length = 0;
+        out[length++] = frames & 0xff;
+        out[length++] = frames >> 8;
+        out[length++] = lost & 0xff;
+        out[length++] = lost >> 8;
+        out[length++] = bursts & 0xff;
+        out[length++] = bursts >> 8;
+        out[length++] = get_minus_dbm(rssi_min);
+        out[length++] = get_minus_dbm(rssi_max);
+        out[length++] = (uint8_t)snr_min;
+        out[length++] = (uint8_t)snr_max;
+
+        length += encode_histogram(rssi_bins, out + length);
+        length += encode_histogram(snr_bins, out + length);
+        length += encode_histogram(jitter_bins, out + length);
+        length += encode_histogram(burst_bins, out + length);
+        return length;
+    }
+
+    uint16_t get_frames() const {
+        return frames;
+    }
+
+    uint16_t get_bursts() const {
+        return bursts;
+    }
+
+private:
+    static size_t encode_histogram(const uint16_t* bins, uint8_t* out) {
+        uint32_t total = 0;
+        for (size_t ix = 0; ix < FRAG_TELEMETRY_BINS; ix++) {
+            total += bins[ix];
+        }
+
+        for (size_t ix = 0; ix < FRAG_TELEMETRY_BINS; ix++) {
+            out[ix] = total == 0 ? 0 : (uint8_t)(((uint32_t)bins[ix] * 255 + total - 1) / total);
+        }
+        return FRAG_TELEMETRY_BINS;
+    }
+
+    /**
+     * Bin of a value in bins of step wide, where the second bin starts at first
+     */
+    static size_t get_linear_bin(int value, int first, int step) {
+        if (value < first) return 0;
+
+        size_t bin = 1 + (value - first) / step;
+        return bin < FRAG_TELEMETRY_BINS ? bin : FRAG_TELEMETRY_BINS - 1;
+    }
+
+    /**
+     * Bin of a value in bins that double in width: 0-1, 2-3, 4-7 ...
+     */
+    static size_t get_log2_bin(uint32_t value) {
+        size_t bin = 0;
+        while (value >= 2 && bin < FRAG_TELEMETRY_BINS - 1) {
+            value >>= 1;
+            bin++;
+        }
+        return bin;
+    }
+
+    static size_t get_burst_bin(uint16_t length) {
+        if (length <= 4) return length - 1;
+
+        // 5-8, 9-16, 17-32, 33 and up
+        size_t bin = 4 + get_log2_bin((length - 1) >> 2);
+        return bin < FRAG_TELEMETRY_BINS ? bin : FRAG_TELEMETRY_BINS - 1;
+    }
+
+    static uint8_t get_minus_dbm(int16_t rssi) {
+        if (rssi >= 0) return 0;
+        return -rssi > 255 ? 255 : -rssi;
+    }
+
+    uint16_t rssi_bins[FRAG_TELEMETRY_BINS];
+    uint16_t snr_bins[FRAG_TELEMETRY_BINS];
+    uint16_t jitter_bins[FRAG_TELEMETRY_BINS];
+    uint16_t burst_bins[FRAG_TELEMETRY_BINS];
+
+    uint16_t frames;
+    uint16_t lost;                  // fragments lost in bursts, between received fragments
+    uint16_t bursts;
+    int16_t rssi_min;
+    int16_t rssi_max;
+    int8_t snr_min;
+    int8_t snr_max;
+
+    uint16_t last_frame_counter;
+    uint32_t last_rx_us;
+    uint32_t last_interval_us;      // time per frame counter between the last two fragments, 0 if unknown
+};
+
+#endif
@@ -0,0 +1,174 @@
+/*
+* PackageLicenseDeclared: Apache-2.0
+* Copyright (c) 2017 ARM Limited
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*     http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+
+/**
+ * XOR kernels for combining fragment rows (parity generation and recovery).
+ *
+ * frag_xor() is the fastest kernel for the target, selected at compile time:
+ * AVX2 or SSE2 on hosts that support it, otherwise a 32-bit word kernel, which is what runs on
+ * the Cortex-M3 of the xDot. The other kernels stay available, e.g. for benchmarks.
+ */
+
+#ifndef __FRAGMENTATION_XOR_H__
+#define __FRAGMENTATION_XOR_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+/**
+ * dst ^= src, one byte at a time (reference)
+ */
+static void frag_xor_bytes(uint8_t* dst, const uint8_t* src, size_t length) {
+    for (size_t ix = 0; ix < length; ix++) {
+        dst[ix] ^= src[ix];
+    }
+}
+
+/**
+ * dst ^= src, 32 bits at a time. dst is aligned first, src may be unaligned
+ * (the Cortex-M3 handles unaligned single word loads). memcpy keeps this free of aliasing
+ * problems, GCC turns it into single LDR / STR instructions.
+ */
+static void frag_xor_words(uint8_t* dst, const uint8_t* src, size_t length) {
+    while (length > 0 && ((uintptr_t)dst & 3)) {
+        *dst++ ^= *src++;
+        length--;
+    }
+
+    while (length >= 16) {
+        uint32_t d[4], s[4];
+        memcpy(d, dst, 16);
+        memcpy(s, src, 16);
+        d[0] ^= s[0];
+        d[1] ^= s[1];
+        d[2] ^= s[2];
+        d[3] ^= s[3];
+        memcpy(dst, d, 16);
+        dst += 16;
+        src += 16;
+        length -= 16;
+    }
+    while (length >= 4) {
+        uint32_t d, s;
+        memcpy(&d, dst, 4);
+        memcpy(&s, src, 4);
+        d ^= s;
+        memcpy(dst, &d, 4);
+        dst += 4;
+        src += 4;
+        length -= 4;
+    }
+
+    frag_xor_bytes(dst, src, length);
+}
+
+#if defined(__SSE2__)
+/**
+ * dst ^= src, 128 bits at a time
+ */
+static void frag_xor_sse2(uint8_t* dst, const uint8_t* src, size_t length) {
+    while (length >= 64) {
+        __m128i d0 = _mm_loadu_si128((const __m128i*)dst);
+        __m128i d1 = _mm_loadu_si128((const __m128i*)(dst + 16));
+        __m128i d2 = _mm_loadu_si128((const __m128i*)(dst + 32));
+        __m128i d3 = _mm_loadu_si128((const __m128i*)(dst + 48));
+        d0 = _mm_xor_si128(d0, _mm_loadu_si128((const __m128i*)src));
+        d1 = _mm_xor_si128(d1, _mm_loadu_si128((const __m128i*)(src + 16)));
+        d2 = _mm_xor_si128(d2, _mm_loadu_si128((const __m128i*)(src + 32)));
+        d3 = _mm_xor_si128(d3, _mm_loadu_si128((const __m128i*)(src + 48)));
+        _mm_storeu_si128((__m128i*)dst, d0);
+        _mm_storeu_si128((__m128i*)(dst + 16), d1);
+        _mm_storeu_si128((__m128i*)(dst + 32), d2);
+        _mm_storeu_si128((__m128i*)(dst + 48), d3);
+        dst += 64;
+        src += 64;
+        length -= 64;
+    }
+    while (length >= 16) {
+        __m128i d = _mm_loadu_si128((const __m128i*)dst);
+        __m128i s = _mm_loadu_si128((const __m128i*)src);
+        _mm_storeu_si128((__m128i*)dst, _mm_xor_si128(d, s));
+        dst += 16;
+        src += 16;
+        length -= 16;
+    }
+
+    frag_xor_words(dst, src, length);
+}
+#endif
+
+#if defined(__AVX2__)
+/**
+ * dst ^= src, 256 bits at a time
+ */
+static void frag_xor_avx2(uint8_t* dst, const uint8_t* src, size_t length) {
+    while (length >= 64) {
+        __m256i d0 = _mm256_loadu_si256((const __m256i*)dst);
+        __m256i d1 = _mm256_loadu_si256((const __m256i*)(dst + 32));
+        d0 = _mm256_xor_si256(d0, _mm256_loadu_si256((const __m256i*)src));
+        d1 = _mm256_xor_si256(d1, _mm256_loadu_si256((const __m256i*)(src + 32)));
+        _mm256_storeu_si256((__m256i*)dst, d0);
+        _mm256_storeu_si256((__m256i*)(dst + 32), d1);
+        dst += 64;
+        src += 64;
+        length -= 64;
+    }
+    while (length >= 32) {
+        __m256i d = _mm256_loadu_si256((const __m256i*)dst);
+        __m256i s = _mm256_loadu_si256((const __m256i*)src);
+        _mm256_storeu_si256((__m256i*)dst, _mm256_xor_si256(d, s));
+        dst += 32;
+        src += 32;
+        length -= 32;
+    }
+
+    frag_xor_sse2(dst, src, length);
+}
+#endif
+
+#if defined(__AVX2__)
+#define FRAG_XOR_KERNEL_NAME    "avx2"
+#define FRAG_XOR_KERNEL         frag_xor_avx2
+#elif defined(__SSE2__)
+#define FRAG_XOR_KERNEL_NAME    "sse2"
+#define FRAG_XOR_KERNEL         frag_xor_sse2
+#else
+#define FRAG_XOR_KERNEL_NAME    "words"
+#define FRAG_XOR_KERNEL         frag_xor_words
+#endif
+
+/**
+ * dst ^= src with the fastest kernel for this target
+ *
+ * @param dst Row that is updated
+ * @param src Row that is combined into dst
+ * @param length Length of both rows in bytes
+ */
+static inline void frag_xor(uint8_t* dst, const uint8_t* src, size_t length) {
+    FRAG_XOR_KERNEL(dst, src, length);
+}
+
+#endif
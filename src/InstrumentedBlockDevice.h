@@ -0,0 +1,219 @@
+/*
+* PackageLicenseDeclared: Apache-2.0
+* Copyright (c) 2017 ARM Limited
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*     http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+
+#ifndef __INSTRUMENTED_BLOCK_DEVICE_H__
+#define __INSTRUMENTED_BLOCK_DEVICE_H__
+
+#include "mbed.h"
+#include "BlockDevice.h"
+
+#define INSTRUMENTED_BD_READ        0
+#define INSTRUMENTED_BD_PROGRAM     1
+#define INSTRUMENTED_BD_ERASE       2
+#define INSTRUMENTED_BD_OPS         3
+
+#define INSTRUMENTED_BD_BINS        6
+// size of encode(): counters and histogram for every operation
+#define INSTRUMENTED_BD_STATS_SIZE  (INSTRUMENTED_BD_OPS * (8 + INSTRUMENTED_BD_BINS))
+
+/**
+ * Counters of one type of operation
+ */
+typedef struct {
+    uint32_t count;
+    uint32_t errors;
+    uint32_t bytes;
+    uint32_t total_us;
+    uint32_t max_us;
+    uint16_t bins[INSTRUMENTED_BD_BINS];    // latency: <64 us, <256 us, <1 ms, <4 ms, <16 ms, 16 ms and up
+} InstrumentedBlockDeviceStats_t;
+
+/**
+ * Counts the reads, programs and erases that go to another block device, with the number of bytes
+ * and a latency histogram per type of operation, so we can tell how much of a FOTA session is spent
+ * in flash. Sits in front of the AT45 in RadioEvent; everything that uses the flash goes through it.
+ *
+ * The counters are not locked. Flash is only used from one thread at a time, and a lost count is
+ * not worth a mutex around every SPI transaction.
+ */
+class InstrumentedBlockDevice : public BlockDevice {
+public:
+    InstrumentedBlockDevice(BlockDevice* abd) : bd(abd)
+    {
+        reset_stats();
+        timer.start();
+    }
+
+    virtual int init() {
+        return bd->init();
+    }
+
+    virtual int deinit() {
+        return bd->deinit();
+    }
+
+    virtual int sync() {
+        return bd->sync();
+    }
+
+    virtual int read(void* b, bd_addr_t addr, bd_size_t size) {
+        uint32_t start = timer.read_us();
+        int r = bd->read(b, addr, size);
+        add(INSTRUMENTED_BD_READ, size, start, r);
+        return r;
+    }
+
+    virtual int program(const void* b, bd_addr_t addr, bd_size_t size) {
+        uint32_t start = timer.read_us();
+        int r = bd->program(b, addr, size);
+        add(INSTRUMENTED_BD_PROGRAM, size, start, r);
+        return r;
+    }
+
+    virtual int erase(bd_addr_t addr, bd_size_t size) {
+        uint32_t start = timer.read_us();
+        int r = bd->erase(addr, size);
+        add(INSTRUMENTED_BD_ERASE, size, start, r);
+        return r;
+    }
+
+    virtual bd_size_t get_read_size() const {
+        return bd->get_read_size();
+    }
+
+    virtual bd_size_t get_program_size() const {
+        return bd->get_program_size();
+    }
+
+    virtual bd_size_t get_erase_size() const {
+        return bd->get_erase_size();
+    }
+
+    virtual bd_size_t size() const {
+        return bd->size();
+    }
+
+    void reset_stats() {
+        memset(stats, 0, sizeof(stats));
+    }
+
+    /**
+     * Counters of an operation (INSTRUMENTED_BD_READ, _PROGRAM or _ERASE)
+     */
+    const InstrumentedBlockDeviceStats_t* get_stats(uint8_t op) const {
+        return op < INSTRUMENTED_BD_OPS ? &stats[op] : NULL;
+    }
+
+    /**
+     * Time spent in all operations since the last reset_stats(), in microseconds
+     */
+    uint32_t get_total_us() const {
+        uint32_t total = 0;
+        for (size_t ix = 0; ix < INSTRUMENTED_BD_OPS; ix++) {
+            total += stats[ix].total_us;
+        }
+        return total;
+    }
+
+    /**
+     * Write the counters and histograms to the serial console
+     */
+    void print() const {
+        static const char* names[INSTRUMENTED_BD_OPS] = { "read", "program", "erase" };
+
+        for (size_t ix = 0; ix < INSTRUMENTED_BD_OPS; ix++) {
+            const InstrumentedBlockDeviceStats_t* s = &stats[ix];
+            printf("Flash %-7s %lu ops (%lu errors), %lu bytes, %lu ms (max %lu us), latency",
+                names[ix], (unsigned long)s->count, (unsigned long)s->errors, (unsigned long)s->bytes,
+                (unsigned long)(s->total_us / 1000), (unsigned long)s->max_us);
+            for (size_t bin = 0; bin < INSTRUMENTED_BD_BINS; bin++) {
+                printf(" %u", s->bins[bin]);
+            }
+            printf("\n");
+        }
+    }
+
+    /**
+     * Encode the statistics, INSTRUMENTED_BD_STATS_SIZE bytes. For reads, programs and erases:
+     *
+     *   operations (2 bytes), KiB moved (2), total time in ms (2), longest operation in ms (2),
+     *   all little endian and saturated at 0xffff
+     *   latency histogram (6 bytes), every bin is the share of the operations in 1/255, rounded up
+     *   so a bin with operations is never 0
+     *
+     * @returns Number of bytes written, 0 if out is too small
+     */
+    size_t encode(uint8_t* out, size_t size) const {
+        if (size < INSTRUMENTED_BD_STATS_SIZE) return 0;
+
+        size_t length = 0;
+        for (size_t ix = 0; ix < INSTRUMENTED_BD_OPS; ix++) {
+            const InstrumentedBlockDeviceStats_t* s = &stats[ix];
+            length += encode_u16(s->count, out + length);
+            length += encode_u16((s->bytes + 1023) / 1024, out + length);
+            length += encode_u16((s->total_us + 999) / 1000, out + length);
+            length += encode_u16((s->max_us + 999) / 1000, out + length);
+
+            for (size_t bin = 0; bin < INSTRUMENTED_BD_BINS; bin++) {
+                out[length++] = s->count == 0 ? 0 : (uint8_t)(((uint32_t)s->bins[bin] * 255 + s->count - 1) / s->count);
+            }
+        }
+        return length;
+    }
+
+private:
+    void add(uint8_t op, bd_size_t size, uint32_t start_us, int r) {
+        uint32_t us = (uint32_t)timer.read_us() - start_us;
+
+        InstrumentedBlockDeviceStats_t* s = &stats[op];
+        s->count++;
+        if (r != BD_ERROR_OK) s->errors++;
+        s->bytes += size;
+        s->total_us += us;
+        if (us > s->max_us) s->max_us = us;
+
+        size_t bin = get_bin(us);
+        if (s->bins[bin] < 0xffff) s->bins[bin]++;
+    }
+
+    /**
+     * Bin of a latency in bins that are four times wider than the previous one, starting at 64 us
+     */
+    static size_t get_bin(uint32_t us) {
+        size_t bin = 0;
+        us >>= 6;
+        while (us > 0 && bin < INSTRUMENTED_BD_BINS - 1) {
+            us >>= 2;
+            bin++;
+        }
+        return bin;
+    }
+
+    static size_t encode_u16(uint32_t value, uint8_t* out) {
+        if (value > 0xffff) value = 0xffff;
+        out[0] = value & 0xff;
+        out[1] = value >> 8;
+        return 2;
+    }
+
+    BlockDevice* bd;
+    Timer timer;
+    InstrumentedBlockDeviceStats_t stats[INSTRUMENTED_BD_OPS];
+};
+
+#endif
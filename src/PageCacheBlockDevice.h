@@ -0,0 +1,184 @@
+/*
+* PackageLicenseDeclared: Apache-2.0
+* Copyright (c) 2017 ARM Limited
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*     http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#ifndef __PAGE_CACHE_BLOCK_DEVICE_H__
+#define __PAGE_CACHE_BLOCK_DEVICE_H__
+
+#include "mbed.h"
+#include "BlockDevice.h"
+#include "FlashGeometry.h"
+
+/**
+ * Write-back cache of a single flash page in front of another block device.
+ *
+ * Fragments rarely line up with the 528 byte AT45 pages, so programming every fragment directly
+ * makes the driver read, modify and program the same page two or three times. This block device
+ * collects consecutive writes to a page in RAM and programs the page once, when it is complete,
+ * when a write goes to another page, or on sync(). Reads see the cached data.
+ */
+class PageCacheBlockDevice : public BlockDevice {
+public:
+    PageCacheBlockDevice(BlockDevice* abd)
+        : bd(abd), page_size(0), buffer(NULL), cached_page(NO_PAGE), dirty_start(0), dirty_end(0)
+    {
+    }
+
+    virtual ~PageCacheBlockDevice() {
+        if (buffer) free(buffer);
+    }
+
+    virtual int init() {
+        int r = bd->init();
+        if (r != BD_ERROR_OK) return r;
+
+        page_size = bd->get_read_size();
+        geometry.set_page_size(page_size);
+        if (buffer == NULL) {
+            buffer = (uint8_t*)malloc(page_size);
+        }
+        return buffer != NULL ? BD_ERROR_OK : BD_ERROR_DEVICE_ERROR;
+    }
+
+    virtual int deinit() {
+        int r = flush();
+        if (r != BD_ERROR_OK) return r;
+
+        return bd->deinit();
+    }
+
+    /**
+     * Program the cached page to flash
+     */
+    virtual int sync() {
+        int r = flush();
+        if (r != BD_ERROR_OK) return r;
+
+        return bd->sync();
+    }
+
+    virtual int read(void* b, bd_addr_t addr, bd_size_t size) {
+        int r = bd->read(b, addr, size);
+        if (r != BD_ERROR_OK || cached_page == NO_PAGE) return r;
+
+        // overlay the part of the cached page that was not programmed yet
+        bd_addr_t dirty_addr_start = geometry.get_address(cached_page) + dirty_start;
+        bd_addr_t dirty_addr_end = geometry.get_address(cached_page) + dirty_end;
+
+        bd_addr_t start = addr > dirty_addr_start ? addr : dirty_addr_start;
+        bd_addr_t end = addr + size < dirty_addr_end ? addr + size : dirty_addr_end;
+
+        if (start < end) {
+            memcpy((uint8_t*)b + (start - addr), buffer + (start - geometry.get_address(cached_page)), end - start);
+        }
+        return BD_ERROR_OK;
+    }
+
+    virtual int program(const void* b, bd_addr_t addr, bd_size_t size) {
+        const uint8_t* data = (const uint8_t*)b;
+
+        while (size > 0) {
+            bd_addr_t page = geometry.get_page(addr);
+            bd_size_t offset = geometry.get_offset(addr);
+            bd_size_t length = page_size - offset < size ? page_size - offset : size;
+
+            int r = program_page(page, offset, data, length);
+            if (r != BD_ERROR_OK) return r;
+
+            addr += length;
+            data += length;
+            size -= length;
+        }
+        return BD_ERROR_OK;
+    }
+
+    virtual int erase(bd_addr_t addr, bd_size_t size) {
+        int r = flush();
+        if (r != BD_ERROR_OK) return r;
+
+        return bd->erase(addr, size);
+    }
+
+    virtual bd_size_t get_read_size() const {
+        return bd->get_read_size();
+    }
+
+    virtual bd_size_t get_program_size() const {
+        return bd->get_program_size();
+    }
+
+    virtual bd_size_t get_erase_size() const {
+        return bd->get_erase_size();
+    }
+
+    virtual bd_size_t size() const {
+        return bd->size();
+    }
+
+private:
+    static const bd_addr_t NO_PAGE = (bd_addr_t)-1;
+
+    int program_page(bd_addr_t page, bd_size_t offset, const uint8_t* data, bd_size_t length) {
+        // a full page goes straight to flash, and replaces whatever we cached for it
+        if (offset == 0 && length == page_size) {
+            if (cached_page == page) {
+                cached_page = NO_PAGE;
+            }
+            return bd->program(data, geometry.get_address(page), page_size);
+        }
+
+        if (cached_page == page && offset <= dirty_end && offset + length >= dirty_start) {
+            // extends the cached range
+            if (offset < dirty_start) dirty_start = offset;
+            if (offset + length > dirty_end) dirty_end = offset + length;
+        }
+        else {
+            int r = flush();
+            if (r != BD_ERROR_OK) return r;
+
+            cached_page = page;
+            dirty_start = offset;
+            dirty_end = offset + length;
+        }
+
+        memcpy(buffer + offset, data, length);
+
+        if (dirty_start == 0 && dirty_end == page_size) {
+            return flush();
+        }
+        return BD_ERROR_OK;
+    }
+
+    int flush() {
+        if (cached_page == NO_PAGE) return BD_ERROR_OK;
+
+        bd_addr_t page = cached_page;
+        cached_page = NO_PAGE;
+
+        return bd->program(buffer + dirty_start, geometry.get_address(page) + dirty_start, dirty_end - dirty_start);
+    }
+
+    BlockDevice* bd;
+    bd_size_t page_size;
+    FlashGeometry geometry;
+    uint8_t* buffer;
+
+    bd_addr_t cached_page;
+    bd_size_t dirty_start;      // cached range within the page
+    bd_size_t dirty_end;
+};
+
+#endif
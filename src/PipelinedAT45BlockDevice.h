@@ -0,0 +1,257 @@
+/*
+* PackageLicenseDeclared: Apache-2.0
+* Copyright (c) 2017 ARM Limited
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*     http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#ifndef __PIPELINED_AT45_BLOCK_DEVICE_H__
+#define __PIPELINED_AT45_BLOCK_DEVICE_H__
+
+#include "mbed.h"
+#include "BlockDevice.h"
+#include "AT45BlockDevice.h"
+
+#ifndef PIPELINED_AT45_SPI_FREQUENCY
+#define PIPELINED_AT45_SPI_FREQUENCY    8000000
+#endif
+
+/**
+ * Programs the AT45 through both of its SRAM buffers in turn.
+ *
+ * The at45 driver writes every page into a buffer, starts the program and waits until the chip is ready
+ * before it returns. In pipelined mode this device sends the buffer commands itself, on the SPI bus of
+ * the driver: a page goes into the buffer that is not being programmed, and program() returns as soon as
+ * the chip started programming it. The transfer of the next page, and whatever the CPU does until then,
+ * overlap with the program of this one. Only the next page program waits for the chip.
+ *
+ * Reads, erases, init(), deinit() and sync() wait until the chip is ready and then go through the driver,
+ * so the driver never sees a busy chip. A page that is only partly programmed is first transferred from
+ * main memory into the buffer, which the chip can't do while it programs the other buffer, so partial
+ * pages don't overlap. Page cache in front of this (PageCacheBlockDevice) programs whole pages.
+ *
+ * When pipelined is off, everything goes through the driver and the SPI bus is not touched. Not thread
+ * safe; RadioEvent only uses the flash from one thread at a time.
+ */
+class PipelinedAT45BlockDevice : public BlockDevice {
+public:
+    /**
+     * @param adriver The at45 driver, for everything but page programs
+     * @param apipelined Program pages through both SRAM buffers, otherwise through the driver
+     * @param amosi, amiso, asclk, acs Pins of the AT45, the same as the driver's
+     */
+    PipelinedAT45BlockDevice(AT45BlockDevice* adriver, bool apipelined,
+                             PinName amosi = SPI_MOSI, PinName amiso = SPI_MISO, PinName asclk = SPI_SCK, PinName acs = SPI_NSS)
+        : driver(adriver), pipelined(apipelined), mosi(amosi), miso(amiso), sclk(asclk), cs_pin(acs),
+          spi(NULL), cs(NULL), page_size(0), page_shift(0), next_buffer(0), busy(false)
+    {
+    }
+
+    ~PipelinedAT45BlockDevice() {
+        if (spi) delete spi;
+        if (cs) delete cs;
+    }
+
+    virtual int init() {
+        int r = wait_ready();
+        if (r != BD_ERROR_OK) return r;
+
+        r = driver->init();
+        if (r != BD_ERROR_OK || !pipelined || spi != NULL) return r;
+
+        page_size = driver->get_read_size();
+
+        // page addresses follow the byte address in the page, 10 bits for 528 byte pages, 9 for 512
+        page_shift = 0;
+        while (((bd_size_t)1 << page_shift) < page_size) page_shift++;
+
+        spi = new SPI(mosi, miso, sclk);
+        spi->format(8, 0);
+        spi->frequency(PIPELINED_AT45_SPI_FREQUENCY);
+        cs = new DigitalOut(cs_pin, 1);
+        return BD_ERROR_OK;
+    }
+
+    virtual int deinit() {
+        int r = wait_ready();
+        if (r != BD_ERROR_OK) return r;
+
+        return driver->deinit();
+    }
+
+    /**
+     * Wait until the last page program finished
+     */
+    virtual int sync() {
+        int r = wait_ready();
+        if (r != BD_ERROR_OK) return r;
+
+        return driver->sync();
+    }
+
+    virtual int read(void* b, bd_addr_t addr, bd_size_t size) {
+        int r = wait_ready();
+        if (r != BD_ERROR_OK) return r;
+
+        return driver->read(b, addr, size);
+    }
+
+    virtual int program(const void* b, bd_addr_t addr, bd_size_t size) {
+        if (!pipelined || spi == NULL) return driver->program(b, addr, size);
+
+        if (addr + size > driver->size()) return BD_ERROR_DEVICE_ERROR;
+
+        const uint8_t* data = (const uint8_t*)b;
+        while (size > 0) {
+            uint32_t page = addr / page_size;
+            bd_size_t offset = addr % page_size;
+            bd_size_t length = page_size - offset < size ? page_size - offset : size;
+
+            int r = program_page(page, offset, data, length);
+            if (r != BD_ERROR_OK) return r;
+
+            addr += length;
+            data += length;
+            size -= length;
+        }
+        return BD_ERROR_OK;
+    }
+
+    virtual int erase(bd_addr_t addr, bd_size_t size) {
+        int r = wait_ready();
+        if (r != BD_ERROR_OK) return r;
+
+        return driver->erase(addr, size);
+    }
+
+    virtual bd_size_t get_read_size() const {
+        return driver->get_read_size();
+    }
+
+    virtual bd_size_t get_program_size() const {
+        return driver->get_program_size();
+    }
+
+    virtual bd_size_t get_erase_size() const {
+        return driver->get_erase_size();
+    }
+
+    virtual bd_size_t size() const {
+        return driver->size();
+    }
+
+    bool is_pipelined() const {
+        return pipelined;
+    }
+
+private:
+    static const uint8_t STATUS_READ = 0xD7;
+    static const uint8_t STATUS_READY = 0x80;
+    static const uint32_t READY_TIMEOUT_US = 100000;    // page program with erase is 35 ms at most
+    static const uint32_t POLL_INTERVAL_US = 50;
+
+    /**
+     * Write part of a page into the free buffer, and start programming it
+     */
+    int program_page(uint32_t page, bd_size_t offset, const uint8_t* data, bd_size_t length) {
+        // buffer write, buffer to main memory page program with built-in erase, main memory page to buffer transfer
+        static const uint8_t BUFFER_WRITE[2] = { 0x84, 0x87 };
+        static const uint8_t BUFFER_PROGRAM[2] = { 0x83, 0x86 };
+        static const uint8_t PAGE_TO_BUFFER[2] = { 0x53, 0x55 };
+
+        uint8_t buffer = next_buffer;
+        int r;
+
+        // the rest of the page has to be in the buffer first, the transfer is an internal operation
+        if (length != page_size) {
+            r = wait_ready();
+            if (r != BD_ERROR_OK) return r;
+
+            command(PAGE_TO_BUFFER[buffer], page << page_shift);
+            cs->write(1);
+            busy = true;
+
+            r = wait_ready();
+            if (r != BD_ERROR_OK) return r;
+        }
+
+        // the other buffer may still be programming, this one is free
+        command(BUFFER_WRITE[buffer], offset);
+        for (bd_size_t ix = 0; ix < length; ix++) {
+            spi->write(data[ix]);
+        }
+        cs->write(1);
+
+        r = wait_ready();
+        if (r != BD_ERROR_OK) return r;
+
+        command(BUFFER_PROGRAM[buffer], page << page_shift);
+        cs->write(1);
+        busy = true;
+
+        next_buffer = buffer ^ 1;
+        return BD_ERROR_OK;
+    }
+
+    /**
+     * Select the chip and send a command with a 24 bit address, the caller deselects it
+     */
+    void command(uint8_t opcode, uint32_t address) {
+        cs->write(0);
+        spi->write(opcode);
+        spi->write((address >> 16) & 0xff);
+        spi->write((address >> 8) & 0xff);
+        spi->write(address & 0xff);
+    }
+
+    /**
+     * Wait until the chip finished the page program (or transfer) this device started
+     */
+    int wait_ready() {
+        if (!busy) return BD_ERROR_OK;
+
+        Timer timer;
+        timer.start();
+
+        while (true) {
+            cs->write(0);
+            spi->write(STATUS_READ);
+            uint8_t status = spi->write(0);
+            cs->write(1);
+
+            if (status & STATUS_READY) break;
+            if ((uint32_t)timer.read_us() > READY_TIMEOUT_US) return BD_ERROR_DEVICE_ERROR;
+
+            wait_us(POLL_INTERVAL_US);
+        }
+
+        busy = false;
+        return BD_ERROR_OK;
+    }
+
+    AT45BlockDevice* driver;
+    bool pipelined;
+    PinName mosi;
+    PinName miso;
+    PinName sclk;
+    PinName cs_pin;
+
+    SPI* spi;                   // only allocated when pipelined
+    DigitalOut* cs;
+    bd_size_t page_size;
+    uint8_t page_shift;         // bit of the page address in a command address
+    uint8_t next_buffer;        // SRAM buffer (0 or 1) the next page goes into
+    bool busy;                  // a page program or transfer may still be running
+};
+
+#endif
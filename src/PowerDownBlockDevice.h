@@ -0,0 +1,161 @@
+/*
+* PackageLicenseDeclared: Apache-2.0
+* Copyright (c) 2017 ARM Limited
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*     http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+
+#ifndef __POWER_DOWN_BLOCK_DEVICE_H__
+#define __POWER_DOWN_BLOCK_DEVICE_H__
+
+#include "mbed.h"
+#include "BlockDevice.h"
+
+typedef struct {
+    uint32_t power_downs;       // times the flash went into deep power-down
+    uint32_t wakes;             // accesses that had to wake it up first
+    uint32_t wake_us_max;       // longest wake-up, including the driver
+    uint64_t wake_us_total;
+    uint32_t down_s_total;      // time spent in deep power-down, up to the last wake-up (RTC, the sleeps outlast the us timer)
+} PowerDownStats_t;
+
+/**
+ * Keeps a flash chip in deep power-down while nothing uses it. power_down() deinitializes the driver,
+ * which puts the AT45 in deep power-down, and the first access after it initializes the driver again,
+ * which wakes the chip up. The wake-ups are counted and timed, so we can see what it costs.
+ *
+ * In deep power-down the AT45 draws a few uA instead of the tens of uA of standby, which adds up over the
+ * long Class A sleeps between uplinks. Not thread safe; RadioEvent only uses the flash from one thread at a time.
+ *
+ * This relies on the at45 driver entering deep power-down (0xB9) in deinit() and sending the resume
+ * command (0xAB) in init(). That driver is not part of this tree, and neither is the source of the
+ * bootloader: the host stub assumes both, it does not verify them. The chip keeps its state over a reset
+ * of the MCU, so after a watchdog reset or a HardFault in deep power-down the bootloader only finds the
+ * flash (and a pending update on it) if its init() sends the resume command as well. Until both are
+ * verified, flash-power-down is off by default.
+ */
+class PowerDownBlockDevice : public BlockDevice {
+public:
+    PowerDownBlockDevice(BlockDevice* abd) : bd(abd), powered_down(false), down_since(0)
+    {
+        memset(&stats, 0, sizeof(PowerDownStats_t));
+        timer.start();
+    }
+
+    virtual int init() {
+        if (powered_down) return wake();
+        return bd->init();
+    }
+
+    virtual int deinit() {
+        return bd->deinit();
+    }
+
+    virtual int sync() {
+        int r = wake();
+        if (r != BD_ERROR_OK) return r;
+
+        return bd->sync();
+    }
+
+    virtual int read(void* b, bd_addr_t addr, bd_size_t size) {
+        int r = wake();
+        if (r != BD_ERROR_OK) return r;
+
+        return bd->read(b, addr, size);
+    }
+
+    virtual int program(const void* b, bd_addr_t addr, bd_size_t size) {
+        int r = wake();
+        if (r != BD_ERROR_OK) return r;
+
+        return bd->program(b, addr, size);
+    }
+
+    virtual int erase(bd_addr_t addr, bd_size_t size) {
+        int r = wake();
+        if (r != BD_ERROR_OK) return r;
+
+        return bd->erase(addr, size);
+    }
+
+    virtual bd_size_t get_read_size() const {
+        return bd->get_read_size();
+    }
+
+    virtual bd_size_t get_program_size() const {
+        return bd->get_program_size();
+    }
+
+    virtual bd_size_t get_erase_size() const {
+        return bd->get_erase_size();
+    }
+
+    virtual bd_size_t size() const {
+        return bd->size();
+    }
+
+    /**
+     * Put the flash in deep power-down, after the last program or erase finished. The next access wakes it up.
+     * Only with a driver whose deinit() and init() enter and leave deep power-down, see above.
+     */
+    int power_down() {
+        if (powered_down) return BD_ERROR_OK;
+
+        int r = bd->sync();
+        if (r != BD_ERROR_OK) return r;
+
+        r = bd->deinit();
+        if (r != BD_ERROR_OK) return r;
+
+        powered_down = true;
+        down_since = time(NULL);
+        stats.power_downs++;
+        return BD_ERROR_OK;
+    }
+
+    bool is_powered_down() const {
+        return powered_down;
+    }
+
+    const PowerDownStats_t* get_stats() const {
+        return &stats;
+    }
+
+private:
+    int wake() {
+        if (!powered_down) return BD_ERROR_OK;
+
+        uint32_t start = timer.read_us();
+        int r = bd->init();
+        if (r != BD_ERROR_OK) return r;
+
+        uint32_t us = (uint32_t)timer.read_us() - start;
+        powered_down = false;
+
+        stats.wakes++;
+        stats.wake_us_total += us;
+        if (us > stats.wake_us_max) stats.wake_us_max = us;
+        stats.down_s_total += time(NULL) - down_since;
+        return BD_ERROR_OK;
+    }
+
+    BlockDevice* bd;
+    Timer timer;
+    bool powered_down;
+    time_t down_since;
+    PowerDownStats_t stats;
+};
+
+#endif
@@ -44,10 +44,27 @@ Description: 	Firmware update over the air with LoRa proof of concept
 #define DATA_BLOCK_AUTH_REQ  0x05
 #define DATA_BLOCK_AUTH_ANS  0x05
 #define DATA_FRAGMENT  0x08
+#define FRAG_TELEMETRY  0x80    // not in the specification: reception statistics of a session, sent after DATA_BLOCK_AUTH_REQ
+#define FLASH_STATS  0x81       // not in the specification: flash operations and latencies during a session, sent after DATA_BLOCK_AUTH_REQ
+#define FRAG_GEOMETRY  0x82     // not in the specification: FragSize that tiles the flash pages, sent after FRAG_SESSION_SETUP_ANS
 #define FRAG_SESSION_SETUP_REQ_LENGTH 0x7
 
 #define  FRAG_SESSION_SETUP_ANS_LENGTH 0x2
+#define  FRAG_SESSION_SETUP_ANS_ENCODING_UNSUPPORTED 0x01
+#define  FRAG_SESSION_SETUP_ANS_NOT_ENOUGH_MEMORY 0x02
+#define  FRAG_SESSION_SETUP_ANS_INDEX_NOT_SUPPORTED 0x04
+#define  FRAG_SESSION_SETUP_ANS_WRONG_DESCRIPTOR 0x08
+#define  FRAG_STATUS_REQ_LENGTH 0x2
+#define  FRAG_STATUS_REQ_ALL_PARTICIPANTS 0x01
+#define  FRAG_STATUS_ANS_LENGTH 0x5
+#define  FRAG_STATUS_ANS_NOT_ENOUGH_MEMORY 0x01
+#define  FRAG_STATUS_ANS_MISSING_TRUNCATED 0x02
+#define  FRAG_SESSION_DELETE_REQ_LENGTH 0x2
+#define  FRAG_SESSION_DELETE_ANS_SESSION_DOES_NOT_EXIST 0x04
 #define  DATA_BLOCK_AUTH_REQ_LENGTH 0xa
+#define  FRAG_TELEMETRY_HEADER_LENGTH 0x2
+#define  FLASH_STATS_HEADER_LENGTH 0x2
+#define  FRAG_GEOMETRY_LENGTH 0x5                       // index, preferred FragSize, flash page size (2 bytes)
 #define  LORAWAN_APP_FTM_PACKAGE_DATA_MAX_SIZE 20
 
 #define REDUNDANCYMAX 80
@@ -33,12 +33,69 @@
 #include "BDFile.h"
 #include "janpatch.h"
 #include "mbed_delta_update.h"
+#include "RxFrameQueue.h"
+#include "FragmentationHeap.h"
+#include "FragmentationDigest.h"
+#include "PageCacheBlockDevice.h"
+#include "InstrumentedBlockDevice.h"
+#include "PowerDownBlockDevice.h"
+#include "PipelinedAT45BlockDevice.h"
+#include "RamBlockDevice.h"
+#include "ReplayBlockDevice.h"
+#include "BlockDeviceStreamReader.h"
+#include "FlashGeometry.h"
+#include "FlashSlotTable.h"
+#include "UpdateParamsJournal.h"
+#include "FlashEraseAhead.h"
+#include "DeltaPatchStream.h"
+#include "FragmentationCheckpoint.h"
+#include "FragmentationParityRows.h"
+#include "FragmentationFlashDecoder.h"
+#include "FragmentationTelemetry.h"
 
 typedef struct {
     uint32_t uplinkCounter;
     time_t time;
 } UplinkEvent_t;
 
+// FragSession index that carries the firmware, the other indices carry data blocks
+#define FOTA_FRAG_SESSION       0
+// FragSession is a 2 bit field
+#define FRAG_SESSION_MAX        4
+
+// Decoder of a fragmentation session, see RadioEvent::SetFragDecoderMode
+#define FRAG_DECODER_AUTO       0       // in flash if the heap cannot hold enough redundancy packets, see frag-flash-decoder-loss
+#define FRAG_DECODER_RAM        1
+#define FRAG_DECODER_FLASH      2
+
+typedef struct {
+    FTMPackageParams_t params;
+    FragmentationSessionOpts_t opts;
+    BlockDevice* flash;                 // at45 with a write-back page cache, or a RamBlockDevice, for the fragments of this session
+    ReplayBlockDevice* decoder_flash;   // flash for the decoder, skips the programs of fragments that are fed to it again
+    FragmentationSession* session;      // decoder, NULL on the fast path
+    FragmentationFlashDecoder* flash_decoder;   // decoder with the parity rows in flash, used instead of session
+    FragmentationDigest* digest;
+    uint16_t* parity_frames;            // redundancy frames that were received (1-based), up to params.Redundancy
+    uint16_t parity_count;
+    FragmentationParityRows* parity_rows;   // rows of the first redundancy frames, for CountRecoverableFragments
+    bool received;                      // set up OK, DATA_BLOCK_AUTH_ANS for this index is expected
+    bool fast_path;                     // no fragment lost yet, fragments go straight to flash without the decoder
+    bool decode_in_flash;               // the decoder is a FragmentationFlashDecoder
+    bool in_ram;                        // reassembled in a RamBlockDevice and handed to the data block callback, no flash I/O
+    uint16_t cache_rows;                // parity rows the flash decoder caches in RAM
+    uint8_t decoder_mode;               // FRAG_DECODER_*, kept when the session is deleted
+    bool checkpoint;                    // the session is checkpointed, it has a checkpoint slot and is not in RAM
+    bool resumed;                       // resumed from a checkpoint after a reset
+    bool replaying;                     // fragments are read back from flash (ResumeFragSessions), they are not programmed again
+    uint16_t checkpoint_frames;         // uncoded fragments received since the last checkpoint
+    bool patch_checked;                 // the header of the firmware was read to see whether it is a diff
+    uint16_t frames_received;           // uncoded and redundancy fragments processed
+    uint16_t last_frame_counter;        // highest frame counter received
+    uint8_t frags_per_page;             // fragments per flash page if FragSize tiles the pages exactly, otherwise 0
+    FragmentationTelemetry telemetry;   // RSSI, SNR, jitter and loss bursts of the received fragments
+} FragSession_t;
+
 typedef struct {
     uint8_t DevAddr[4];
     uint8_t AppSKey[16];
@@ -61,17 +118,31 @@ static bool compare_buffers(uint8_t* buff1, const uint8_t* buff2, size_t size) {
 }
 
 static void calculate_sha256(BlockDevice* bd, size_t offset, size_t size, unsigned char sha_out_buffer[32]) {
-    uint8_t sha_buffer[128];
+    // read in chunks of up to 512 bytes on this thread, see BlockDeviceStreamReader
+    BlockDeviceStreamReader reader(bd, offset, size);
+    if (!reader.initialize()) {
+        debug("Not enough memory to read %u bytes for SHA256\n", size);
+        memset(sha_out_buffer, 0, 32);
+        return;
+    }
+
+    mbedtls_sha256_context sha;
+    mbedtls_sha256_init(&sha);
+    mbedtls_sha256_starts(&sha, 0);
 
-    // SHA256 requires a large buffer, alloc on heap instead of stack
-    FragmentationSha256* sha256 = new FragmentationSha256(bd, sha_buffer, sizeof(sha_buffer));
+    const uint8_t* data;
+    size_t length;
+    while ((length = reader.next(&data)) > 0) {
+        mbedtls_sha256_update(&sha, data, length);
+    }
 
-    sha256->calculate(
-        offset,
-        size,
-        sha_out_buffer);
+    mbedtls_sha256_finish(&sha, sha_out_buffer);
+    mbedtls_sha256_free(&sha);
 
-    delete sha256;
+    if (reader.get_error() != BD_ERROR_OK) {
+        debug("Reading %u bytes for SHA256 failed (%d)\n", size, reader.get_error());
+        memset(sha_out_buffer, 0, 32);
+    }
 }
 
 static void print_sha256(unsigned char sha_out_buffer[32]) {
@@ -87,22 +158,59 @@ class RadioEvent : public mDotEvent
 
 public:
     RadioEvent(
-        // EventQueue* aevent_queue,
         Callback<void(uint8_t, std::vector<uint8_t>*)> asend_msg_cb,
         Callback<void(char)> aclass_switch_cb
-    ) : /*event_queue(aevent_queue), */send_msg_cb(asend_msg_cb), class_switch_cb(aclass_switch_cb)
+    ) : send_msg_cb(asend_msg_cb), class_switch_cb(aclass_switch_cb), rx_queue(callback(this, &RadioEvent::HandleMacEvent)),
+        at45_pipelined(&at45_device, MBED_CONF_APP_FLASH_PIPELINED_PROGRAM), at45_power(&at45_pipelined), at45(&at45_power), slot_table(&at45, FLASH_SLOT_TABLE_PAGE, FOTA_INFO_PAGE), journal(NULL), erase_ahead(&at45),
+        delta_patch(&at45)
     {
         join_succeeded = false;
         cls = '0';
-        has_received_frag_session = false;
+        memset(frag_sessions, 0, sizeof(frag_sessions));
 
-        int ain;
-        if ((ain = at45.init()) != BD_ERROR_OK) {
+        int ain = at45.init();
+
+        // 528 byte pages, or 512 when the AT45 is in binary page mode, all flash offsets follow from it
+        geometry.set_page_size(at45.get_read_size());
+
+        if (ain != BD_ERROR_OK) {
             printf("Failed to initialize AT45BlockDevice (%d)\n", ain);
         }
+        else if ((ain = slot_table.load()) != BD_ERROR_OK) {
+            printf("Failed to store the flash slot table (%d)\n", ain);
+        }
+
+        // every session needs a checkpoint and a scratch slot, don't run with a table that lacks them
+        for (uint8_t index = 0; index < MBED_CONF_APP_FRAG_SESSIONS; index++) {
+            if (!slot_table.find(FLASH_SLOT_CHECKPOINT, index) || !slot_table.find(FLASH_SLOT_SCRATCH, index)) {
+                printf("Flash slot table has no checkpoint or scratch slot for session %d, using the default layout\n", index);
+                // sessions without a checkpoint or scratch slot run without checkpoints or the flash decoder
+                if (!slot_table.set_default_layout()) {
+                    printf("Flash of %lu bytes does not hold all slots of the default layout\n", (uint32_t)at45.size());
+                }
+                break;
+            }
+        }
+
+        // tables stored before the update parameters had a journal get the default one
+        if (!slot_table.find(FLASH_SLOT_JOURNAL, 0) && slot_table.add(FLASH_SLOT_JOURNAL, 0, FOTA_JOURNAL_PAGE, FOTA_JOURNAL_PAGES)) {
+            slot_table.save();
+        }
+
+        const FlashSlot_t* journal_slot = slot_table.find(FLASH_SLOT_JOURNAL, 0);
+        if (journal_slot) {
+            journal = new UpdateParamsJournal(&at45, geometry.get_address(journal_slot->first_page), journal_slot->page_count);
+        }
+
+        PowerDownFlashIfIdle();
+
+        rx_queue.set_idle_handler(callback(this, &RadioEvent::RxIdleStep));
+        rx_queue.start();
     }
 
-    virtual ~RadioEvent() {}
+    virtual ~RadioEvent() {
+        if (journal) delete journal;
+    }
 
     /*!
      * MAC layer event callback prototype.
@@ -111,10 +219,175 @@ public:
      * \param [IN] info  Details about MAC events occurred
      */
     virtual void MacEvent(LoRaMacEventFlags* flags, LoRaMacEventInfo* info) {
+        // Received data is processed on the Rx worker thread, so flash writes don't block the MAC.
+        // If the queue is full the frame is dropped (and counted), fragmentation recovers it through redundancy.
+        if (flags->Bits.Rx && info->RxBufferSize > 0) {
+            rx_queue.push(flags, info);
+            return;
+        }
+
         HandleMacEvent(flags, info);
+    }
+
+    /**
+     * Wait until the Rx worker thread has processed all received frames
+     *
+     * @param timeout_ms Maximum time to wait
+     * @returns true if all frames were processed, false on timeout
+     */
+    bool WaitForRxIdle(uint32_t timeout_ms) {
+        return rx_queue.wait_idle(timeout_ms);
+    }
+
+    const RxFrameQueueStats_t* GetRxQueueStats() {
+        return rx_queue.get_stats();
+    }
+
+    /**
+     * Erase the flash the firmware session is received in, while the device waits for the Class C
+     * session to start, so the fragments only need to be programmed. The Rx worker thread erases a
+     * few pages at a time between frames, and stops when the first fragment of the session arrives.
+     * Called on MC_CLASSC_SESSION_REQ; call it from the Rx worker thread, or while it is idle.
+     *
+     * @returns false if there is no new firmware session in flash to erase for
+     */
+    bool StartEraseAhead() {
+        FragSession_t* s = &frag_sessions[FOTA_FRAG_SESSION];
+        if (!IsFragSessionActive(s) || s->in_ram || s->resumed || s->frames_received > 0) return false;
+
+        bd_size_t size = (bd_size_t)s->opts.NumberOfFragments * s->opts.FragmentSize;
+        printf("Erasing %lu bytes at offset %lu ahead of the firmware session\n", (uint32_t)size, (uint32_t)s->opts.FlashOffset);
+
+        erase_ahead.start(s->opts.FlashOffset, size);
+        rx_queue.schedule_idle();
+        return true;
+    }
+
+    /**
+     * Deep power-down statistics of the flash
+     */
+    const PowerDownStats_t* GetFlashPowerStats() const {
+        return at45_power.get_stats();
+    }
+
+    bool IsFlashPoweredDown() const {
+        return at45_power.is_powered_down();
+    }
+
+    /**
+     * Progress of StartEraseAhead(), e.g. to tell whether the region is ready when the Class C session starts
+     */
+    const FlashEraseAhead* GetEraseAhead() const {
+        return &erase_ahead;
+    }
+
+    /**
+     * Progress of patching the firmware while the diff is received (frag-delta-stream)
+     */
+    const DeltaPatchStream* GetDeltaPatch() const {
+        return &delta_patch;
+    }
+
+    /**
+     * Select the decoder for the next fragmentation session that is set up with this index
+     *
+     * @param index FragSession index
+     * @param mode FRAG_DECODER_AUTO, FRAG_DECODER_RAM or FRAG_DECODER_FLASH
+     */
+    void SetFragDecoderMode(uint8_t index, uint8_t mode) {
+        if (index >= FRAG_SESSION_MAX) return;
+
+        frag_sessions[index].decoder_mode = mode;
+    }
+
+    /**
+     * Receive small data blocks in RAM instead of flash. Data block sessions (not FOTA_FRAG_SESSION) of up to
+     * frag-ram-sink-max-size bytes are reassembled in a heap buffer and passed to the callback when they
+     * are complete, before DATA_BLOCK_AUTH_REQ is sent. The callback runs on the Rx worker thread, and the
+     * buffer is freed when it returns.
+     *
+     * @param cb Called with the FragSession index, the data block (without padding) and its size
+     */
+    void SetDataBlockCallback(Callback<void(uint8_t, const uint8_t*, size_t)> cb) {
+        data_block_cb = cb;
+    }
+
+    /**
+     * Flash address the last fragmentation session with this index was set up at (0 for data blocks in RAM)
+     */
+    bd_addr_t GetFragSessionAddress(uint8_t index) {
+        return index < FRAG_SESSION_MAX ? frag_sessions[index].opts.FlashOffset : 0;
+    }
+
+    /**
+     * Flash statistics of an operation (INSTRUMENTED_BD_READ, _PROGRAM or _ERASE) since the first of the
+     * sessions that are receiving (or the last session) was set up
+     */
+    const InstrumentedBlockDeviceStats_t* GetFlashStats(uint8_t op) const {
+        return at45.get_stats(op);
+    }
+
+    /**
+     * Resume the fragmentation sessions that were running before the last reset, from their checkpoints.
+     * The uncoded fragments that were received are read back from flash and fed to a new session;
+     * redundancy packets were only held in RAM and are lost.
+     */
+    void ResumeFragSessions() {
+        for (uint8_t index = 0; index < MBED_CONF_APP_FRAG_SESSIONS; index++) {
+            if (!HasFragCheckpointSlot(index)) continue;
+
+            FragmentationCheckpoint checkpoint(&at45, GetFragCheckpointAddress(index));
+
+            FTMPackageParams_t params;
+            if (!checkpoint.read_params(&params)) continue;
+
+            printf("Resuming FragmentationSession %d (NbFrag %d, FragSize %d)\n", index, params.NbFrag, params.FragSize);
+
+            // a bitmap that did not fit in the slot ran into the next one
+            FragmentBitmap received(params.NbFrag);
+            if (params.FragSession != index || FragmentationCheckpoint::get_size(params.NbFrag) > GetFragCheckpointSlotSize(index) ||
+                    !received.initialize() || checkpoint.load(&received) != BD_ERROR_OK ||
+                    SetupFragSession(&params, true) != 0) {
+                printf("Could not resume FragmentationSession %d\n", index);
+                checkpoint.clear();
+                continue;
+            }
+
+            FragSession_t* s = &frag_sessions[index];
+            s->replaying = true;
+
+            uint8_t buffer[255];
+            for (uint16_t frameCounter = 1; frameCounter <= params.NbFrag; frameCounter++) {
+                if (!received.get(frameCounter)) continue;
+
+                s->flash->read(buffer, s->opts.FlashOffset + (frameCounter - 1) * params.FragSize, params.FragSize);
+
+                FragResult result = ProcessFragment(index, frameCounter, buffer, params.FragSize);
+                if (result != FRAG_OK && result != FRAG_COMPLETE) {
+                    printf("FragmentationSession %d process_frame %d failed: %s\n",
+                        index, frameCounter, FragmentationSession::frag_result_string(result));
+                    break;
+                }
+
+                if (result == FRAG_COMPLETE) {
+                    CompleteFragSession(index, frameCounter);
+                    break;
+                }
+            }
+
+            // the fragments from the network are new
+            s->replaying = false;
+            if (s->decoder_flash != NULL) {
+                s->decoder_flash->set_replay(false);
+            }
 
-        // Process on the events thread which has bigger stack
-        // event_queue->call(callback(this, &RadioEvent::HandleMacEvent), flags, info);
+            if (IsFragSessionActive(s)) {
+                s->resumed = true;
+                printf("Resumed FragmentationSession %d with %d of %d fragments\n", index, received.get_count(), params.NbFrag);
+            }
+        }
+
+        PowerDownFlashIfIdle();
     }
 
     void OnTx(uint32_t uplinkCounter) {
@@ -197,14 +470,13 @@ private:
                     return;
                 }
 
-                // @todo: fragsession is bit 5 and 6 on byte 1
                 // @todo: extract mc group from byte 1
+                FTMPackageParams_t frag_params;
                 frag_params.FragSession = (info->RxBuffer[1] >> 4) & 0x03;
                 frag_params.NbFrag = ( info->RxBuffer[3] << 8 ) + info->RxBuffer[2];
                 frag_params.FragSize = info->RxBuffer[4];
                 frag_params.Encoding = info->RxBuffer[5];
                 frag_params.Padding = info->RxBuffer[6];
-                frag_params.Redundancy = REDUNDANCYMAX-1;
 
                 // [2, 0, 26, 0, 204, 0, 184]
 
@@ -213,40 +485,36 @@ private:
                 printf("\tNbFrag: %d\n", frag_params.NbFrag);
                 printf("\tFragSize: %d\n", frag_params.FragSize);
                 printf("\tEncoding: %d\n", frag_params.Encoding);
-                printf("\tRedundancy: %d\n", frag_params.Redundancy);
                 printf("\tPadding: %d\n", frag_params.Padding);
 
-                std::vector<uint8_t>* ack = new std::vector<uint8_t>();
-                ack->push_back(FRAG_SESSION_SETUP_ANS);
-                ack->push_back(0b01000000);
-                send_msg_cb(201, ack);
-
-                frag_opts.NumberOfFragments = frag_params.NbFrag;
-                frag_opts.FragmentSize = frag_params.FragSize;
-                frag_opts.Padding = frag_params.Padding;
-
-                // @todo: make this dependent on the space on the heap
-                frag_opts.RedundancyPackets = MBED_CONF_APP_MAX_REDUNDANCY_PACKETS;
-
-                frag_opts.FlashOffset = FOTA_UPDATE_PAGE * at45.get_read_size();
-
-                if (frag_session != NULL) {
-                    delete frag_session;
+                // the flash statistics cover everything from the setup of a session to its completion, so they
+                // are only reset when no other session is receiving (their flash operations are then included)
+                bool others_active = false;
+                for (uint8_t index = 0; index < FRAG_SESSION_MAX; index++) {
+                    if (index != frag_params.FragSession && IsFragSessionActive(&frag_sessions[index])) others_active = true;
                 }
 
-                mbed_stats_heap_get(&heap_stats);
-                printf("Heap stats: Used %lu / %lu bytes\n", heap_stats.current_size, heap_stats.reserved_size);
+                uint8_t status = (frag_params.FragSession << 6) | SetupFragSession(&frag_params);
 
-                frag_session = new FragmentationSession(&at45, frag_opts);
-                FragResult result = frag_session->initialize();
-                if (result != FRAG_OK) {
-                    printf("FragmentationSession could not initialize! %d %s\n", result, FragmentationSession::frag_result_string(result));
-                    break;
+                if (!others_active) {
+                    at45.reset_stats();
                 }
 
-                printf("FragmentationSession initialized OK\n");
+                std::vector<uint8_t>* ack = new std::vector<uint8_t>();
+                ack->push_back(FRAG_SESSION_SETUP_ANS);
+                ack->push_back(status);
+                send_msg_cb(201, ack);
+
+                // advertise the fragment size that tiles the flash pages, so the network can use it for the next session
+                uint8_t preferred_size = GetPreferredFragSize(frag_params.FragSize);
+                if (preferred_size != frag_params.FragSize) {
+                    printf("FragSize %d does not tile the %lu byte flash pages, %d does\n",
+                        frag_params.FragSize, (uint32_t)geometry.get_page_size(), preferred_size);
 
-                has_received_frag_session = true;
+                    if (MBED_CONF_APP_FRAG_GEOMETRY) {
+                        SendFragGeometry(frag_params.FragSession, preferred_size);
+                    }
+                }
 
                 mbed_stats_heap_get(&heap_stats);
                 printf("Heap stats: Used %lu / %lu bytes\n", heap_stats.current_size, heap_stats.reserved_size);
@@ -255,75 +523,124 @@ private:
 
             case DATA_FRAGMENT:
             {
-                uint16_t frameCounter = (info->RxBuffer[2] << 8) + info->RxBuffer[1];
+                // the two MSBs are the fragmentation session index, the rest is the frame counter
+                uint16_t indexAndN = (info->RxBuffer[2] << 8) + info->RxBuffer[1];
+                uint8_t frag_index = indexAndN >> 14;
+                uint16_t frameCounter = indexAndN & 0x3fff;
 
-                if (frag_session == NULL) return;
+                FragSession_t* s = &frag_sessions[frag_index];
 
-                FragResult result;
+                if (!IsFragSessionActive(s)) return;
 
-                if ((result = frag_session->process_frame(frameCounter, info->RxBuffer + 3, info->RxBufferSize - 3)) != FRAG_OK) {
-                    if (result == FRAG_COMPLETE) {
-                        printf("FragmentationSession is complete at frame %d\n", frameCounter);
-                        delete frag_session;
-                        frag_session = NULL;
-
-                        mbed_stats_heap_t heap_stats;
-                        mbed_stats_heap_get(&heap_stats);
-                        printf("Heap stats: Used %lu / %lu bytes\n", heap_stats.current_size, heap_stats.reserved_size);
-
-                        InvokeClassASwitch();
-
-                        // Calculate the CRC of the data in flash to see if the file was unpacked correctly
-                        // CRC64 of the original file is 150eff2bcd891e18 (see fake-fw/test-crc64/main.cpp)
-                        uint8_t crc_buffer[128];
+                // the fragments go where the eraser would erase next
+                if (frag_index == FOTA_FRAG_SESSION && erase_ahead.is_running()) {
+                    printf("Stopped erasing ahead at %d%%, the session started\n", erase_ahead.get_progress());
+                    erase_ahead.cancel();
+                }
 
-                        FragmentationCrc64 crc64(&at45, crc_buffer, sizeof(crc_buffer));
-                        uint64_t crc_res = crc64.calculate(frag_opts.FlashOffset, (frag_opts.NumberOfFragments * frag_opts.FragmentSize) - frag_opts.Padding);
+                s->telemetry.add(frameCounter, info->RxRssi, info->RxSnr, rx_queue.get_rx_time_us());
 
-                        printf("Hash is %08llx\n", crc_res);
+                // outside the multicast window (also after a reset, before the first class switch) the network
+                // repairs the session with unicast class A downlinks, only accept the uncoded fragments we reported missing
+                if (cls != 'C' && (frameCounter > s->opts.NumberOfFragments || s->digest->get_received()->get(frameCounter))) {
+                    printf("Ignoring repair fragment %d in session %d, it is not missing\n", frameCounter, frag_index);
+                    return;
+                }
 
-                        // Write the parameters to flash; but don't set update_pending yet (only after verification by the network)
-                        UpdateParams_t update_params;
-                        update_params.update_pending = 0;
-                        update_params.size = (frag_opts.NumberOfFragments * frag_opts.FragmentSize) - frag_opts.Padding - FOTA_SIGNATURE_LENGTH;
-                        update_params.offset = frag_opts.FlashOffset + FOTA_SIGNATURE_LENGTH;
-                        update_params.signature = UpdateParams_t::MAGIC;
-                        at45.program(&update_params, FOTA_INFO_PAGE * at45.get_read_size(), sizeof(UpdateParams_t));
+                FragResult result = ProcessFragment(frag_index, frameCounter, info->RxBuffer + 3, info->RxBufferSize - 3);
 
-                        std::vector<uint8_t>* ack = new std::vector<uint8_t>();
-                        ack->push_back(DATA_BLOCK_AUTH_REQ);
-                        ack->push_back(frag_params.FragSession); // fragindex
+                // patch the firmware with the diff bytes this fragment added, between frames
+                if (frag_index == FOTA_FRAG_SESSION && MBED_CONF_APP_FRAG_DELTA_STREAM) {
+                    rx_queue.schedule_idle();
+                }
 
-                        uint8_t* crc_buff = (uint8_t*)&crc_res;
-                        ack->push_back(crc_buff[0]);
-                        ack->push_back(crc_buff[1]);
-                        ack->push_back(crc_buff[2]);
-                        ack->push_back(crc_buff[3]);
-                        ack->push_back(crc_buff[4]);
-                        ack->push_back(crc_buff[5]);
-                        ack->push_back(crc_buff[6]);
-                        ack->push_back(crc_buff[7]);
+                // when the fragments tile the pages, wait for the last fragment of a page, so the checkpoint
+                // does not program a partial page that is programmed again when the rest of it arrives
+                if (result == FRAG_OK && s->checkpoint && frameCounter <= s->opts.NumberOfFragments &&
+                        ++s->checkpoint_frames >= MBED_CONF_APP_FRAG_CHECKPOINT_INTERVAL &&
+                        (s->frags_per_page == 0 || frameCounter % s->frags_per_page == 0)) {
+                    SaveFragCheckpoint(frag_index);
+                }
 
-                        send_msg_cb(201, ack);
+                if (result != FRAG_OK) {
+                    if (result == FRAG_COMPLETE) {
+                        CompleteFragSession(frag_index, frameCounter);
 
+                        // stay in class C while other sessions are still receiving
+                        if (GetActiveFragSessionCount() == 0) {
+                            InvokeClassASwitch();
+                        }
                         break;
                     }
                     else {
-                        printf("FragmentationSession process_frame %d failed: %s\n",
-                            frameCounter, FragmentationSession::frag_result_string(result));
+                        printf("FragmentationSession %d process_frame %d failed: %s\n",
+                            frag_index, frameCounter, FragmentationSession::frag_result_string(result));
                         break;
                     }
                 }
 
-                printf("Processed frame with frame counter %d, packets lost %d\n", frameCounter, frag_session->get_lost_frame_count());
+                printf("Processed frame with frame counter %d in session %d, packets lost %d\n",
+                    frameCounter, frag_index, GetFragLostCount(s));
                 break;
             }
             break;
 
+            case FRAG_STATUS_REQ:
+            {
+                if (info->RxBufferSize != FRAG_STATUS_REQ_LENGTH) {
+                    logError("Invalid FRAG_STATUS_REQ command");
+                    return;
+                }
+
+                bool all_participants = info->RxBuffer[1] & FRAG_STATUS_REQ_ALL_PARTICIPANTS;
+                uint8_t frag_index = (info->RxBuffer[1] >> 1) & 0x03;
+
+                printf("FRAG_STATUS_REQ:\n");
+                printf("\tFragSession: %d\n", frag_index);
+                printf("\tParticipants: %d\n", all_participants);
+
+                SendFragStatus(frag_index, all_participants);
+            }
+            break;
+
+            case FRAG_SESSION_DELETE_REQ:
+            {
+                if (info->RxBufferSize != FRAG_SESSION_DELETE_REQ_LENGTH) {
+                    logError("Invalid FRAG_SESSION_DELETE_REQ command");
+                    return;
+                }
+
+                uint8_t frag_index = info->RxBuffer[1] & 0x03;
+
+                printf("FRAG_SESSION_DELETE_REQ:\n");
+                printf("\tFragSession: %d\n", frag_index);
+
+                uint8_t status = frag_index;
+
+                if (!IsFragSessionActive(&frag_sessions[frag_index])) {
+                    status |= FRAG_SESSION_DELETE_ANS_SESSION_DOES_NOT_EXIST;
+                }
+                else {
+                    DeleteFragSession(frag_index);
+                    ClearFragCheckpoint(frag_index);
+
+                    mbed_stats_heap_t heap_stats;
+                    mbed_stats_heap_get(&heap_stats);
+                    printf("Heap stats: Used %lu / %lu bytes\n", heap_stats.current_size, heap_stats.reserved_size);
+                }
+
+                std::vector<uint8_t>* ack = new std::vector<uint8_t>();
+                ack->push_back(FRAG_SESSION_DELETE_ANS);
+                ack->push_back(status);
+                send_msg_cb(201, ack);
+            }
+            break;
+
             case DATA_BLOCK_AUTH_ANS:
             {
                 // sanity check in case old DATA_BLOCK_AUTH_ANS is still in the queue
-                if (!has_received_frag_session) return;
+                uint8_t frag_index = info->RxBufferSize > 1 ? info->RxBuffer[1] & 0x03 : FOTA_FRAG_SESSION;
+                if (!frag_sessions[frag_index].received) return;
 
                 printf("DATA_BLOCK_AUTH_ANS: ");
                 for (size_t ix = 0; ix < info->RxBufferSize; ix++) {
@@ -331,6 +648,9 @@ private:
                 }
                 printf("\n");
 
+                // data blocks are left in flash (or were passed to the data block callback) for the application,
+                // only the firmware is verified and installed
+                if (frag_index != FOTA_FRAG_SESSION) return;
 
 
                 // fragindex and success bit are on info->RxBuffer[1]
@@ -342,9 +662,12 @@ private:
                     // if MIC check is OK, then start flashing the firmware
                     // TTN has MIC not implemented yet
 
+                    // the parameters of the package that was received last (with offset and size info)
                     UpdateParams_t update_params;
-                    // read the current page (with offset and size info)
-                    at45.read(&update_params, FOTA_INFO_PAGE * at45.get_read_size(), sizeof(UpdateParams_t));
+                    if (!ReadUpdateParams(&update_params)) {
+                        debug("No update parameters in flash\n");
+                        return;
+                    }
 
                     // Read out the header of the package...
                     UpdateSignature_t* header = new UpdateSignature_t();
@@ -367,49 +690,37 @@ private:
                     // Is this a diff?
                     uint8_t* diff_info = (uint8_t*)&header->diff_info;
 
-                    printf("Diff? %d, size=%d\n", diff_info[0], (diff_info[1] << 16) + (diff_info[2] << 8) + diff_info[3]);
-
-                    if (diff_info[0] == 1) {
-                        int old_size = (diff_info[1] << 16) + (diff_info[2] << 8) + diff_info[3];
+                    int old_size = (diff_info[1] << 16) + (diff_info[2] << 8) + diff_info[3];
 
-                        int v;
+                    printf("Diff? %d, size=%d\n", diff_info[0], old_size);
 
-                        // calculate sha256 hash for current fw & diff file (for debug purposes)
-                        unsigned char sha_out_buff[32];
-                        calculate_sha256(&at45, FOTA_DIFF_OLD_FW_PAGE * at45.get_read_size(), old_size, sha_out_buff);
-                        debug("Current firmware hash: ");
-                        print_sha256(sha_out_buff);
+                    UpdateParams_t diff_params = update_params;
+                    bool streamed = false;
 
-                        calculate_sha256(&at45, update_params.offset, update_params.size, sha_out_buff);
+                    if (diff_info[0] == 1) {
+                        // calculated during reception
                         debug("Diff file hash: ");
-                        print_sha256(sha_out_buff);
-
-                        // so now use JANPatch
-                        printf("source start=%llu size=%d\n", FOTA_DIFF_OLD_FW_PAGE * at45.get_read_size(), old_size);
-                        BDFILE source(&at45, FOTA_DIFF_OLD_FW_PAGE * at45.get_read_size(), old_size);
-                        printf("diff start=%lu size=%u\n", update_params.offset, update_params.size);
-                        BDFILE diff(&at45, update_params.offset, update_params.size);
-                        printf("target start=%llu\n", FOTA_DIFF_TARGET_PAGE * at45.get_read_size());
-                        BDFILE target(&at45, FOTA_DIFF_TARGET_PAGE * at45.get_read_size(), 0);
-
-                        v = apply_delta_update(&at45, 528, &source, &diff, &target);
+                        print_sha256(update_params.sha256_hash);
 
-                        if (v != MBED_DELTA_UPDATE_OK) {
-                            debug("apply_delta_update failed %d\n", v);
+                        // usually most of it was patched while the diff came in (frag-delta-stream)
+                        streamed = FinishDeltaPatch(&update_params);
+                        if (!streamed && !ApplyDeltaUpdate(&update_params, old_size)) {
+                            free(header);
                             return;
                         }
-
-                        debug("Patched firmware length is %ld\n", target.ftell());
-
-                        update_params.offset = FOTA_DIFF_TARGET_PAGE * at45.get_read_size();
-                        update_params.size = target.ftell();
                     }
 
 
                     // Calculate the SHA256 hash of the file, and then verify whether the signature was signed with a trusted private key
                     unsigned char sha_out_buffer[32];
                     {
-                        calculate_sha256(&at45, update_params.offset, update_params.size, sha_out_buffer);
+                        if (diff_info[0] == 1) {
+                            calculate_sha256(&at45, update_params.offset, update_params.size, sha_out_buffer);
+                        }
+                        else {
+                            // the full image was hashed during reception
+                            memcpy(sha_out_buffer, update_params.sha256_hash, sizeof(sha_out_buffer));
+                        }
 
                         debug("Patched firmware hash: ");
                         print_sha256(sha_out_buffer);
@@ -429,6 +740,18 @@ private:
                             // ECDSA requires a large buffer, alloc on heap instead of stack
                             FragmentationEcdsaVerify* ecdsa = new FragmentationEcdsaVerify(UPDATE_CERT_PUBKEY, UPDATE_CERT_LENGTH);
                             bool valid = ecdsa->verify(sha_out_buffer, header->signature, header->signature_length);
+
+                            // janpatch is the reference, patch the firmware again with it before rejecting the update
+                            if (!valid && streamed) {
+                                debug("ECDSA verification of the firmware patched while receiving failed, patching it with janpatch\n");
+
+                                update_params = diff_params;
+                                if (ApplyDeltaUpdate(&update_params, old_size)) {
+                                    calculate_sha256(&at45, update_params.offset, update_params.size, sha_out_buffer);
+                                    valid = ecdsa->verify(sha_out_buffer, header->signature, header->signature_length);
+                                }
+                            }
+
                             if (!valid) {
                                 debug("ECDSA verification of firmware failed\n");
                                 free(header);
@@ -444,11 +767,14 @@ private:
 
                     free(header);
 
+                    // ECDSA and janpatch are the deepest calls on the Rx worker thread
+                    printf("Rx worker stack: %lu of %d bytes used\n", rx_queue.get_max_stack(), MBED_CONF_APP_RX_WORKER_STACK_SIZE);
+
                     // Hash is matching, now populate the FOTA_INFO_PAGE with information about the update, so the bootloader can flash the update
                     if (1) {
                         update_params.update_pending = 1;
                         memcpy(update_params.sha256_hash, sha_out_buffer, sizeof(sha_out_buffer));
-                        at45.program(&update_params, FOTA_INFO_PAGE * at45.get_read_size(), sizeof(UpdateParams_t));
+                        WriteUpdateParams(&update_params);
 
                         debug("Stored the update parameters in flash on page 0x%x\n", FOTA_INFO_PAGE);
                     }
@@ -456,6 +782,9 @@ private:
                         debug("Has not stored update parameters in flash, override in RadioEvent.h\n");
                     }
 
+                    // a pipelined page program may still be running, the bootloader needs the page
+                    at45.sync();
+
                     // and now reboot the device...
                     printf("System going down for reset *NOW*!\n");
                     NVIC_SystemReset();
@@ -569,6 +898,11 @@ private:
                         // class_c_start_timeout.attach(event_queue->event(this, &RadioEvent::InvokeClassCSwitch), switch_to_class_c_t);
                         class_c_start_timeout.attach(callback(this, &RadioEvent::InvokeClassCSwitch), switch_to_class_c_t);
 
+                        // the device is idle until then, prepare the flash for the fragments
+                        if (MBED_CONF_APP_FRAG_ERASE_AHEAD) {
+                            StartEraseAhead();
+                        }
+
                         // timetostart in seconds
                         // @TODO: if this message fails to ack we should update this timing here otherwise the server is out of sync
                         ack->push_back(switch_to_class_c_t & 0xff);
@@ -587,115 +921,1240 @@ private:
         }
     }
 
-    void InvokeClassCSwitch() {
-        // no frag_session? abort
-        if (frag_session == NULL) {
-            logError("Refusing class C switch. No frag_session");
-            return;
-        }
+    /**
+     * Set up the fragmentation session in the slot for params->FragSession, replacing the session
+     * that was there. Other sessions keep running.
+     *
+     * @param params Session parameters from FRAG_SESSION_SETUP_REQ
+     * @param resume Whether the session is resumed from its checkpoint (which is then kept)
+     * @returns FRAG_SESSION_SETUP_ANS status bits (without the index)
+     */
+    uint8_t SetupFragSession(FTMPackageParams_t* params, bool resume = false) {
+        uint8_t index = params->FragSession;
 
-        class_switch_cb('C');
-    }
+        if (index >= MBED_CONF_APP_FRAG_SESSIONS) {
+            printf("FragSession %d not supported, this device handles %d sessions\n", index, MBED_CONF_APP_FRAG_SESSIONS);
+            return FRAG_SESSION_SETUP_ANS_INDEX_NOT_SUPPORTED;
+        }
 
-    void InvokeClassASwitch() {
-        class_switch_cb('A');
-    }
+        // an invalid request leaves the session that is in the slot alone
+        uint8_t invalid = 0;
+        if (params->Encoding != 0) {
+            printf("Encoding %d not supported\n", params->Encoding);
+            invalid |= FRAG_SESSION_SETUP_ANS_ENCODING_UNSUPPORTED;
+        }
+        // the frame counter of DATA_FRAGMENT has 14 bits, and the padding is part of the last fragment
+        if (params->NbFrag == 0 || params->NbFrag > 0x3fff || params->FragSize == 0 || params->Padding >= params->FragSize) {
+            printf("Invalid session (NbFrag=%d, FragSize=%d, Padding=%d)\n", params->NbFrag, params->FragSize, params->Padding);
+            invalid |= FRAG_SESSION_SETUP_ANS_WRONG_DESCRIPTOR;
+        }
+        if (invalid) return invalid;
 
-    void ClassCTimeout() {
-        if (cls == 'C') {
-            logInfo("Class C Timeout");
+        FragSession_t* s = &frag_sessions[index];
 
-            InvokeClassASwitch();
+        // the network does not know we were reset, and might set up the same session again
+        if (s->resumed && IsFragSessionActive(s) && s->params.NbFrag == params->NbFrag && s->params.FragSize == params->FragSize &&
+                s->params.Encoding == params->Encoding && s->params.Padding == params->Padding) {
+            printf("FragmentationSession %d matches the resumed session, keeping %d received fragments\n",
+                index, s->digest->get_received()->get_count());
+            return 0;
         }
-    }
 
-    void HandleMacEvent(LoRaMacEventFlags* flags, LoRaMacEventInfo* info) {
+        // a new session replaces the old one, so release its memory before sizing the new one
+        DeleteFragSession(index);
 
-        if (mts::MTSLog::getLogLevel() == mts::MTSLog::TRACE_LEVEL) {
-            std::string msg = "OK";
-            switch (info->Status) {
-                case LORAMAC_EVENT_INFO_STATUS_ERROR:
-                    msg = "ERROR";
-                    break;
-                case LORAMAC_EVENT_INFO_STATUS_TX_TIMEOUT:
-                    msg = "TX_TIMEOUT";
-                    break;
-                case LORAMAC_EVENT_INFO_STATUS_RX_TIMEOUT:
-                    msg = "RX_TIMEOUT";
-                    break;
-                case LORAMAC_EVENT_INFO_STATUS_RX_ERROR:
-                    msg = "RX_ERROR";
-                    break;
-                case LORAMAC_EVENT_INFO_STATUS_JOIN_FAIL:
-                    msg = "JOIN_FAIL";
-                    break;
-                case LORAMAC_EVENT_INFO_STATUS_DOWNLINK_FAIL:
-                    msg = "DOWNLINK_FAIL";
-                    break;
-                case LORAMAC_EVENT_INFO_STATUS_ADDRESS_FAIL:
-                    msg = "ADDRESS_FAIL";
-                    break;
-                case LORAMAC_EVENT_INFO_STATUS_MIC_FAIL:
-                    msg = "MIC_FAIL";
-                    break;
-                default:
-                    break;
+        if (!resume) {
+            ClearFragCheckpoint(index);
+        }
+        s->params = *params;
+
+        s->opts.NumberOfFragments = params->NbFrag;
+        s->opts.FragmentSize = params->FragSize;
+        s->opts.Padding = params->Padding;
+        s->opts.FlashOffset = geometry.get_address(GetFragSessionPage(index));
+        s->frags_per_page = geometry.get_page_size() % params->FragSize == 0 ?
+            geometry.get_page_size() / params->FragSize : 0;
+
+        // small data blocks that the application takes from RAM don't need to go through flash
+        uint32_t session_size = (uint32_t)params->NbFrag * params->FragSize;
+        if (index != FOTA_FRAG_SESSION && data_block_cb && session_size - params->Padding <= MBED_CONF_APP_FRAG_RAM_SINK_MAX_SIZE) {
+            s->flash = new RamBlockDevice(session_size);
+            if (s->flash->init() == BD_ERROR_OK) {
+                s->in_ram = true;
+                s->opts.FlashOffset = 0;
             }
-            logTrace("Event: %s", msg.c_str());
+            else {
+                printf("Not enough memory to receive data block %d in RAM, using flash\n", index);
+                delete s->flash;
+                s->flash = NULL;
+            }
+        }
 
-            logTrace("Flags Tx: %d Rx: %d RxData: %d RxSlot: %d LinkCheck: %d JoinAccept: %d",
-                     flags->Bits.Tx, flags->Bits.Rx, flags->Bits.RxData, flags->Bits.RxSlot, flags->Bits.LinkCheck, flags->Bits.JoinAccept);
-            logTrace("Info: Status: %d ACK: %d Retries: %d TxDR: %d RxPort: %d RxSize: %d RSSI: %d SNR: %d Energy: %d Margin: %d Gateways: %d",
-                     info->Status, info->TxAckReceived, info->TxNbRetries, info->TxDatarate, info->RxPort, info->RxBufferSize,
-                     info->RxRssi, info->RxSnr, info->Energy, info->DemodMargin, info->NbGateways);
+        uint32_t flash_size = geometry.get_address(GetFragSessionPageCount(index));
+        if (!s->in_ram && session_size > flash_size) {
+            printf("Session needs %lu bytes, but flash region %d is only %lu bytes\n", session_size, index, flash_size);
+            return FRAG_SESSION_SETUP_ANS_NOT_ENOUGH_MEMORY;
         }
 
-        if (flags->Bits.Rx) {
+        if (!s->in_ram) {
+            s->flash = new PageCacheBlockDevice(&at45);
+            if (s->flash->init() != BD_ERROR_OK) {
+                DeleteFragSession(index);
+                return FRAG_SESSION_SETUP_ANS_NOT_ENOUGH_MEMORY;
+            }
+        }
 
-            logDebug("Rx %d bytes", info->RxBufferSize);
-            if (info->RxBufferSize > 0) {
-                if (cls == 'C') {
-                    class_c_cancel_timeout.attach(callback(this, &RadioEvent::ClassCTimeout), class_c_cancel_s);
-                }
+        // only the firmware starts with a signature header, which is not part of the SHA256 hash
+        s->digest = new FragmentationDigest(s->flash, s->opts.FlashOffset, s->opts.NumberOfFragments, s->opts.FragmentSize,
+            (s->opts.NumberOfFragments * s->opts.FragmentSize) - s->opts.Padding, index == FOTA_FRAG_SESSION ? FOTA_SIGNATURE_LENGTH : 0);
+        if (!s->digest->initialize()) {
+            DeleteFragSession(index);
+            return FRAG_SESSION_SETUP_ANS_NOT_ENOUGH_MEMORY;
+        }
 
-                // Forward the data to the target MCU
-                // logInfo("PacketRx port=%d, size=%d, rssi=%d, FPending=%d", info->RxPort, info->RxBufferSize, info->RxRssi, 0);
-                // logInfo("Rx data: %s", mts::Text::bin2hexString(info->RxBuffer, info->RxBufferSize).c_str());
+        // size the parity matrix to the heap we have, but leave room for the rest of the application and
+        // the decoders that sessions on the fast path did not allocate yet, and split it evenly with the
+        // sessions that can still be set up
+        size_t heap_free = heap_free_size();
+        size_t heap_reserve = MBED_CONF_APP_FRAG_HEAP_RESERVE + GetFragDecoderHeapPending();
+        size_t heap_available = heap_free > heap_reserve ? heap_free - heap_reserve : 0;
+        heap_available /= MBED_CONF_APP_FRAG_SESSIONS - GetActiveFragSessionCount();
+
+        uint16_t redundancy = frag_session_max_redundancy(params->NbFrag, params->FragSize, heap_available);
+        if (redundancy > MBED_CONF_APP_MAX_REDUNDANCY_PACKETS) {
+            redundancy = MBED_CONF_APP_MAX_REDUNDANCY_PACKETS;
+        }
 
-                // Process MAC events ourselves
-                if (info->RxPort == 200) {
-                    processMulticastMacCommand(flags, info);
-                }
-                else if (info->RxPort == 201) {
-                    processFragmentationMacCommand(flags, info);
-                }
+        printf("Heap free %u bytes, sizing session %d for %d redundancy packets (%u bytes)\n",
+            heap_free, index, redundancy, frag_session_heap_size(params->NbFrag, params->FragSize, redundancy));
+
+        // when the heap cannot hold enough parity rows to recover the loss we expect, keep them in flash
+        uint16_t loss_redundancy = ((uint32_t)params->NbFrag * MBED_CONF_APP_FRAG_FLASH_DECODER_LOSS) / 100;
+        if (!s->in_ram && (s->decoder_mode == FRAG_DECODER_FLASH || (s->decoder_mode == FRAG_DECODER_AUTO && redundancy < loss_redundancy))) {
+            if (slot_table.find(FLASH_SLOT_SCRATCH, index) != NULL) {
+                s->decode_in_flash = true;
+                redundancy = SizeFragFlashDecoder(index, heap_available);
+            }
+            else {
+                printf("No scratch slot for session %d, decoding it in RAM\n", index);
             }
         }
-    }
 
+        if (redundancy < MBED_CONF_APP_MIN_REDUNDANCY_PACKETS) {
+            printf("FragmentationSession %d needs at least %d redundancy packets\n", index, MBED_CONF_APP_MIN_REDUNDANCY_PACKETS);
+            DeleteFragSession(index);
+            return FRAG_SESSION_SETUP_ANS_NOT_ENOUGH_MEMORY;
+        }
 
-    Callback<void(uint8_t, std::vector<uint8_t>*)> send_msg_cb;
-    Callback<void(char)> class_switch_cb;
-    UplinkEvent_t uplinkEvents[10];
+        s->params.Redundancy = redundancy;
 
-    McClassCSessionParams_t class_c_session_params;
-    McGroupSetParams_t class_c_group_params;
-    FTMPackageParams_t frag_params;
+        if (MBED_CONF_APP_FRAG_FAST_PATH) {
+            s->fast_path = true;
+        }
+        else if (!StartFragDecoder(index)) {
+            DeleteFragSession(index);
+            return FRAG_SESSION_SETUP_ANS_NOT_ENOUGH_MEMORY;
+        }
 
-    LoRaWANCredentials_t class_a_credentials;
-    LoRaWANCredentials_t class_c_credentials;
+        s->received = true;
+
+        // a block in RAM is lost on a reset anyway
+        if (!s->in_ram && MBED_CONF_APP_FRAG_CHECKPOINT_INTERVAL > 0) {
+            s->checkpoint = HasFragCheckpointSlot(index);
+            if (!s->checkpoint) {
+                printf("No checkpoint slot for session %d, it does not resume after a reset\n", index);
+            }
+            // with 512 byte pages the bitmap of a large session does not fit, it would run into the next slot
+            else if (FragmentationCheckpoint::get_size(s->params.NbFrag) > GetFragCheckpointSlotSize(index)) {
+                printf("Checkpoint of session %d needs %lu bytes, its slot holds %lu, it does not resume after a reset\n",
+                    index, (uint32_t)FragmentationCheckpoint::get_size(s->params.NbFrag), (uint32_t)GetFragCheckpointSlotSize(index));
+                s->checkpoint = false;
+            }
+            else if (!resume) {
+                FragmentationCheckpoint(&at45, GetFragCheckpointAddress(index)).start(&s->params);
+            }
+        }
+
+        printf("FragmentationSession %d initialized OK (redundancy %d%s%s%s)\n", index, s->params.Redundancy,
+            s->decode_in_flash ? ", decoded in flash" : "", s->in_ram ? ", received in RAM" : "",
+            s->fast_path ? ", decoder allocated at the first lost fragment" : "");
+        return 0;
+    }
+
+    /**
+     * Size the flash decoder of a session: as many parity rows as its scratch region holds, and as many of
+     * them cached in RAM as the heap allows (up to frag-flash-decoder-cache-rows)
+     *
+     * @param heap_available Heap this session can use
+     * @returns Number of redundancy packets the session can use
+     */
+    uint16_t SizeFragFlashDecoder(uint8_t index, size_t heap_available) {
+        FragSession_t* s = &frag_sessions[index];
+
+        uint32_t rows = GetFragScratchRows(index);
+
+        // every stored row recovers a different missing fragment
+        if (rows > s->params.NbFrag) {
+            rows = s->params.NbFrag;
+        }
+
+        s->cache_rows = MBED_CONF_APP_FRAG_FLASH_DECODER_CACHE_ROWS;
+        while (s->cache_rows > 1 && frag_flash_decoder_heap_size(s->params.NbFrag, s->params.FragSize, rows, s->cache_rows) > heap_available) {
+            s->cache_rows--;
+        }
+
+        size_t heap_size = frag_flash_decoder_heap_size(s->params.NbFrag, s->params.FragSize, rows, s->cache_rows);
+        printf("Decoding session %d in flash: %lu parity rows in the scratch region, %d cached in RAM (%u bytes)\n",
+            index, rows, s->cache_rows, heap_size);
+
+        return heap_size > heap_available ? 0 : rows;
+    }
+
+    /**
+     * Allocate the decoder of a fragmentation session, and feed it the uncoded fragments that were
+     * received on the fast path (read back from flash)
+     *
+     * @returns true if the decoder is ready for the next fragment
+     */
+    bool StartFragDecoder(uint8_t index) {
+        FragSession_t* s = &frag_sessions[index];
+
+        if (s->decoder_flash == NULL) {
+            s->decoder_flash = new ReplayBlockDevice(s->flash);
+        }
+        s->decoder_flash->set_replay(s->replaying);
+
+        if (s->decode_in_flash) return StartFragFlashDecoder(index);
+
+        uint16_t redundancy = s->params.Redundancy;
+        FragResult result = FRAG_NO_MEMORY;
+        while (redundancy >= MBED_CONF_APP_MIN_REDUNDANCY_PACKETS) {
+            s->opts.RedundancyPackets = redundancy;
+
+            s->session = new FragmentationSession(s->decoder_flash, s->opts);
+            result = s->session->initialize();
+            if (result == FRAG_OK) break;
+
+            delete s->session;
+            s->session = NULL;
+
+            if (result != FRAG_NO_MEMORY) break;
+
+            // the estimate was too optimistic (e.g. fragmented heap), retry with fewer packets, but
+            // don't go below the minimum (or wrap around when that is configured as 0)
+            uint16_t step = (redundancy / 4) + 1;
+            if (redundancy <= step || redundancy - step < MBED_CONF_APP_MIN_REDUNDANCY_PACKETS) break;
+            redundancy -= step;
+        }
+
+        if (s->session == NULL) {
+            printf("FragmentationSession could not initialize! %d %s\n", result, FragmentationSession::frag_result_string(result));
+            return false;
+        }
+
+        s->parity_frames = (uint16_t*)malloc(redundancy * sizeof(uint16_t));
+        if (s->parity_frames == NULL) {
+            printf("Not enough memory for the redundancy frame list of FragmentationSession %d\n", index);
+            DeleteFragDecoder(index);
+            return false;
+        }
+
+        uint16_t cached_rows = redundancy < MBED_CONF_APP_FRAG_PARITY_ROW_CACHE ? redundancy : MBED_CONF_APP_FRAG_PARITY_ROW_CACHE;
+        s->parity_rows = new FragmentationParityRows(s->params.NbFrag, cached_rows);
+        if (!s->parity_rows->initialize()) {
+            printf("Not enough memory for the parity row cache of FragmentationSession %d\n", index);
+            DeleteFragDecoder(index);
+            return false;
+        }
+
+        s->params.Redundancy = redundancy;
+
+        const FragmentBitmap* received = s->digest->get_received();
+        if (received->get_count() == 0) return true;
+
+        // the fragments are in flash already, the decoder only needs to know about them
+        s->decoder_flash->set_replay(true);
+
+        uint8_t buffer[255];
+        for (uint16_t frameCounter = 1; frameCounter <= s->params.NbFrag; frameCounter++) {
+            if (!received->get(frameCounter)) continue;
+
+            s->flash->read(buffer, s->opts.FlashOffset + (frameCounter - 1) * s->params.FragSize, s->params.FragSize);
+
+            result = s->session->process_frame(frameCounter, buffer, s->params.FragSize);
+            if (result != FRAG_OK) {
+                printf("FragmentationSession %d process_frame %d failed: %s\n",
+                    index, frameCounter, FragmentationSession::frag_result_string(result));
+                DeleteFragDecoder(index);
+                return false;
+            }
+        }
+
+        s->decoder_flash->set_replay(s->replaying);
+
+        printf("FragmentationSession %d lost a fragment, decoder started with %d fragments (redundancy %d)\n",
+            index, received->get_count(), redundancy);
+        return true;
+    }
+
+    /**
+     * Allocate the flash decoder of a fragmentation session, the uncoded fragments that were received
+     * on the fast path are in flash already
+     *
+     * @returns true if the decoder is ready for the next fragment
+     */
+    bool StartFragFlashDecoder(uint8_t index) {
+        FragSession_t* s = &frag_sessions[index];
+
+        // the decoder drops the rows that don't fit in the scratch region, so it has to hold all of them
+        if (s->params.Redundancy > GetFragScratchRows(index)) {
+            printf("Scratch region of session %d holds %lu parity rows, not %d\n",
+                index, GetFragScratchRows(index), s->params.Redundancy);
+            return false;
+        }
+
+        s->opts.RedundancyPackets = s->params.Redundancy;
+
+        FragResult result;
+        while (true) {
+            s->flash_decoder = new FragmentationFlashDecoder(s->decoder_flash, s->opts, &at45, GetFragScratchAddress(index), s->cache_rows);
+            result = s->flash_decoder->initialize();
+            if (result == FRAG_OK) break;
+
+            delete s->flash_decoder;
+            s->flash_decoder = NULL;
+
+            if (result != FRAG_NO_MEMORY || s->cache_rows <= 1) {
+                printf("FragmentationFlashDecoder could not initialize! %d %s\n", result, FragmentationSession::frag_result_string(result));
+                return false;
+            }
+
+            // the estimate was too optimistic (e.g. fragmented heap), retry with a smaller cache
+            s->cache_rows--;
+        }
+
+        const FragmentBitmap* received = s->digest->get_received();
+        for (uint16_t frameCounter = 1; frameCounter <= s->params.NbFrag; frameCounter++) {
+            if (received->get(frameCounter)) {
+                s->flash_decoder->mark_received(frameCounter);
+            }
+        }
+
+        printf("FragmentationSession %d started the flash decoder with %d fragments (%d parity rows, %d cached)\n",
+            index, received->get_count(), s->params.Redundancy, s->cache_rows);
+        return true;
+    }
+
+    /**
+     * Process a data fragment of a session: on the fast path uncoded fragments go straight to flash, after
+     * the first lost fragment everything goes through the decoder. Uncoded fragments also go into the
+     * running CRC64 / SHA256.
+     */
+    FragResult ProcessFragment(uint8_t index, uint16_t frameCounter, uint8_t* data, size_t size) {
+        FragSession_t* s = &frag_sessions[index];
+
+        // a gap in the frame counters means a fragment was lost, which only the redundancy packets can recover
+        if (s->fast_path && frameCounter > s->last_frame_counter + 1) {
+            if (StartFragDecoder(index)) {
+                s->fast_path = false;
+            }
+            else {
+                printf("FragmentationSession %d continues without a decoder, lost fragments need a repair\n", index);
+            }
+        }
+
+        FragResult result;
+        if (!s->fast_path) {
+            result = s->flash_decoder != NULL ? s->flash_decoder->process_frame(frameCounter, data, size) :
+                s->session->process_frame(frameCounter, data, size);
+        }
+        else if (size != s->opts.FragmentSize) {
+            result = FRAG_SIZE_INCORRECT;
+        }
+        else if (frameCounter == 0 || frameCounter > s->opts.NumberOfFragments || s->digest->get_received()->get(frameCounter)) {
+            result = FRAG_OK;
+        }
+        else if (!s->replaying && s->flash->program(data, s->opts.FlashOffset + (frameCounter - 1) * size, size) != BD_ERROR_OK) {
+            result = FRAG_FLASH_WRITE_ERROR;
+        }
+        else {
+            s->digest->process_fragment(frameCounter, data, size);
+            result = s->digest->get_received()->get_count() == s->opts.NumberOfFragments ? FRAG_COMPLETE : FRAG_OK;
+        }
+
+        if (result != FRAG_OK && result != FRAG_COMPLETE) return result;
+
+        if (!s->fast_path) {
+            if (frameCounter <= s->opts.NumberOfFragments) {
+                s->digest->process_fragment(frameCounter, data, size);
+            }
+            // only remember the frame, its parity row is generated when FRAG_STATUS_REQ needs it
+            else if (result == FRAG_OK && s->parity_frames != NULL && s->parity_count < s->params.Redundancy) {
+                s->parity_frames[s->parity_count++] = frameCounter - s->opts.NumberOfFragments;
+            }
+        }
+
+        s->frames_received++;
+        if (frameCounter > s->last_frame_counter) {
+            s->last_frame_counter = frameCounter;
+        }
+
+        return result;
+    }
+
+    /**
+     * Called when a fragmentation session has all fragments. Hashes the data block and asks the network to authenticate it.
+     */
+    void CompleteFragSession(uint8_t frag_index, uint16_t frameCounter) {
+        FragSession_t* s = &frag_sessions[frag_index];
+
+        printf("FragmentationSession %d is complete at frame %d\n", frag_index, frameCounter);
+
+        // program the last partially filled page, the rest of the application reads the AT45 directly
+        s->flash->sync();
+
+        const RxFrameQueueStats_t* rx_stats = rx_queue.get_stats();
+        printf("Rx queue: %lu frames, %lu dropped, %lu under backpressure, peak depth %lu, max processing time %lu us\n",
+            rx_stats->queued, rx_stats->dropped, rx_stats->backpressure, rx_stats->peak_depth, rx_stats->process_us_max);
+        uint16_t lost = GetFragLostCount(s);
+        printf("Lost %d frames in session %d%s\n", lost, frag_index, s->fast_path ? " (fast path)" : "");
+        if (s->flash_decoder != NULL) {
+            printf("Flash decoder of session %d: %lu parity row cache hits, %lu misses, %u rows dropped (scratch region full)\n",
+                frag_index, s->flash_decoder->get_cache_hits(), s->flash_decoder->get_cache_misses(),
+                s->flash_decoder->get_dropped_row_count());
+        }
+        if (s->parity_rows != NULL) {
+            printf("Parity rows of session %d: %lu cache hits, %lu generated\n",
+                frag_index, s->parity_rows->get_hits(), s->parity_rows->get_misses());
+        }
+        DeleteFragDecoder(frag_index);
+        s->fast_path = false;
+
+        ClearFragCheckpoint(frag_index);
+
+        mbed_stats_heap_t heap_stats;
+        mbed_stats_heap_get(&heap_stats);
+        printf("Heap stats: Used %lu / %lu bytes\n", heap_stats.current_size, heap_stats.reserved_size);
+
+        // The CRC and SHA256 of the file were calculated while the fragments came in, only the part
+        // after the first lost fragment needs to be read back from flash
+        // CRC64 of the original file is 150eff2bcd891e18 (see fake-fw/test-crc64/main.cpp)
+        uint64_t crc_res;
+        unsigned char sha_out_buffer[32];
+        s->digest->finish(&crc_res, sha_out_buffer);
+
+        printf("Hash is %08llx (read back %u bytes from %s)\n", crc_res, s->digest->get_catchup_bytes(), s->in_ram ? "RAM" : "flash");
+        printf("Spent %lu ms in flash since the session (or the first concurrent one) was set up\n", at45.get_total_us() / 1000);
+        at45.print();
+
+        delete s->digest;
+        s->digest = NULL;
+
+        uint32_t size = (s->opts.NumberOfFragments * s->opts.FragmentSize) - s->opts.Padding;
+        if (s->in_ram) {
+            printf("Data block %d is %lu bytes in RAM\n", frag_index, size);
+            data_block_cb(frag_index, static_cast<RamBlockDevice*>(s->flash)->get_buffer(), size);
+        }
+        else if (frag_index != FOTA_FRAG_SESSION) {
+            printf("Data block %d is %lu bytes at offset %lu\n", frag_index, size, s->opts.FlashOffset);
+        }
+
+        delete s->flash;
+        s->flash = NULL;
+        s->in_ram = false;
+
+        if (frag_index == FOTA_FRAG_SESSION && delta_patch.is_running()) {
+            printf("Patched %lu of %lu bytes of the diff while receiving\n",
+                (uint32_t)delta_patch.get_diff_offset(), size - FOTA_SIGNATURE_LENGTH);
+
+            // without a lost fragment patching kept up with the diff, so the firmware is ready before the
+            // network authenticates it. Otherwise it catches up between frames, or on DATA_BLOCK_AUTH_ANS.
+            if (lost == 0) {
+                delta_patch.finish(&at45);
+            }
+        }
+
+        if (frag_index == FOTA_FRAG_SESSION) {
+            // Write the parameters to flash; but don't set update_pending yet (only after verification by the network)
+            UpdateParams_t update_params;
+            update_params.update_pending = 0;
+            update_params.size = size - FOTA_SIGNATURE_LENGTH;
+            update_params.offset = s->opts.FlashOffset + FOTA_SIGNATURE_LENGTH;
+            update_params.signature = UpdateParams_t::MAGIC;
+            memcpy(update_params.sha256_hash, sha_out_buffer, sizeof(sha_out_buffer));
+            WriteUpdateParams(&update_params);
+        }
+
+        std::vector<uint8_t>* ack = new std::vector<uint8_t>();
+        ack->push_back(DATA_BLOCK_AUTH_REQ);
+        ack->push_back(frag_index); // fragindex
+
+        uint8_t* crc_buff = (uint8_t*)&crc_res;
+        ack->push_back(crc_buff[0]);
+        ack->push_back(crc_buff[1]);
+        ack->push_back(crc_buff[2]);
+        ack->push_back(crc_buff[3]);
+        ack->push_back(crc_buff[4]);
+        ack->push_back(crc_buff[5]);
+        ack->push_back(crc_buff[6]);
+        ack->push_back(crc_buff[7]);
+
+        send_msg_cb(201, ack);
+
+        if (MBED_CONF_APP_FRAG_TELEMETRY) {
+            SendFragTelemetry(frag_index);
+        }
+
+        if (MBED_CONF_APP_FRAG_FLASH_STATS) {
+            SendFlashStats(frag_index);
+        }
+    }
+
+    /**
+     * Send the reception statistics of a fragmentation session, so the network can tune the redundancy
+     * and data rate for the gateways that serve this device
+     */
+    void SendFragTelemetry(uint8_t frag_index) {
+        FragSession_t* s = &frag_sessions[frag_index];
+
+        // e.g. completed from the checkpoint after a reset
+        if (s->telemetry.get_frames() == 0) return;
+
+        uint8_t telemetry[FRAG_TELEMETRY_SIZE];
+        size_t length = s->telemetry.encode(telemetry, sizeof(telemetry));
+
+        printf("FragmentationSession %d telemetry: %d fragments, %d loss bursts\n",
+            frag_index, s->telemetry.get_frames(), s->telemetry.get_bursts());
+
+        std::vector<uint8_t>* msg = new std::vector<uint8_t>();
+        msg->push_back(FRAG_TELEMETRY);
+        msg->push_back(frag_index);
+        msg->insert(msg->end(), telemetry, telemetry + length);
+        send_msg_cb(201, msg);
+    }
+
+    /**
+     * Send the flash statistics (operations, bytes, time and latency histograms of the AT45) since the
+     * session was set up, so the network can tell whether flash or the radio limits the session. Sessions
+     * that receive at the same time share them, they are only reset when the first one is set up.
+     */
+    void SendFlashStats(uint8_t frag_index) {
+        uint8_t stats[INSTRUMENTED_BD_STATS_SIZE];
+        size_t length = at45.encode(stats, sizeof(stats));
+
+        std::vector<uint8_t>* msg = new std::vector<uint8_t>();
+        msg->push_back(FLASH_STATS);
+        msg->push_back(frag_index);
+        msg->insert(msg->end(), stats, stats + length);
+        send_msg_cb(201, msg);
+    }
+
+    /**
+     * Send the fragment size that tiles the flash pages, and the page size. This is a separate message,
+     * FRAG_SESSION_SETUP_ANS stays as the specification defines it.
+     */
+    void SendFragGeometry(uint8_t frag_index, uint8_t preferred_size) {
+        std::vector<uint8_t>* msg = new std::vector<uint8_t>();
+        msg->push_back(FRAG_GEOMETRY);
+        msg->push_back(frag_index);
+        msg->push_back(preferred_size);
+        msg->push_back(geometry.get_page_size() & 0xff);
+        msg->push_back((geometry.get_page_size() >> 8) & 0xff);
+        send_msg_cb(201, msg);
+    }
+
+    /**
+     * Answer FRAG_STATUS_REQ with the number of received and missing fragments, followed by
+     * the runs of missing uncoded fragments (see FragmentBitmap::encode_missing_runs), so the network
+     * can repair the session with unicast downlinks.
+     *
+     * @param all_participants If false, only answer when fragments are missing
+     */
+    void SendFragStatus(uint8_t frag_index, bool all_participants) {
+        FragSession_t* s = &frag_sessions[frag_index];
+
+        uint16_t nb_received;
+        uint8_t missing;
+        uint8_t status = 0;
+        uint8_t runs[MBED_CONF_APP_FRAG_STATUS_MAX_SIZE - FRAG_STATUS_ANS_LENGTH];
+        size_t runs_length = 0;
+
+        if (IsFragSessionActive(s)) {
+            // during the multicast window, fragments after the last one received were not sent yet,
+            // outside of it they are lost as well
+            uint16_t last = s->last_frame_counter;
+            if (cls != 'C' || last > s->params.NbFrag) {
+                last = s->params.NbFrag;
+            }
+
+            const FragmentBitmap* received = s->digest->get_received();
+            uint16_t missing_uncoded = last > received->get_count() ? last - received->get_count() : 0;
+            uint16_t recoverable = CountRecoverableFragments(s, last);
+            uint16_t needed = missing_uncoded > recoverable ? missing_uncoded - recoverable : 0;
+
+            bool truncated;
+            runs_length = received->encode_missing_runs(last, runs, sizeof(runs), &truncated);
+
+            nb_received = s->frames_received;
+            missing = needed > 255 ? 255 : needed;
+
+            // the flash decoder drops rows when its scratch region is full
+            if (missing_uncoded > s->params.Redundancy ||
+                    (s->flash_decoder != NULL && s->flash_decoder->get_dropped_row_count() > 0)) {
+                status |= FRAG_STATUS_ANS_NOT_ENOUGH_MEMORY;
+            }
+            if (truncated) {
+                status |= FRAG_STATUS_ANS_MISSING_TRUNCATED;
+            }
+        }
+        else if (s->received) {
+            // completed, waiting for DATA_BLOCK_AUTH_ANS
+            nb_received = s->params.NbFrag;
+            missing = 0;
+        }
+        else {
+            printf("No FragmentationSession %d, not answering FRAG_STATUS_REQ\n", frag_index);
+            return;
+        }
+
+        if (missing == 0 && !all_participants) return;
+
+        printf("FragmentationSession %d: received %d, missing %d, %u bytes of missing runs\n", frag_index, nb_received, missing, runs_length);
+
+        std::vector<uint8_t>* ack = new std::vector<uint8_t>();
+        ack->push_back(FRAG_STATUS_ANS);
+        ack->push_back(nb_received & 0xff);
+        ack->push_back(((nb_received >> 8) & 0x3f) | (frag_index << 6));
+        ack->push_back(missing);
+        ack->push_back(status);
+        ack->insert(ack->end(), runs, runs + runs_length);
+        send_msg_cb(201, ack);
+    }
+
+    /**
+     * Number of missing uncoded fragments that the redundancy frames received so far can recover: every
+     * redundancy frame that covers at least one missing fragment. This is an upper bound, rows that
+     * are linear combinations of each other recover less.
+     *
+     * @param last Only count fragments up to and including this index as missing
+     */
+    uint16_t CountRecoverableFragments(FragSession_t* s, uint16_t last) {
+        // every stored row of the flash decoder recovers exactly one missing fragment
+        if (s->flash_decoder != NULL) return s->flash_decoder->get_pivot_count();
+
+        if (s->parity_count == 0) return 0;
+
+        const FragmentBitmap* received = s->digest->get_received();
+        uint16_t recoverable = 0;
+
+        // the network asks again while it repairs the session, the first rows are generated only once
+        for (uint16_t ix = 0; ix < s->parity_count; ix++) {
+            const uint8_t* row = s->parity_rows->get(s->parity_frames[ix]);
+            for (uint16_t index = 1; index <= last; index++) {
+                if (!received->get(index) && FragmentationParityRows::get_bit(row, index)) {
+                    recoverable++;
+                    break;
+                }
+            }
+        }
+
+        return recoverable;
+    }
+
+    /**
+     * Delete a fragmentation session (if any), and program what it left in the page cache
+     */
+    void DeleteFragSession(uint8_t index) {
+        FragSession_t* s = &frag_sessions[index];
+
+        if (index == FOTA_FRAG_SESSION) {
+            erase_ahead.cancel();
+            delta_patch.cancel();
+        }
+
+        DeleteFragDecoder(index);
+
+        if (s->digest != NULL) {
+            delete s->digest;
+            s->digest = NULL;
+        }
+        if (s->flash != NULL) {
+            s->flash->sync();
+            delete s->flash;
+            s->flash = NULL;
+        }
+        s->received = false;
+        s->fast_path = false;
+        s->decode_in_flash = false;
+        s->in_ram = false;
+        s->cache_rows = 0;
+        s->checkpoint = false;
+        s->resumed = false;
+        s->checkpoint_frames = 0;
+        s->patch_checked = false;
+        s->frames_received = 0;
+        s->last_frame_counter = 0;
+        s->frags_per_page = 0;
+        s->telemetry.reset();
+    }
+
+    /**
+     * Delete the decoder of a fragmentation session (if any)
+     */
+    void DeleteFragDecoder(uint8_t index) {
+        FragSession_t* s = &frag_sessions[index];
+
+        if (s->session != NULL) {
+            delete s->session;
+            s->session = NULL;
+        }
+        if (s->flash_decoder != NULL) {
+            delete s->flash_decoder;
+            s->flash_decoder = NULL;
+        }
+        if (s->decoder_flash != NULL) {
+            delete s->decoder_flash;
+            s->decoder_flash = NULL;
+        }
+        if (s->parity_frames != NULL) {
+            free(s->parity_frames);
+            s->parity_frames = NULL;
+        }
+        if (s->parity_rows != NULL) {
+            delete s->parity_rows;
+            s->parity_rows = NULL;
+        }
+        s->parity_count = 0;
+    }
+
+    /**
+     * Program the fragments in the page cache, and then record them in the checkpoint of the session
+     */
+    void SaveFragCheckpoint(uint8_t index) {
+        FragSession_t* s = &frag_sessions[index];
+
+        s->flash->sync();
+
+        int r = FragmentationCheckpoint(&at45, GetFragCheckpointAddress(index)).save(s->digest->get_received());
+        if (r != BD_ERROR_OK) {
+            printf("Failed to checkpoint FragmentationSession %d (%d)\n", index, r);
+        }
+
+        s->checkpoint_frames = 0;
+    }
+
+    /**
+     * Whether the slot table has a checkpoint slot for a fragmentation session, sessions without one
+     * are not checkpointed
+     */
+    bool HasFragCheckpointSlot(uint8_t index) {
+        return slot_table.find(FLASH_SLOT_CHECKPOINT, index) != NULL;
+    }
+
+    /**
+     * Address of the checkpoint of a fragmentation session, only call when HasFragCheckpointSlot()
+     */
+    bd_addr_t GetFragCheckpointAddress(uint8_t index) {
+        return geometry.get_address(slot_table.find(FLASH_SLOT_CHECKPOINT, index)->first_page);
+    }
+
+    /**
+     * Bytes in the checkpoint slot of a fragmentation session, only call when HasFragCheckpointSlot()
+     */
+    bd_size_t GetFragCheckpointSlotSize(uint8_t index) {
+        return geometry.get_address(slot_table.find(FLASH_SLOT_CHECKPOINT, index)->page_count);
+    }
+
+    /**
+     * Clear the checkpoint of a fragmentation session (if it has a checkpoint slot)
+     */
+    void ClearFragCheckpoint(uint8_t index) {
+        if (!HasFragCheckpointSlot(index)) return;
+
+        FragmentationCheckpoint(&at45, GetFragCheckpointAddress(index)).clear();
+    }
+
+    /**
+     * Whether a fragmentation session is still receiving fragments, on the fast path or through the decoder
+     */
+    bool IsFragSessionActive(FragSession_t* s) {
+        return s->session != NULL || s->flash_decoder != NULL || s->fast_path;
+    }
+
+    /**
+     * Largest fragment size up to frag_size that tiles the flash pages exactly. The flash regions of the
+     * sessions start on a page, so every page then holds whole fragments and is programmed in one go.
+     */
+    uint8_t GetPreferredFragSize(uint8_t frag_size) {
+        bd_size_t page_size = geometry.get_page_size();
+
+        for (uint8_t size = frag_size; size > 1; size--) {
+            if (page_size % size == 0) return size;
+        }
+        return 1;
+    }
+
+    /**
+     * Address of the scratch region of a fragmentation session, for the parity rows of the flash decoder.
+     * Sessions without a scratch slot are decoded in RAM (see SetupFragSession).
+     */
+    bd_addr_t GetFragScratchAddress(uint8_t index) {
+        return geometry.get_address(slot_table.find(FLASH_SLOT_SCRATCH, index)->first_page);
+    }
+
+    /**
+     * Number of parity rows of the flash decoder that the scratch region of a fragmentation session holds
+     */
+    uint32_t GetFragScratchRows(uint8_t index) {
+        FragSession_t* s = &frag_sessions[index];
+
+        bd_size_t stride = FragmentationFlashDecoder::get_record_stride(s->params.NbFrag, s->params.FragSize, geometry.get_page_size());
+        return geometry.get_address(slot_table.find(FLASH_SLOT_SCRATCH, index)->page_count) / stride;
+    }
+
+    /**
+     * Put the flash in deep power-down when no fragmentation session is receiving and it is not being
+     * erased. The next access wakes it up, so this only costs a wake-up when there is work again.
+     */
+    void PowerDownFlashIfIdle() {
+        if (!MBED_CONF_APP_FLASH_POWER_DOWN || at45_power.is_powered_down()) return;
+        if (GetActiveFragSessionCount() > 0 || erase_ahead.is_running() || delta_patch.is_running()) return;
+
+        int r = at45_power.power_down();
+        if (r != BD_ERROR_OK) {
+            printf("Failed to put the flash in deep power-down (%d)\n", r);
+        }
+    }
+
+    /**
+     * Idle handler of the Rx worker thread: erase ahead of the firmware session, or patch the firmware
+     * with the part of the diff that arrived
+     *
+     * @returns true if there is more to do
+     */
+    bool RxIdleStep() {
+        return EraseAheadStep() || DeltaPatchStep();
+    }
+
+    /**
+     * Erase the next few pages for StartEraseAhead()
+     *
+     * @returns true if there is more to erase
+     */
+    bool EraseAheadStep() {
+        if (erase_ahead.step()) return true;
+
+        if (erase_ahead.is_ready()) {
+            printf("Erased %lu bytes ahead of the firmware session\n", (uint32_t)erase_ahead.get_erased());
+        }
+        else if (erase_ahead.get_error() != BD_ERROR_OK) {
+            printf("Erasing ahead of the firmware session failed (%d)\n", erase_ahead.get_error());
+        }
+        return false;
+    }
+
+    /**
+     * Patch the firmware with the next part of the diff that arrived (frag-delta-stream). While the session
+     * receives, the diff is read through its page cache up to the first missing fragment, and after it
+     * completed from flash.
+     *
+     * @returns true if there is more to patch with the part of the diff that arrived
+     */
+    bool DeltaPatchStep() {
+        if (!MBED_CONF_APP_FRAG_DELTA_STREAM) return false;
+
+        FragSession_t* s = &frag_sessions[FOTA_FRAG_SESSION];
+
+        BlockDevice* bd;
+        bd_size_t received;
+        if (IsFragSessionActive(s)) {
+            bd = s->flash;
+            received = s->digest->get_offset();
+        }
+        else if (s->received) {
+            // complete, waiting for DATA_BLOCK_AUTH_ANS
+            bd = &at45;
+            received = (s->opts.NumberOfFragments * s->opts.FragmentSize) - s->opts.Padding;
+        }
+        else {
+            return false;
+        }
+
+        if (received < FOTA_SIGNATURE_LENGTH) return false;
+
+        if (!s->patch_checked) {
+            StartDeltaPatch(bd);
+        }
+
+        if (!delta_patch.is_running()) return false;
+
+        if (delta_patch.step(bd, received - FOTA_SIGNATURE_LENGTH, DELTA_PATCH_STREAM_STEP_BYTES)) return true;
+
+        if (delta_patch.get_error() != BD_ERROR_OK) {
+            printf("Patching the firmware while receiving failed (%d), it is patched on DATA_BLOCK_AUTH_ANS\n", delta_patch.get_error());
+        }
+        PowerDownFlashIfIdle();
+        return false;
+    }
+
+    /**
+     * Read the header of the firmware that is received, and if it is a diff, start patching it into the
+     * receive slot the session is not in
+     */
+    void StartDeltaPatch(BlockDevice* bd) {
+        FragSession_t* s = &frag_sessions[FOTA_FRAG_SESSION];
+        s->patch_checked = true;
+
+        UpdateSignature_t header;
+        if (bd->read(&header, s->opts.FlashOffset, FOTA_SIGNATURE_LENGTH) != BD_ERROR_OK) return;
+
+        uint8_t* diff_info = (uint8_t*)&header.diff_info;
+        if (diff_info[0] != 1) return;
+
+        bd_size_t old_size = (diff_info[1] << 16) + (diff_info[2] << 8) + diff_info[3];
+        bd_addr_t diff_address = s->opts.FlashOffset + FOTA_SIGNATURE_LENGTH;
+        bd_size_t diff_size = (s->opts.NumberOfFragments * s->opts.FragmentSize) - s->opts.Padding - FOTA_SIGNATURE_LENGTH;
+
+        const FlashSlot_t* old_fw_slot = slot_table.find(FLASH_SLOT_OLD_FW, 0);
+        const FlashSlot_t* target_slot = GetFirmwarePatchSlot(diff_address);
+        if (!old_fw_slot || !target_slot) {
+            printf("No flash slots to patch the firmware while it is received\n");
+            return;
+        }
+
+        if (!delta_patch.start(diff_address, diff_size, geometry.get_address(old_fw_slot->first_page), old_size,
+                geometry.get_address(target_slot->first_page), geometry.get_address(target_slot->page_count))) {
+            printf("Not enough memory to patch the firmware while it is received\n");
+            return;
+        }
+
+        printf("Firmware is a diff of %lu bytes, patching it into receive slot %d while it is received\n",
+            (uint32_t)diff_size, target_slot->index);
+    }
+
+    /**
+     * Finish the firmware that was patched while the diff came in (frag-delta-stream)
+     *
+     * @param update_params Parameters of the diff, changed to the patched firmware
+     * @returns false if the diff was not patched while it came in, or that failed
+     */
+    bool FinishDeltaPatch(UpdateParams_t* update_params) {
+        if (!MBED_CONF_APP_FRAG_DELTA_STREAM || delta_patch.get_diff_address() != update_params->offset) return false;
+        if (!delta_patch.is_running() && !delta_patch.is_complete()) return false;
+
+        bd_size_t applied = delta_patch.get_diff_offset();
+        int r = delta_patch.finish(&at45);
+        if (r != BD_ERROR_OK) {
+            debug("Patching the firmware while receiving failed (%d)\n", r);
+            return false;
+        }
+
+        debug("Patched firmware length is %lu, caught up with %lu bytes of the diff\n",
+            (uint32_t)delta_patch.get_target_size(), (uint32_t)(update_params->size - applied));
+
+        update_params->offset = delta_patch.get_target_address();
+        update_params->size = delta_patch.get_target_size();
+        return true;
+    }
+
+    /**
+     * Patch the firmware with janpatch, from the complete diff in flash
+     *
+     * @param update_params Parameters of the diff, changed to the patched firmware
+     * @param old_size Size of the running firmware the diff applies to
+     * @returns false if the firmware could not be patched
+     */
+    bool ApplyDeltaUpdate(UpdateParams_t* update_params, int old_size) {
+        // the bootloader keeps a copy of the running firmware, patch it into the receive slot that
+        // does not hold the diff
+        const FlashSlot_t* old_fw_slot = slot_table.find(FLASH_SLOT_OLD_FW, 0);
+        const FlashSlot_t* target_slot = GetFirmwarePatchSlot(update_params->offset);
+        if (!old_fw_slot || !target_slot) {
+            debug("No flash slots to patch the firmware\n");
+            return false;
+        }
+        bd_addr_t old_fw_address = geometry.get_address(old_fw_slot->first_page);
+        bd_addr_t target_address = geometry.get_address(target_slot->first_page);
+
+        // calculate sha256 hash for current fw (for debug purposes)
+        unsigned char sha_out_buff[32];
+        calculate_sha256(&at45, old_fw_address, old_size, sha_out_buff);
+        debug("Current firmware hash: ");
+        print_sha256(sha_out_buff);
+
+        // so now use JANPatch
+        printf("source start=%llu size=%d\n", old_fw_address, old_size);
+        BDFILE source(&at45, old_fw_address, old_size);
+        printf("diff start=%lu size=%u\n", update_params->offset, update_params->size);
+        BDFILE diff(&at45, update_params->offset, update_params->size);
+        printf("target start=%llu (receive slot %d)\n", target_address, target_slot->index);
+        BDFILE target(&at45, target_address, 0);
+
+        int v = apply_delta_update(&at45, geometry.get_page_size(), &source, &diff, &target);
+
+        if (v != MBED_DELTA_UPDATE_OK) {
+            debug("apply_delta_update failed %d\n", v);
+            return false;
+        }
+
+        debug("Patched firmware length is %ld\n", target.ftell());
+
+        update_params->offset = target_address;
+        update_params->size = target.ftell();
+        return true;
+    }
+
+    /**
+     * Receive slot a firmware diff is patched into: the one the diff is not in. The package that was in
+     * it before was installed by the bootloader, or rejected, already.
+     *
+     * @returns NULL if the slot table has no two receive slots
+     */
+    const FlashSlot_t* GetFirmwarePatchSlot(bd_addr_t diff_address) {
+        const FlashSlot_t* a = slot_table.find(FLASH_SLOT_RECEIVE, 0);
+        const FlashSlot_t* b = slot_table.find(FLASH_SLOT_RECEIVE, 1);
+        if (a == NULL || b == NULL) return NULL;
+
+        return slot_table.contains(a, diff_address) ? b : a;
+    }
+
+    /**
+     * Number of fragmentation sessions that are still receiving fragments
+     */
+    uint8_t GetActiveFragSessionCount() {
+        uint8_t count = 0;
+        for (size_t ix = 0; ix < FRAG_SESSION_MAX; ix++) {
+            if (IsFragSessionActive(&frag_sessions[ix])) count++;
+        }
+        return count;
+    }
+
+    /**
+     * Heap that the sessions on the fast path need when they lose a fragment and start their decoder
+     */
+    size_t GetFragDecoderHeapPending() {
+        size_t size = 0;
+        for (size_t ix = 0; ix < FRAG_SESSION_MAX; ix++) {
+            FragSession_t* s = &frag_sessions[ix];
+            if (!s->fast_path) continue;
+
+            if (s->decode_in_flash) {
+                size += frag_flash_decoder_heap_size(s->params.NbFrag, s->params.FragSize, s->params.Redundancy, s->cache_rows);
+            }
+            else {
+                size += frag_session_heap_size(s->params.NbFrag, s->params.FragSize, s->params.Redundancy);
+            }
+        }
+        return size;
+    }
+
+    /**
+     * Number of uncoded fragments a session lost so far
+     */
+    uint16_t GetFragLostCount(FragSession_t* s) {
+        if (s->session != NULL) return s->session->get_lost_frame_count();
+        if (s->flash_decoder != NULL) return s->flash_decoder->get_lost_frame_count();
+
+        // on the fast path (or when the decoder could not start), fragments before the last one that are not received
+        uint16_t last = s->last_frame_counter > s->params.NbFrag ? s->params.NbFrag : s->last_frame_counter;
+        uint16_t count = s->digest->get_received()->get_count();
+        return last > count ? last - count : 0;
+    }
+
+    /**
+     * Flash slot of a fragmentation session: a receive slot for the firmware, otherwise the data block slot
+     *
+     * @returns NULL if the slot table has no slot for the session
+     */
+    const FlashSlot_t* GetFragSessionSlot(uint8_t index) {
+        if (index == FOTA_FRAG_SESSION) return GetFirmwareReceiveSlot();
+
+        return slot_table.find(FLASH_SLOT_DATA_BLOCK, index);
+    }
+
+    /**
+     * Receive slot for the next firmware package: the one that does not hold the update in the update
+     * parameters, so that stays valid until the new package is complete. The choice only changes when
+     * a package completes, so a session that resumes after a reset gets the same slot.
+     */
+    const FlashSlot_t* GetFirmwareReceiveSlot() {
+        const FlashSlot_t* a = slot_table.find(FLASH_SLOT_RECEIVE, 0);
+        const FlashSlot_t* b = slot_table.find(FLASH_SLOT_RECEIVE, 1);
+        if (a == NULL || b == NULL) return a != NULL ? a : b;
+
+        UpdateParams_t update_params;
+        if (ReadUpdateParams(&update_params) && slot_table.contains(a, update_params.offset)) return b;
+        return a;
+    }
+
+    /**
+     * The current update parameters: the newest record in the journal, or (on a device that was updated
+     * by an earlier release) the ones on the info page
+     *
+     * @returns false if there are none
+     */
+    bool ReadUpdateParams(UpdateParams_t* params) {
+        if (journal && journal->read(params)) return true;
+
+        at45.read(params, geometry.get_address(FOTA_INFO_PAGE), sizeof(UpdateParams_t));
+        return params->signature == UpdateParams_t::MAGIC;
+    }
+
+    /**
+     * Append the update parameters to the journal. The bootloader only reads the info page, so that is
+     * only programmed when there is an update for it to install. The device resets right after that,
+     * so that update is not appended to the journal as well: it keeps the package that was received,
+     * which is all ReadUpdateParams is needed for after the reset.
+     */
+    void WriteUpdateParams(const UpdateParams_t* params) {
+        if (params->update_pending) {
+            at45.program(params, geometry.get_address(FOTA_INFO_PAGE), sizeof(UpdateParams_t));
+            return;
+        }
+
+        int r = journal ? journal->write(params) : BD_ERROR_DEVICE_ERROR;
+        if (r != BD_ERROR_OK) {
+            printf("Failed to append the update parameters to the journal (%d)\n", r);
+            at45.program(params, geometry.get_address(FOTA_INFO_PAGE), sizeof(UpdateParams_t));
+        }
+    }
+
+    /**
+     * First AT45 page of the flash region of a fragmentation session
+     */
+    uint32_t GetFragSessionPage(uint8_t index) {
+        const FlashSlot_t* slot = GetFragSessionSlot(index);
+        return slot != NULL ? slot->first_page : 0;
+    }
+
+    /**
+     * Number of AT45 pages in the flash region of a fragmentation session
+     */
+    uint32_t GetFragSessionPageCount(uint8_t index) {
+        const FlashSlot_t* slot = GetFragSessionSlot(index);
+        return slot != NULL ? slot->page_count : 0;
+    }
+
+    void InvokeClassCSwitch() {
+        // no frag_session? abort
+        if (GetActiveFragSessionCount() == 0) {
+            logError("Refusing class C switch. No frag_session");
+            return;
+        }
+
+        class_switch_cb('C');
+    }
+
+    void InvokeClassASwitch() {
+        class_switch_cb('A');
+    }
+
+    void ClassCTimeout() {
+        if (cls == 'C') {
+            logInfo("Class C Timeout");
+
+            InvokeClassASwitch();
+        }
+    }
+
+    void HandleMacEvent(LoRaMacEventFlags* flags, LoRaMacEventInfo* info) {
+
+        if (mts::MTSLog::getLogLevel() == mts::MTSLog::TRACE_LEVEL) {
+            std::string msg = "OK";
+            switch (info->Status) {
+                case LORAMAC_EVENT_INFO_STATUS_ERROR:
+                    msg = "ERROR";
+                    break;
+                case LORAMAC_EVENT_INFO_STATUS_TX_TIMEOUT:
+                    msg = "TX_TIMEOUT";
+                    break;
+                case LORAMAC_EVENT_INFO_STATUS_RX_TIMEOUT:
+                    msg = "RX_TIMEOUT";
+                    break;
+                case LORAMAC_EVENT_INFO_STATUS_RX_ERROR:
+                    msg = "RX_ERROR";
+                    break;
+                case LORAMAC_EVENT_INFO_STATUS_JOIN_FAIL:
+                    msg = "JOIN_FAIL";
+                    break;
+                case LORAMAC_EVENT_INFO_STATUS_DOWNLINK_FAIL:
+                    msg = "DOWNLINK_FAIL";
+                    break;
+                case LORAMAC_EVENT_INFO_STATUS_ADDRESS_FAIL:
+                    msg = "ADDRESS_FAIL";
+                    break;
+                case LORAMAC_EVENT_INFO_STATUS_MIC_FAIL:
+                    msg = "MIC_FAIL";
+                    break;
+                default:
+                    break;
+            }
+            logTrace("Event: %s", msg.c_str());
+
+            logTrace("Flags Tx: %d Rx: %d RxData: %d RxSlot: %d LinkCheck: %d JoinAccept: %d",
+                     flags->Bits.Tx, flags->Bits.Rx, flags->Bits.RxData, flags->Bits.RxSlot, flags->Bits.LinkCheck, flags->Bits.JoinAccept);
+            logTrace("Info: Status: %d ACK: %d Retries: %d TxDR: %d RxPort: %d RxSize: %d RSSI: %d SNR: %d Energy: %d Margin: %d Gateways: %d",
+                     info->Status, info->TxAckReceived, info->TxNbRetries, info->TxDatarate, info->RxPort, info->RxBufferSize,
+                     info->RxRssi, info->RxSnr, info->Energy, info->DemodMargin, info->NbGateways);
+        }
+
+        if (flags->Bits.Rx) {
+
+            logDebug("Rx %d bytes", info->RxBufferSize);
+            if (info->RxBufferSize > 0) {
+                if (cls == 'C') {
+                    class_c_cancel_timeout.attach(callback(this, &RadioEvent::ClassCTimeout), class_c_cancel_s);
+                }
+
+                // Forward the data to the target MCU
+                // logInfo("PacketRx port=%d, size=%d, rssi=%d, FPending=%d", info->RxPort, info->RxBufferSize, info->RxRssi, 0);
+                // logInfo("Rx data: %s", mts::Text::bin2hexString(info->RxBuffer, info->RxBufferSize).c_str());
+
+                // Process MAC events ourselves
+                if (info->RxPort == 200) {
+                    processMulticastMacCommand(flags, info);
+                }
+                else if (info->RxPort == 201) {
+                    processFragmentationMacCommand(flags, info);
+                }
+
+                // received frames are handled on the Rx worker thread, like all other flash access
+                PowerDownFlashIfIdle();
+            }
+        }
+    }
+
+
+    Callback<void(uint8_t, std::vector<uint8_t>*)> send_msg_cb;
+    Callback<void(char)> class_switch_cb;
+    Callback<void(uint8_t, const uint8_t*, size_t)> data_block_cb;
+    UplinkEvent_t uplinkEvents[10];
+
+    McClassCSessionParams_t class_c_session_params;
+    McGroupSetParams_t class_c_group_params;
+
+    LoRaWANCredentials_t class_a_credentials;
+    LoRaWANCredentials_t class_c_credentials;
 
     Timeout class_c_start_timeout;
     Timeout class_c_cancel_timeout;
     uint32_t class_c_cancel_s;
 
-    AT45BlockDevice at45;
-    FragmentationSession* frag_session;
-    FragmentationSessionOpts_t frag_opts;
+    RxFrameQueue rx_queue;
+
+    AT45BlockDevice at45_device;
+    PipelinedAT45BlockDevice at45_pipelined;    // page programs through both SRAM buffers, see flash-pipelined-program
+    PowerDownBlockDevice at45_power;    // deep power-down while the FOTA subsystem is idle
+    InstrumentedBlockDevice at45;       // all flash access goes through here, so it is counted
+    FlashGeometry geometry;             // pages of at45
+    FlashSlotTable slot_table;
+    UpdateParamsJournal* journal;       // NULL if the slot table has no journal
+    FlashEraseAhead erase_ahead;        // region of the firmware session, only used on the Rx worker thread
+    DeltaPatchStream delta_patch;       // firmware diff that is received, only used on the Rx worker thread
+    FragSession_t frag_sessions[FRAG_SESSION_MAX];
 
     bool join_succeeded;
     char cls;
-    bool has_received_frag_session;
 };
 
 #endif
@@ -0,0 +1,103 @@
+/*
+* PackageLicenseDeclared: Apache-2.0
+* Copyright (c) 2017 ARM Limited
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*     http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+
+#ifndef __RAM_BLOCK_DEVICE_H__
+#define __RAM_BLOCK_DEVICE_H__
+
+#include "mbed.h"
+#include "BlockDevice.h"
+
+/**
+ * Block device in a heap buffer. Fragmentation sessions for small data blocks are reassembled in
+ * one, so their fragments never touch the AT45. Reads and programs have byte granularity, like the
+ * AT45 driver, so the decoder and the digest use it the same way.
+ */
+class RamBlockDevice : public BlockDevice {
+public:
+    RamBlockDevice(bd_size_t asize) : buffer(NULL), buffer_size(asize)
+    {
+    }
+
+    virtual ~RamBlockDevice() {
+        if (buffer) free(buffer);
+    }
+
+    virtual int init() {
+        if (buffer == NULL) {
+            buffer = (uint8_t*)malloc(buffer_size);
+            if (buffer == NULL) return BD_ERROR_DEVICE_ERROR;
+
+            memset(buffer, 0xff, buffer_size);
+        }
+        return BD_ERROR_OK;
+    }
+
+    virtual int deinit() {
+        return BD_ERROR_OK;
+    }
+
+    virtual int read(void* b, bd_addr_t addr, bd_size_t size) {
+        if (buffer == NULL || addr + size > buffer_size) return BD_ERROR_DEVICE_ERROR;
+
+        memcpy(b, buffer + addr, size);
+        return BD_ERROR_OK;
+    }
+
+    virtual int program(const void* b, bd_addr_t addr, bd_size_t size) {
+        if (buffer == NULL || addr + size > buffer_size) return BD_ERROR_DEVICE_ERROR;
+
+        memcpy(buffer + addr, b, size);
+        return BD_ERROR_OK;
+    }
+
+    virtual int erase(bd_addr_t addr, bd_size_t size) {
+        if (buffer == NULL || addr + size > buffer_size) return BD_ERROR_DEVICE_ERROR;
+
+        memset(buffer + addr, 0xff, size);
+        return BD_ERROR_OK;
+    }
+
+    virtual bd_size_t get_read_size() const {
+        return 1;
+    }
+
+    virtual bd_size_t get_program_size() const {
+        return 1;
+    }
+
+    virtual bd_size_t get_erase_size() const {
+        return 1;
+    }
+
+    virtual bd_size_t size() const {
+        return buffer_size;
+    }
+
+    /**
+     * Contents of the block device, NULL before init()
+     */
+    const uint8_t* get_buffer() const {
+        return buffer;
+    }
+
+private:
+    uint8_t* buffer;
+    bd_size_t buffer_size;
+};
+
+#endif
@@ -0,0 +1,103 @@
+/*
+* PackageLicenseDeclared: Apache-2.0
+* Copyright (c) 2017 ARM Limited
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*     http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#ifndef __REPLAY_BLOCK_DEVICE_H__
+#define __REPLAY_BLOCK_DEVICE_H__
+
+#include "mbed.h"
+#include "BlockDevice.h"
+
+/**
+ * Passes everything to another block device, except programs while replay is on.
+ *
+ * The decoder of a fragmentation session starts when the first fragment is lost (or when a session
+ * resumes after a reset), and the uncoded fragments that are in flash already are fed to it again.
+ * The decoder programs them back to the same address, which on the AT45 is an erase and program of every
+ * page. The data is there already, so those programs are skipped. A decoder without redundancy frames
+ * only programs the uncoded fragments it gets, so nothing else is lost.
+ */
+class ReplayBlockDevice : public BlockDevice {
+public:
+    ReplayBlockDevice(BlockDevice* abd) : bd(abd), replay(false), skipped(0)
+    {
+    }
+
+    virtual int init() {
+        return bd->init();
+    }
+
+    virtual int deinit() {
+        return bd->deinit();
+    }
+
+    virtual int sync() {
+        return bd->sync();
+    }
+
+    virtual int read(void* b, bd_addr_t addr, bd_size_t size) {
+        return bd->read(b, addr, size);
+    }
+
+    virtual int program(const void* b, bd_addr_t addr, bd_size_t size) {
+        if (replay) {
+            skipped++;
+            return BD_ERROR_OK;
+        }
+        return bd->program(b, addr, size);
+    }
+
+    virtual int erase(bd_addr_t addr, bd_size_t size) {
+        return bd->erase(addr, size);
+    }
+
+    virtual bd_size_t get_read_size() const {
+        return bd->get_read_size();
+    }
+
+    virtual bd_size_t get_program_size() const {
+        return bd->get_program_size();
+    }
+
+    virtual bd_size_t get_erase_size() const {
+        return bd->get_erase_size();
+    }
+
+    virtual bd_size_t size() const {
+        return bd->size();
+    }
+
+    /**
+     * Skip programs (the fragments that are fed to the decoder are in flash already), or stop skipping them
+     */
+    void set_replay(bool areplay) {
+        replay = areplay;
+    }
+
+    /**
+     * Number of programs that were skipped
+     */
+    uint32_t get_skipped() const {
+        return skipped;
+    }
+
+private:
+    BlockDevice* bd;
+    bool replay;
+    uint32_t skipped;
+};
+
+#endif
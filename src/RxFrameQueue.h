@@ -0,0 +1,223 @@
+/*
+* PackageLicenseDeclared: Apache-2.0
+* Copyright (c) 2017 ARM Limited
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*     http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#ifndef __RX_FRAME_QUEUE_H__
+#define __RX_FRAME_QUEUE_H__
+
+#include "mbed.h"
+#include "mDotEvent.h"
+#include "platform/mbed_critical.h"
+
+typedef struct {
+    uint32_t queued;            // frames accepted from the MAC
+    uint32_t dropped;           // frames dropped because the queue was full
+    uint32_t backpressure;      // frames that arrived while the worker was still busy with an earlier frame
+    uint32_t peak_depth;        // highest number of frames waiting at the same time
+    uint32_t process_us_max;    // longest time the worker spent on a single frame
+    uint64_t process_us_total;  // total time the worker spent processing frames
+} RxFrameQueueStats_t;
+
+/**
+ * Bounded queue between the LoRaMAC callback and a worker thread.
+ *
+ * The MAC callback copies the received frame into a free slot and returns immediately,
+ * the worker thread then calls the handler for every frame in order. This keeps flash writes
+ * and logging out of the MAC context, so they cannot make us miss the next receive window.
+ *
+ * There is a single producer (the MAC) and a single consumer (the worker). While no frames are waiting,
+ * the worker can do background work in small steps (see schedule_idle).
+ */
+class RxFrameQueue {
+public:
+    typedef Callback<void(LoRaMacEventFlags*, LoRaMacEventInfo*)> handler_t;
+    typedef Callback<bool()> idle_handler_t;
+
+    RxFrameQueue(handler_t ahandler)
+        : handler(ahandler), frames_available(0), worker_thread(osPriorityAboveNormal, MBED_CONF_APP_RX_WORKER_STACK_SIZE),
+          head(0), tail(0), busy(false), idle_pending(false), rx_us(0)
+    {
+        memset(&stats, 0, sizeof(RxFrameQueueStats_t));
+    }
+
+    /**
+     * Start the worker thread
+     */
+    void start() {
+        clock.start();
+        worker_thread.start(callback(this, &RxFrameQueue::worker));
+    }
+
+    /**
+     * Set the handler for background work. It does one small step at a time, and returns whether
+     * there is more to do.
+     */
+    void set_idle_handler(idle_handler_t ahandler) {
+        idle_handler = ahandler;
+    }
+
+    /**
+     * Call the idle handler on the worker thread, between frames, until it returns false
+     */
+    void schedule_idle() {
+        idle_pending = true;
+
+        // wake up the worker, it finds no frame and goes to the idle handler
+        frames_available.release();
+    }
+
+    /**
+     * Copy a received frame into the queue. Safe to call from the MAC callback.
+     *
+     * @returns true if the frame was queued, false if it was dropped because the queue is full
+     */
+    bool push(LoRaMacEventFlags* flags, LoRaMacEventInfo* info) {
+        core_util_critical_section_enter();
+
+        uint32_t depth = head - tail;
+        if (depth >= MBED_CONF_APP_RX_QUEUE_DEPTH) {
+            stats.dropped++;
+            core_util_critical_section_exit();
+            return false;
+        }
+
+        if (depth > 0 || busy) {
+            stats.backpressure++;
+        }
+
+        RxFrame_t* frame = &slots[head % MBED_CONF_APP_RX_QUEUE_DEPTH];
+        frame->flags = *flags;
+        frame->info = *info;
+        memcpy(frame->data, info->RxBuffer, info->RxBufferSize);
+        frame->info.RxBuffer = frame->data;
+        frame->rx_us = clock.read_us();
+
+        head++;
+        stats.queued++;
+        if (depth + 1 > stats.peak_depth) {
+            stats.peak_depth = depth + 1;
+        }
+
+        core_util_critical_section_exit();
+
+        frames_available.release();
+        return true;
+    }
+
+    /**
+     * Wait until all queued frames have been processed
+     *
+     * @param timeout_ms Maximum time to wait
+     * @returns true if the queue is idle, false on timeout
+     */
+    bool wait_idle(uint32_t timeout_ms) {
+        for (uint32_t waited = 0; waited <= timeout_ms; waited++) {
+            if (head == tail && !busy) return true;
+            wait_ms(1);
+        }
+        return false;
+    }
+
+    /**
+     * Number of frames that are waiting for the worker
+     */
+    uint32_t get_depth() {
+        return head - tail;
+    }
+
+    const RxFrameQueueStats_t* get_stats() {
+        return &stats;
+    }
+
+    /**
+     * Most stack the worker thread has used so far, out of MBED_CONF_APP_RX_WORKER_STACK_SIZE
+     */
+    uint32_t get_max_stack() {
+        return worker_thread.max_stack();
+    }
+
+    /**
+     * Time (in microseconds since start, wraps) at which the frame that the handler is processing was
+     * received from the MAC
+     */
+    uint32_t get_rx_time_us() {
+        return rx_us;
+    }
+
+private:
+    typedef struct {
+        LoRaMacEventFlags flags;
+        LoRaMacEventInfo info;
+        uint8_t data[255];
+        uint32_t rx_us;
+    } RxFrame_t;
+
+    void worker() {
+        Timer t;
+        t.start();
+
+        while (true) {
+            if (!idle_pending) {
+                frames_available.wait();
+            }
+            else if (frames_available.wait(0) == 0) {
+                idle_pending = idle_handler ? idle_handler() : false;
+                continue;
+            }
+
+            // woken up by schedule_idle()
+            if (head == tail) continue;
+
+            RxFrame_t* frame = &slots[tail % MBED_CONF_APP_RX_QUEUE_DEPTH];
+            busy = true;
+
+            rx_us = frame->rx_us;
+
+            t.reset();
+            handler(&frame->flags, &frame->info);
+            uint32_t elapsed = t.read_us();
+
+            stats.process_us_total += elapsed;
+            if (elapsed > stats.process_us_max) {
+                stats.process_us_max = elapsed;
+            }
+
+            // only now release the slot, the handler reads straight from it
+            core_util_critical_section_enter();
+            tail++;
+            busy = false;
+            core_util_critical_section_exit();
+        }
+    }
+
+    handler_t handler;
+    idle_handler_t idle_handler;
+    Semaphore frames_available;
+    Thread worker_thread;
+
+    RxFrame_t slots[MBED_CONF_APP_RX_QUEUE_DEPTH];
+    volatile uint32_t head;
+    volatile uint32_t tail;
+    volatile bool busy;
+    volatile bool idle_pending;
+
+    Timer clock;
+    uint32_t rx_us;             // receive time of the frame being handled
+
+    RxFrameQueueStats_t stats;
+};
+
+#endif
@@ -23,10 +23,23 @@
 #define _MBED_FOTA_UPDATE_PARAMS
 
 // These values need to be the same between target application and bootloader!
+// The application only uses the pages other than FOTA_INFO_PAGE and FOTA_DIFF_OLD_FW_PAGE for the default
+// layout of the flash slot table (see FlashSlotTable.h), which is stored on FLASH_SLOT_TABLE_PAGE.
+// Pages are 528 bytes, or 512 bytes when the AT45 is in binary page mode. Addresses are page * page size
+// (see FlashGeometry.h), so the bootloader has to use the same mode.
+#define     FLASH_SLOT_TABLE_PAGE  0x17E7                       // The flash slot table, on its own page (the bootloader does not read it)
+#define     FOTA_JOURNAL_PAGE      0x17E8                       // Ring of UpdateParams_t records (see UpdateParamsJournal.h) starts at this page
+#define     FOTA_JOURNAL_PAGES     8                            // Number of pages in the ring
+#define     FRAG_CHECKPOINT_PAGE   0x17F0                       // Checkpoints of running fragmentation sessions start at this page
+#define     FRAG_CHECKPOINT_PAGES  4                            // Number of pages per checkpoint (session parameters + bitmap of 16383 fragments with 528 byte pages, 16280 with 512)
 #define     FOTA_INFO_PAGE         0x1800                       // The information page for the firmware update
-#define     FOTA_UPDATE_PAGE       0x1801                       // The update starts at this page (and then continues)
-#define     FOTA_DIFF_OLD_FW_PAGE  0x2100
-#define     FOTA_DIFF_TARGET_PAGE  0x2500
+#define     FOTA_UPDATE_PAGE       0x1801                       // The update starts at this page (and then continues), receive slot A
+#define     FOTA_DIFF_OLD_FW_PAGE  0x2100                       // Copy of the running firmware, written by the bootloader
+#define     FOTA_DIFF_TARGET_PAGE  0x2500                       // Receive slot B, also the target of a diff received in slot A
+#define     FRAG_DATA_BLOCK_PAGE   0x2900                       // Data blocks (fragmentation sessions 1..3) start at this page
+#define     FRAG_DATA_BLOCK_PAGES  0x100                        // Number of pages per data block
+#define     FRAG_SCRATCH_PAGE      0x2C00                       // Parity rows of fragmentation sessions that decode in flash start at this page
+#define     FRAG_SCRATCH_PAGES     0x400                        // Number of scratch pages per fragmentation session
 #define     FOTA_SIGNATURE_LENGTH  sizeof(UpdateSignature_t)    // Length of ECDSA signature + class UUIDs + diff struct (5 bytes) -> matches sizeof(UpdateSignature_t)
 
 // This structure is shared between the bootloader and the target application
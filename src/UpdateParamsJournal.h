@@ -0,0 +1,159 @@
+/*
+* PackageLicenseDeclared: Apache-2.0
+* Copyright (c) 2017 ARM Limited
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*     http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+
+#ifndef __UPDATE_PARAMS_JOURNAL_H__
+#define __UPDATE_PARAMS_JOURNAL_H__
+
+#include "mbed.h"
+#include "BlockDevice.h"
+#include "UpdateParameters.h"
+
+typedef struct {
+    uint32_t sequence;                  // one higher than the record before it, 0xFFFFFFFF is erased flash
+    UpdateParams_t params;
+    uint32_t crc;                       // CRC32 over sequence and params
+} UpdateParamsRecord_t;
+
+/**
+ * Append-only journal of UpdateParams_t records in a ring of flash pages, one record per page.
+ *
+ * Every write goes to the next page in the ring, so the pages wear evenly instead of rewriting one
+ * page for every change. The valid record with the highest sequence number is the current one. The
+ * AT45 programs a whole page (erase included) even for a small record, so a write that is interrupted
+ * can destroy everything on its page. That page holds the oldest record of the ring, it fails its CRC
+ * or reads as erased, and the current record on the page before it stays current.
+ */
+class UpdateParamsJournal {
+public:
+    /**
+     * @param abd Block device the journal is on
+     * @param aaddress Address of the first page of the ring
+     * @param apages Number of pages in the ring
+     */
+    UpdateParamsJournal(BlockDevice* abd, bd_addr_t aaddress, uint32_t apages)
+        : bd(abd), address(aaddress), pages(apages), loaded(false), sequence(0), next_record(0)
+    {
+    }
+
+    /**
+     * Read the current record
+     *
+     * @returns false if the journal has no valid record
+     */
+    bool read(UpdateParams_t* params) {
+        if (!loaded) load();
+        if (sequence == 0) return false;
+
+        UpdateParamsRecord_t record;
+        uint32_t current = next_record == 0 ? get_record_count() - 1 : next_record - 1;
+        if (!read_record(current, &record)) return false;
+
+        *params = record.params;
+        return true;
+    }
+
+    /**
+     * Append a record, which becomes the current one
+     */
+    int write(const UpdateParams_t* params) {
+        if (!loaded) load();
+        if (get_record_count() == 0) return BD_ERROR_DEVICE_ERROR;
+
+        UpdateParamsRecord_t record;
+        memset(&record, 0, sizeof(record));
+        record.sequence = sequence + 1;
+        record.params = *params;
+        record.crc = crc32(&record, offsetof(UpdateParamsRecord_t, crc));
+
+        int r = bd->program(&record, get_record_address(next_record), sizeof(record));
+        if (r != BD_ERROR_OK) return r;
+
+        sequence = record.sequence;
+        next_record = (next_record + 1) % get_record_count();
+        return BD_ERROR_OK;
+    }
+
+    /**
+     * Sequence number of the current record, 0 if there is none
+     */
+    uint32_t get_sequence() {
+        if (!loaded) load();
+        return sequence;
+    }
+
+private:
+    /**
+     * Find the current record, the next one is written after it
+     */
+    void load() {
+        loaded = true;
+        sequence = 0;
+        next_record = 0;
+
+        UpdateParamsRecord_t record;
+        for (uint32_t ix = 0; ix < get_record_count(); ix++) {
+            if (!read_record(ix, &record) || record.sequence <= sequence) continue;
+
+            sequence = record.sequence;
+            next_record = (ix + 1) % get_record_count();
+        }
+    }
+
+    bool read_record(uint32_t ix, UpdateParamsRecord_t* record) {
+        if (bd->read(record, get_record_address(ix), sizeof(UpdateParamsRecord_t)) != BD_ERROR_OK) return false;
+
+        return record->sequence != 0xFFFFFFFF && record->crc == crc32(record, offsetof(UpdateParamsRecord_t, crc));
+    }
+
+    uint32_t get_record_count() const {
+        return pages;
+    }
+
+    bd_addr_t get_record_address(uint32_t ix) const {
+        return address + (bd_addr_t)ix * bd->get_read_size();
+    }
+
+    static uint32_t crc32(const void* data, size_t length) {
+        // nibble table for the reflected CRC-32 polynomial (0xEDB88320)
+        static const uint32_t table[16] = {
+            0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac,
+            0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c,
+            0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c,
+            0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c
+        };
+
+        const uint8_t* bytes = (const uint8_t*)data;
+        uint32_t c = 0xFFFFFFFF;
+        for (size_t ix = 0; ix < length; ix++) {
+            c ^= bytes[ix];
+            c = (c >> 4) ^ table[c & 0xf];
+            c = (c >> 4) ^ table[c & 0xf];
+        }
+        return ~c;
+    }
+
+    BlockDevice* bd;
+    bd_addr_t address;
+    uint32_t pages;
+
+    bool loaded;
+    uint32_t sequence;                  // of the current record
+    uint32_t next_record;               // index of the record that is written next
+};
+
+#endif
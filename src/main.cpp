@@ -70,9 +70,15 @@ mDot* dot = NULL;
 // // fwd declaration
 void send_mac_msg(uint8_t port, vector<uint8_t>* data);
 void class_switch(char cls);
+void post_mac_msg(uint8_t port, vector<uint8_t>* data);
+void post_class_switch(char cls);
+
+// RadioEvent handles frames on its Rx worker thread (and switches back to class A from a Timeout),
+// its callbacks are posted here and run on the main thread, which owns message_queue and the dot
+static EventQueue main_queue;
 
 // Custom event handler for automatically displaying RX data
-RadioEvent radio_events(&send_mac_msg, &class_switch);
+RadioEvent radio_events(&post_mac_msg, &post_class_switch);
 
 typedef struct {
     uint8_t port;
@@ -312,6 +318,24 @@ void class_switch(char cls) {
     }
 }
 
+void post_mac_msg(uint8_t port, std::vector<uint8_t>* data) {
+    if (main_queue.call(&send_mac_msg, port, data) == 0) {
+        logError("Event queue full, dropping MAC message on port %d", port);
+        delete data;
+    }
+}
+
+void post_class_switch(char cls) {
+    if (main_queue.call(&class_switch, cls) == 0) {
+        logError("Event queue full, dropping class switch to %c", cls);
+    }
+}
+
+// small data blocks (see frag-ram-sink-max-size) arrive here instead of in flash
+void data_block_received(uint8_t index, const uint8_t* data, size_t size) {
+    logInfo("data block %d received (%u bytes)", index, size);
+}
+
 DigitalOut led(LED1);
 void blink() {
     led = !led;
@@ -334,6 +358,7 @@ int main() {
 
     // attach the custom events handler
     dot->setEvents(&radio_events);
+    radio_events.SetDataBlockCallback(&data_block_received);
 
     if (!dot->getStandbyFlag()) {
         // start from a well-known state
@@ -381,6 +406,9 @@ int main() {
         dot->restoreNetworkSession();
     }
 
+    // continue fragmentation sessions that were interrupted by a reset
+    radio_events.ResumeFragSessions();
+
     mbed_stats_heap_t heap_stats;
     mbed_stats_heap_get(&heap_stats);
     printf("Heap stats: Used %lu / %lu bytes\n", heap_stats.current_size, heap_stats.reserved_size);
@@ -435,11 +463,11 @@ int main() {
 
         // @todo: in class A can go to deepsleep, in class C cannot
         if (in_class_c_mode) {
-            wait(sleep_time);
+            main_queue.dispatch(sleep_time * 1000);
             continue; // for now just send as fast as possible
         }
         else {
-            wait(sleep_time); // @todo, wait for all frames to be processed before going to sleep. need a wakelock.
+            main_queue.dispatch(sleep_time * 1000); // @todo, wait for all frames to be processed before going to sleep. need a wakelock.
             // sleep_wake_rtc_or_interrupt(10, deep_sleep);
         }
     }